@@ -191,7 +191,7 @@ void initStream(StreamInfo * stream, DiskInfo * info, Hash hostId)
 
 
    data->buffer =
-       (char *)aligned_malloc(LOG_HEAD_SIZE + LOG_HEAD_MAX_BLOCKS * BLKSIZE);
+       (char *)aligned_malloc(LOG_MAX_ENTRY_SIZE);
    data->headleft = LOG_HEAD_SIZE;
    data->bodyleft = 0;
    data->buf_offs = 0;
@@ -986,10 +986,9 @@ static size_t data_callback(void *ptr, size_t size, size_t nmemb, void *data)
          d->headleft -= take;
          inputleft -= take;
 
-         if (d->headleft == 0) {
+         if (d->headleft == 0 && d->buf_offs == LOG_HEAD_SIZE) {
             /* tiny sanity check */
-            if (head->tag == log_entry_type
-                && head->update.num_blocks > LOG_HEAD_MAX_BLOCKS) {
+            if (head->tag == log_entry_type && !log_entry_extent_valid(head)) {
                Hash id, parent;
                LogFS_HashSetRaw(&id, head->id);
                LogFS_HashSetRaw(&parent, head->parent);
@@ -997,13 +996,17 @@ static size_t data_callback(void *ptr, size_t size, size_t nmemb, void *data)
                exit(1);
             }
 
+            /* Large entries continue with overflow refs blocks */
+            d->headleft = log_entry_head_size(head) - LOG_HEAD_SIZE;
             d->bodyleft = log_body_size(head);
 
-            if (d->bodyleft > LOG_HEAD_MAX_BLOCKS * BLKSIZE) {
+            if (log_entry_size(head) > LOG_MAX_ENTRY_SIZE) {
                fprintf(stderr, "too large %u\n", d->bodyleft);
                exit(1);
             }
+         }
 
+         if (d->headleft == 0) {
             d->state = 2;
          }
       }
@@ -1,16 +1,21 @@
 files += Split('''
 
-   shalib/sha1-compress.c  shalib/sha1-meta.c  shalib/sha1.c
+   shalib/sha1-compress.c  shalib/sha1-compress-x86.c  shalib/sha1-meta.c  shalib/sha1-multi.c  shalib/crc32c.c
+   shalib/sha1.c
 
    binHeap.c
+   blockCache.c
+   blockClassify.c
    btree.c
    bTreeRange.c
    common.c
    fingerPrint.c
    graph.c
    hashDb.c
+   insIndex.c
    httplib/parseHttp.c
    log.c
+   logRing.c
    logCompactor.c
    logfs.c
    logfsCheckPoint.c
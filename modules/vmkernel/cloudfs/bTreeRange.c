@@ -50,15 +50,16 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  * batching updates to the tree, inserts are batched in ins_buffer[], and only
  * flushed when this runs full or in case of a lookup from a blocking context.
  * Lookups can be served non-blocking from ins_buffer[], or if all involved
- * B-tree nodes are memory resident. When in non-blocking mode, lookups that
- * cause a cache miss will fail and be queued and handled by the rangemap
- * syncer thread.
+ * B-tree nodes are memory resident. Lookups that cause a cache miss start
+ * paging in the node, and are redone when it arrives.
  *
  * The tree is only ever flushed from non-blocking contexts, and flushes are
  * serialized with bt->sem. Normal inserts and lookups can be handled during
  * flush, but replace operations cannot. Thus they are also serialized by
- * bt->sem. Non-blocking lookups that cannot be serviced from ins_buffer[]
- * are postponed to be handled by the syncer thread.
+ * bt->sem. Lookups do not take bt->sem, but read the tree optimistically
+ * and retry if it changed under them, see LogFS_PagedTreeReadBegin(). The
+ * few that cannot be answered that way are postponed to be handled by the
+ * syncer thread.
  *
  *
  */
@@ -73,9 +74,23 @@ typedef struct {
    List_Links next;
 } QueuedLookup;
 
-static List_Links lookupQueue;
-static SP_SpinLock lookupQueueLock;
-static List_Links lookupWaitQueue;
+/* Postponed lookups are answered by a pool of worker threads. Each has its
+ * own queue, which the lookups of a given rangemap always go to, so that
+ * one vdisk waiting for the B-tree does not hold up the others. A worker
+ * that runs out of work steals from the other queues. Workers never wait
+ * for a node to be paged in, but leave the lookup to be redone from the
+ * completion of the page-in, so each can have many page-ins in flight. */
+
+typedef struct {
+   List_Links queue;
+   SP_SpinLock lock;
+   List_Links waitQueue;
+   Bool busy;
+   World_ID world;
+} LookupWorker;
+
+static LookupWorker lookupWorkers[LOGFS_LOOKUP_MAX_WORKERS];
+static uint32 numLookupWorkers;
 
 static List_Links flusherQueue;
 static SP_SpinLock flusherQueueLock;
@@ -86,10 +101,10 @@ static List_Links flusherWaitQueue;
 void LogFS_DelayedLookup(void *data);
 void LogFS_Flusher(void *data);
 void LogFS_KickFlusher(void);
-static void LogFS_KickDelayedLookup(void);
+static void LogFS_QueueDelayedLookup(QueuedLookup *l);
+static void LogFS_BTreeRangeMapResumeLookup(void *data);
 
 static World_ID flusherWorld;
-static World_ID syncerWorld;
 
 static Bool flusherExit = FALSE;
 static Bool syncerExit = FALSE;
@@ -100,20 +115,32 @@ static Bool bTreeInitialized = FALSE;
 void LogFS_BTreeRangeMapPreInit(LogFS_MetaLog *ml)
 {
    VMK_ReturnStatus status;
+   uint32 i;
 
    flusherExit = FALSE;
    syncerExit = FALSE;
    bTreeShutdown = FALSE;
 
-   List_Init(&lookupWaitQueue);
-   SP_InitLock("rangemaplookupq", &lookupQueueLock, SP_RANK_RANGEMAPQUEUES);
-   List_Init(&lookupQueue);
+   numLookupWorkers = MIN(MAX(ml->lookupWorkers, 1), LOGFS_LOOKUP_MAX_WORKERS);
 
-   status = World_NewSystemWorld("logDelayedLookup", 0, WORLD_GROUP_DEFAULT,
-                                 NULL, SCHED_GROUP_PATHNAME_DRIVERS,
-                                 &syncerWorld);
-   ASSERT(status == VMK_OK);
-   Sched_Add(World_Find(syncerWorld), LogFS_DelayedLookup, NULL);
+   for (i = 0; i < numLookupWorkers; i++) {
+      LookupWorker *w = &lookupWorkers[i];
+
+      List_Init(&w->waitQueue);
+      SP_InitLock("rangemaplookupq", &w->lock, SP_RANK_RANGEMAPQUEUES);
+      List_Init(&w->queue);
+      w->busy = FALSE;
+   }
+
+   for (i = 0; i < numLookupWorkers; i++) {
+      LookupWorker *w = &lookupWorkers[i];
+
+      status = World_NewSystemWorld("logDelayedLookup", 0, WORLD_GROUP_DEFAULT,
+                                    NULL, SCHED_GROUP_PATHNAME_DRIVERS,
+                                    &w->world);
+      ASSERT(status == VMK_OK);
+      Sched_Add(World_Find(w->world), LogFS_DelayedLookup, w);
+   }
 
    List_Init(&flusherWaitQueue);
    SP_InitLock("rangemapflushq", &flusherQueueLock, SP_RANK_RANGEMAPQUEUES);
@@ -138,6 +165,8 @@ void LogFS_BTreeRangeStartFlusher(LogFS_MetaLog *ml, uint64 generation)
 
 void LogFS_BTreeRangeMapCleanupGlobalState(LogFS_MetaLog *ml)
 {
+   uint32 i;
+
    if (!bTreeInitialized)
       return;
 
@@ -147,13 +176,17 @@ void LogFS_BTreeRangeMapCleanupGlobalState(LogFS_MetaLog *ml)
    syncerExit = TRUE;
 
    LogFS_KickFlusher();
-   LogFS_KickDelayedLookup();
+   for (i = 0; i < numLookupWorkers; i++) {
+      CpuSched_Wakeup(&lookupWorkers[i].waitQueue);
+   }
 
    /* Threads will reset their exit flags back to false when done */
    World_WaitForExit(flusherWorld);
-   World_WaitForExit(syncerWorld);
+   for (i = 0; i < numLookupWorkers; i++) {
+      World_WaitForExit(lookupWorkers[i].world);
+      SP_CleanupLock(&lookupWorkers[i].lock);
+   }
 
-   SP_CleanupLock(&lookupQueueLock);
    SP_CleanupLock(&flusherQueueLock);
 
    bTreeInitialized = FALSE;
@@ -180,12 +213,16 @@ void LogFS_BTreeRangeMapInit(LogFS_BTreeRangeMap *bt, LogFS_MetaLog *ml,
    Atomic_Write(&bt->producerIndex, 0);
    Atomic_Write(&bt->producerStableIndex, 0);
    Atomic_Write(&bt->numBuffered, 0);
+
+   LogFS_InsIndexInit(&bt->insIndex, MAX_INSERTS);
+   memset(bt->written, 0, sizeof(bt->written));
 }
 
 void LogFS_BTreeRangeMapCleanup(LogFS_BTreeRangeMap *bt)
 {
    Semaphore_Cleanup(&bt->sem);
    SP_CleanupLock(&bt->lock);
+   LogFS_InsIndexCleanup(&bt->insIndex);
    if(bt->tree != NULL) {
       free(bt->tree);
    }
@@ -209,9 +246,21 @@ void LogFS_BTreeRangeMapCreateTrees(
    Semaphore_Lock(&ml->superTreeSemaphore);
 
    if (tree_find(ml->superTree, (elem_t *) e, NULL)) {
+      btree_t *tree;
+      int i;
+
+      /* Lookups trust the written summary as soon as they see the tree */
+
+      SP_Lock(&bt->lock);
+      for (i = 0; i < LOGFS_WRITTEN_SUMMARY_BYTES; i++) {
+         bt->written[i] |= e->value.written[i];
+      }
+      SP_Unlock(&bt->lock);
 
-      bt->tree = LogFS_PagedTreeReOpen(ml,e->value.root);
+      tree = LogFS_PagedTreeReOpen(ml,e->value.root);
       bt->lsnTree = LogFS_PagedTreeReOpen(ml,e->value.lsnRoot);
+      CPU_MemBarrier();
+      bt->tree = tree;
 
    } else {
 
@@ -223,6 +272,10 @@ void LogFS_BTreeRangeMapCreateTrees(
       LogFS_HashCopy(e->value.currentId,currentId);
       LogFS_HashCopy(e->value.entropy,entropy);
 
+      SP_Lock(&bt->lock);
+      memcpy(e->value.written, bt->written, sizeof(e->value.written));
+      SP_Unlock(&bt->lock);
+
       tree_insert(ml->superTree, (elem_t *) e, NULL);
 
       Hash nullId;
@@ -233,12 +286,119 @@ void LogFS_BTreeRangeMapCreateTrees(
    free(e);
 }
 
+/* Note that blocks [from, to[ are being written. bt->lock must be held. */
+
+static void LogFS_BTreeRangeMapMarkWritten(LogFS_BTreeRangeMap *bt,
+      log_block_t from, log_block_t to)
+{
+   log_block_t first = from >> LOGFS_WRITTEN_REGION_SHIFT;
+   log_block_t last = (to - 1) >> LOGFS_WRITTEN_REGION_SHIFT;
+   log_block_t r;
+
+   if (last - first >= LOGFS_WRITTEN_SUMMARY_BYTES * 8) {
+      memset(bt->written, 0xff, sizeof(bt->written));
+      return;
+   }
+
+   for (r = first; r <= last; r++) {
+      uint32 bit = r % (LOGFS_WRITTEN_SUMMARY_BYTES * 8);
+      bt->written[bit / 8] |= 1 << (bit % 8);
+   }
+}
+
+/* Where the run of never written regions that X is in ends, capped at END,
+ * or X if its region may have been written. Only meaningful once bt->tree
+ * is set, and races with nothing but writes to the same blocks. */
+
+static log_block_t LogFS_BTreeRangeMapUnwrittenEnd(LogFS_BTreeRangeMap *bt,
+      log_block_t x, log_block_t end)
+{
+   log_block_t y = x;
+
+   while (y < end) {
+      log_block_t r = y >> LOGFS_WRITTEN_REGION_SHIFT;
+      uint32 bit = r % (LOGFS_WRITTEN_SUMMARY_BYTES * 8);
+
+      if (bt->written[bit / 8] & (1 << (bit % 8))) {
+         break;
+      }
+      y = (r + 1) << LOGFS_WRITTEN_REGION_SHIFT;
+   }
+
+   return MIN(y, end);
+}
+
 static inline void createPagedTree( LogFS_BTreeRangeMap *bt)
 {
    LogFS_BTreeRangeMapCreateTrees(bt,
          bt->diskId, bt->currentId, bt->entropy);
 }
 
+/* Version of the block DELTA blocks into an extent at V */
+
+static inline log_id_t LogFS_VersionAt(log_id_t v, log_block_t delta)
+{
+   if (!is_invalid_version(v)) {
+      v.raw += delta;
+   }
+   return v;
+}
+
+/* N blocks mapped to OLD are about to be mapped to NEW instead, both given
+ * for the first of them. Count the references lost. */
+
+static inline void LogFS_BTreeRangeMapObsolete(LogFS_ObsoletedSegments *os,
+      log_id_t old, log_id_t new, log_block_t n)
+{
+   if (!is_invalid_version(old) && !equal_version(old, new)) {
+      ASSERT(old.v.segment < MAX_NUM_SEGMENTS);
+      LogFS_ObsoletedSegmentsAdd(os, old.v.segment, n);
+   }
+}
+
+static int LogFS_BTreeRangeExtentCmp(const void *a, const void *b)
+{
+   const LogFS_BTreeRangeExtent *x = a;
+   const LogFS_BTreeRangeExtent *y = b;
+
+   if (x->from < y->from)
+      return -1;
+   return (x->from > y->from);
+}
+
+#define LOGFS_FLUSH_RANGES 32
+
+/* Count what the tree has at F as about to be overwritten with F's
+ * version */
+
+static void LogFS_BTreeRangeMapObsoleteInTree(LogFS_BTreeRangeMap *bt,
+      LogFS_ObsoletedSegments *os, const LogFS_BTreeRangeExtent *f)
+{
+   log_block_t j = f->from;
+
+   while (j < f->to) {
+      range_t r[LOGFS_FLUSH_RANGES];
+      log_block_t end;
+      int m, q;
+
+      m = __rangemap_get_range(bt->tree, j, f->to, r, LOGFS_FLUSH_RANGES,
+                               &end, NULL);
+      ASSERT(m > 0);
+
+      for (q = 0; q < m; q++) {
+         log_id_t old;
+         log_block_t rto = (q + 1 < m) ? r[q + 1].from : end;
+
+         old.raw = r[q].version;
+         LogFS_BTreeRangeMapObsolete(os, old,
+               LogFS_VersionAt(f->version, r[q].from - f->from),
+               rto - r[q].from);
+      }
+
+      j = end;
+   }
+}
+
 /* can only be called from a blocking context */
 static void LogFS_BTreeRangeMapFlushLocked(LogFS_BTreeRangeMap *bt)
 {
@@ -255,50 +415,119 @@ static void LogFS_BTreeRangeMapFlushLocked(LogFS_BTreeRangeMap *bt)
    uint32 i;
    uint32 from = Atomic_Read(&bt->consumerIndex);
    uint32 to = Atomic_Read(&bt->producerStableIndex);
+   uint32 n = to - from;
+   int k;
+
+   if (n == 0) {
+      return;
+   }
+
+   /* Rather than applying the inserts to the tree one by one, in the
+    * order they appeared, resolve them in memory first, newest wins, by
+    * painting them onto an index of their own. Blocks an insert takes
+    * over from an older one of the batch are counted as obsoleted right
+    * away. Those it is the first to cover are collected in fresh[], to be
+    * counted against what the tree has there. */
+
+   LogFS_InsIndex batch;
+   LogFS_BTreeRangeExtent *fresh;
+   int numFresh = 0;
 
-   /* flush the inserts in the order they appeared.  it would be
-    * tempting to sort them for better locality, but this would lead
-    * to incorrect results. A better alternative might be to buffer
-    * them in a in-memory rangemap, and then flush the rangemap,
-    * but that would loose information needed for tracking obsolete 
-    * segments.
-    */
+   LogFS_InsIndexInit(&batch, n);
+   fresh = malloc(LOGFS_INSINDEX_NODES(n) * sizeof(LogFS_BTreeRangeExtent));
+   ASSERT(fresh);
 
    for (i = from; i != to; ++i) {
       struct ins_elem *e = &bt->ins_buffer[i % MAX_INSERTS];
-
       log_block_t j;
 
-      /* This insert may clobber existing data in the rangemap.
-       * Count how many valid references where overwritten, and
-       * update the priortity queue of obsoleted segments. */
-
       for (j = e->from; j < e->to;) {
-         log_block_t endsat = MAXBLOCK;
+         log_block_t endsat = e->to;
+         log_block_t pfrom;
+         uint32 tag;
+
+         if (LogFS_InsIndexLookup(&batch, j, &pfrom, &tag, &endsat)) {
+            struct ins_elem *p = &bt->ins_buffer[tag % MAX_INSERTS];
+
+            LogFS_BTreeRangeMapObsolete(os,
+                  LogFS_VersionAt(p->version, j - p->from),
+                  LogFS_VersionAt(e->version, j - e->from), endsat - j);
+         } else {
+            ASSERT(numFresh < LOGFS_INSINDEX_NODES(n));
+            fresh[numFresh].from = j;
+            fresh[numFresh].to = endsat;
+            fresh[numFresh].version = LogFS_VersionAt(e->version,
+                                                      j - e->from);
+            ++numFresh;
+         }
+
+         j = endsat;
+      }
+
+      LogFS_InsIndexPaint(&batch, e->from, e->to, i);
+   }
 
-         log_id_t r;
-         r.raw = rangemap_get(bt->tree, j, &endsat);
-         endsat = MIN(endsat, e->to);
+   /* Apply what is left of the batch in block order, in one sweep with
+    * counting what it overwrites in the tree. Each fresh extent is counted
+    * before any insert that reaches into it, and the inserts do not change
+    * what the tree maps outside of their own range. The counting also
+    * pages in the nodes that the inserts will change, so the tree is only
+    * in flux for as long as each insert takes in memory. */
 
-         if (!is_invalid_version(r) && !(equal_version(r, e->version)) ) {
+   qsort(fresh, numFresh, sizeof(LogFS_BTreeRangeExtent),
+         LogFS_BTreeRangeExtentCmp);
+
+   log_block_t x = 0;
+   k = 0;
+
+   for (;;) {
+      log_block_t endsat = MAXBLOCK;
+      log_block_t sfrom;
+      uint32 tag;
 
-            ASSERT(r.v.segment < MAX_NUM_SEGMENTS);
+      if (LogFS_InsIndexLookup(&batch, x, &sfrom, &tag, &endsat)) {
+         struct ins_elem *e = &bt->ins_buffer[tag % MAX_INSERTS];
+         log_id_t v = LogFS_VersionAt(e->version, x - e->from);
 
-            LogFS_ObsoletedSegmentsAdd(os, r.v.segment, endsat - j);
+         for (; k < numFresh && fresh[k].from < endsat; k++) {
+            LogFS_BTreeRangeMapObsoleteInTree(bt, os, &fresh[k]);
          }
 
-         j = endsat;
+         LogFS_PagedTreeWriteBegin(bt->tree);
+         rangemap_insert(bt->tree, x, endsat, v.raw);
+         LogFS_PagedTreeWriteEnd(bt->tree);
+
+      } else if (endsat == MAXBLOCK) {
+         break;
       }
 
-      rangemap_insert(bt->tree, e->from, e->to, e->version.raw);
+      x = endsat;
+   }
+
+   ASSERT(k == numFresh);
+   free(fresh);
+
+   LogFS_InsIndexCleanup(&batch);
+
+   /* Only now that the tree has all of the batch can lookups stop finding
+    * it in the buffer */
+
+   for (i = from; i != to; ++i) {
+      struct ins_elem *e = &bt->ins_buffer[i % MAX_INSERTS];
+      log_segment_id_t s  = e->version.v.segment;
+      Bool valid = !is_invalid_version(e->version);
+      uint64 lsn = e->lsn;
+
+      SP_Lock(&bt->lock);
+      LogFS_InsIndexRemove(&bt->insIndex, e->from, e->to, i);
+      SP_Unlock(&bt->lock);
 
       Atomic_Dec(&bt->numBuffered);
       Atomic_Inc(&bt->consumerIndex);
 
-      log_segment_id_t s  = e->version.v.segment;
-      if(!is_invalid_version(e->version) && bt->lastLsnSegment != s) {
+      if(valid && bt->lastLsnSegment != s) {
 
-         rangemap_insert(bt->lsnTree, e->lsn, e->lsn+1, s);
+         rangemap_insert(bt->lsnTree, lsn, lsn+1, s);
          bt->lastLsnSegment = s;
 
       }
@@ -398,6 +627,8 @@ void LogFS_BTreeRangeMapInsert(LogFS_BTreeRangeMap *bt,
    elem->from = from;
    elem->to = to;
    elem->version = version;
+   LogFS_BTreeRangeMapMarkWritten(bt, from, to);
+   LogFS_InsIndexPaint(&bt->insIndex, from, to, idx);
 
    /* Make sure elem is globally visible before updating stableIndex */
 
@@ -447,6 +678,8 @@ VMK_ReturnStatus LogFS_BTreeRangeMapInsertSimple(LogFS_BTreeRangeMap *bt,
    elem->from = from;
    elem->to = to;
    elem->version = version;
+   LogFS_BTreeRangeMapMarkWritten(bt, from, to);
+   LogFS_InsIndexPaint(&bt->insIndex, from, to, idx);
 
    /* Make sure elem is globally visible before updating stableIndex */
 
@@ -478,11 +711,16 @@ void LogFS_BTreeRangeMapReplace(LogFS_BTreeRangeMap *bt,
 
    LogFS_BTreeRangeMapFlushLocked(bt);
 
+   LogFS_PagedTreeWriteBegin(bt->tree);
    rangemap_replace(bt->tree, from, to, oldvalue.raw, newvalue.raw);
+   LogFS_PagedTreeWriteEnd(bt->tree);
 
    Semaphore_Unlock(&bt->sem);
 }
 
+/* Look X up among the buffered inserts. On success, RANGE starts at X and
+ * has the version found there. */
+
 VMK_ReturnStatus
 LogFS_BTreeRangeMapLookupInBuffer( LogFS_BTreeRangeMap *bt,
       log_block_t x, 
@@ -490,55 +728,33 @@ LogFS_BTreeRangeMapLookupInBuffer( LogFS_BTreeRangeMap *bt,
       log_block_t * endsat)
 
 {
-   mk_invalid_version(inv);
+   VMK_ReturnStatus status = VMK_NOT_FOUND;
+   log_block_t from;
+   uint32 idx;
 
    if (bTreeShutdown)
       return VMK_NOT_FOUND;
 
-   /* We first check the buffered inserts, before consulting
-    * the B-tree on disk */
-
-   uint32 i;
-   uint32 top;
-   uint32 bottom;
-   log_block_t greatest_less_than_x = 0;
-
-   top = Atomic_Read(&bt->producerStableIndex);
-   bottom = Atomic_Read(&bt->consumerIndex);
-
-   for (i = top; i != bottom;) {
-      --i;
+   SP_Lock(&bt->lock);
 
-      struct ins_elem *e = &bt->ins_buffer[i % MAX_INSERTS];
+   if (LogFS_InsIndexLookup(&bt->insIndex, x, &from, &idx, endsat)) {
+      struct ins_elem *e = &bt->ins_buffer[idx % MAX_INSERTS];
+      log_id_t v = e->version;
 
-      /* ends before x */
-      if (e->to <= x) {
-         greatest_less_than_x = MAX(e->to, greatest_less_than_x);
-      }
+      ASSERT(e->from <= x && x < e->to);
 
-      /* starts after x */
-      else if (x < e->from) {
-         *endsat = MIN(e->from, *endsat);
+      if (!is_invalid_version(v)) {
+         v.v.blk_offset += (x - e->from);
       }
 
-      /* overlaps x -- we have found it */
-      else {
-
-         range->from = MAX(e->from, greatest_less_than_x);
-         *endsat = MIN(e->to, *endsat);
-
-         log_id_t v = e->version;
-
-         if(greatest_less_than_x > e->from) {
-            v.v.blk_offset += (greatest_less_than_x - e->from);
-         }
-
-         range->version = v.raw;
-         return VMK_OK;
-      }
+      range->from = x;
+      range->version = v.raw;
+      status = VMK_OK;
    }
 
-   return VMK_NOT_FOUND;
+   SP_Unlock(&bt->lock);
+
+   return status;
 }
 
 log_id_t LogFS_BTreeRangeMapLookup(LogFS_BTreeRangeMap *bt,
@@ -569,53 +785,262 @@ log_id_t LogFS_BTreeRangeMapLookup(LogFS_BTreeRangeMap *bt,
    return v;
 }
 
-/* In cases where B-tree lookups cannot be answered without blocking (due to
- * nodes being paged in from disk), this thread will retry the lookups from a
- * blocking context */
-
-void LogFS_DelayedLookup(void *data)
+/* Resolve [start, start+len[ into at most MAX extents, in order and
+ * without gaps, holes included. Blocks covered by buffered inserts are
+ * answered from ins_buffer[], regions never written from bt->written, and
+ * the rest from a single optimistic walk of the B-tree, see
+ * LogFS_PagedTreeReadBegin(). The walk is thrown away if
+ * the tree changed before the last look at the buffer, as the flusher may
+ * then have moved inserts from the buffer into the tree in between.
+ *
+ * When the tree has not been created yet, or a tree node is not in
+ * memory, or the tree keeps changing, the extents found so far are
+ * returned, or VMK_WOULD_BLOCK if there are none; the caller should then
+ * fall back to LogFS_BTreeRangeMapAsyncLookup(). This never blocks. */
+
+#define LOGFS_LOOKUP_RANGE_TREE 32
+#define LOGFS_LOOKUP_TRIES 4
+
+VMK_ReturnStatus LogFS_BTreeRangeMapLookupRange(LogFS_BTreeRangeMap *bt,
+      log_block_t start, log_block_t len,
+      LogFS_BTreeRangeExtent *extents, int max,
+      int *numExtents)
 {
-   VMK_ReturnStatus status;
+   range_t tree[LOGFS_LOOKUP_RANGE_TREE];
+   log_block_t end = start + len;
+   int tries;
+   int n = 0;
 
-   for (;;) {
-      SP_Lock(&lookupQueueLock);
+   ASSERT(len > 0);
+   ASSERT(max > 0);
 
-      while (!List_IsEmpty(&lookupQueue)) {
-         List_Links *elem;
+   if (bTreeShutdown) {
+      return VMK_NOT_FOUND;
+   }
 
-         elem = List_First(&lookupQueue);
-         QueuedLookup *l = List_Entry(elem, QueuedLookup, next);
-         List_Remove(elem);
+   for (tries = 0; tries < LOGFS_LOOKUP_TRIES; tries++) {
+      LogFS_PagedTreeReader reader = { NULL };
+      btree_t *t = bt->tree;
+      uint32 seq = 0;
+      Bool usedTree = FALSE;
+      int numTree = 0;
+      int k = 0;
+      log_block_t treeEnd = start;
+      log_block_t x = start;
 
-         log_block_t endsat = l->endsat;
-         LogFS_BTreeRangeMap *bt = l->bt;
+      n = 0;
 
-         SP_Unlock(&lookupQueueLock);
+      if (t != NULL) {
+         seq = LogFS_PagedTreeReadBegin(t);
+      }
 
-         Semaphore_Lock(&bt->sem);
-         if(bt->tree == NULL) {
-            createPagedTree(bt);
+      while (x < end && n < max) {
+         log_block_t endsat = end;
+         log_block_t unwritten = x;
+         range_t range;
+         log_id_t v;
+
+         if (t != NULL) {
+            unwritten = LogFS_BTreeRangeMapUnwrittenEnd(bt, x, end);
          }
 
-         range_t range = {~0,};
-         __rangemap_get(bt->tree, l->block, &range, &endsat, NULL);
-         Semaphore_Unlock(&bt->sem);
+         /* Never written, so in neither the buffer nor the tree. For a
+          * fresh clone this is most reads, which then go to the parent
+          * without looking anything up. */
+
+         if (unwritten > x) {
+            v.raw = ~0ULL;
+            endsat = unwritten;
+         }
+
+         else if (LogFS_BTreeRangeMapLookupInBuffer(bt, x, &range, &endsat) ==
+             VMK_OK) {
+            v.raw = range.version;
+            if (!is_invalid_version(v)) {
+               v.raw += x - range.from;
+            }
+         }
+
+         /* Not buffered, and endsat now says where the next buffered insert
+          * starts. Take the rest from the tree. */
+
+         else {
+            /* not created yet, leave that to the syncer */
+            if (t == NULL) {
+               break;
+            }
+            usedTree = TRUE;
+
+            /* being changed, try again */
+            if (seq & 1) {
+               break;
+            }
+
+            if (x >= treeEnd) {
+               numTree = __rangemap_get_range(t, x, end, tree,
+                                              LOGFS_LOOKUP_RANGE_TREE,
+                                              &treeEnd, &reader);
+               k = 0;
+
+               if (numTree == 0) {
+                  break;
+               }
+            }
+
+            while (k + 1 < numTree && tree[k + 1].from <= x) {
+               ++k;
+            }
+
+            v.raw = tree[k].version;
+            if (!is_invalid_version(v)) {
+               v.raw += x - tree[k].from;
+            }
+            endsat = MIN(endsat, (k + 1 < numTree) ? tree[k + 1].from : treeEnd);
+         }
 
-         l->callback(range, endsat, l->data);
-         free(l);
+         ASSERT(endsat > x);
 
-         SP_Lock(&lookupQueueLock);
+         /* Extend the previous extent if this one simply continues it */
+
+         if (n > 0 && extents[n - 1].to == x &&
+             (is_invalid_version(v) ?
+              is_invalid_version(extents[n - 1].version) :
+              (!is_invalid_version(extents[n - 1].version) &&
+               extents[n - 1].version.raw + (x - extents[n - 1].from) ==
+               v.raw))) {
+            extents[n - 1].to = endsat;
+         } else {
+            extents[n].from = x;
+            extents[n].to = endsat;
+            extents[n].version = v;
+            ++n;
+         }
+
+         x = endsat;
       }
 
-      status =
-          CpuSched_Wait(&lookupWaitQueue, CPUSCHED_WAIT_SCSI, &lookupQueueLock);
-      ASSERT(status == VMK_OK);
+      LogFS_PagedTreeReaderDone(&reader);
+
+      if (!usedTree || !LogFS_PagedTreeReadRetry(t, seq)) {
+         break;
+      }
+      n = 0;
+   }
+
+   *numExtents = n;
+   return (n > 0) ? VMK_OK : VMK_WOULD_BLOCK;
+}
+
+/* Take a lookup off the front of W's queue, or off the back when stealing
+ * from it. NULL if there is none. */
+
+static QueuedLookup *LogFS_LookupWorkerTake(LookupWorker *w, Bool steal)
+{
+   QueuedLookup *l = NULL;
+
+   SP_Lock(&w->lock);
+   if (!List_IsEmpty(&w->queue)) {
+      List_Links *elem = steal ? List_Last(&w->queue) : List_First(&w->queue);
+      l = List_Entry(elem, QueuedLookup, next);
+      List_Remove(elem);
+   }
+   SP_Unlock(&w->lock);
+
+   return l;
+}
+
+/* Answer a postponed lookup, with the tree to itself */
+
+static void LogFS_LookupWorkerProcess(QueuedLookup *l)
+{
+   LogFS_BTreeRangeMap *bt = l->bt;
+   LogFS_PagedTreeReader reader = { NULL };
+   log_block_t endsat = l->endsat;
+   range_t range = {~0,};
+   tree_result_t r;
+
+   Semaphore_Lock(&bt->sem);
+   if(bt->tree == NULL) {
+      createPagedTree(bt);
+   }
+
+   r = __rangemap_get(bt->tree, l->block, &range, &endsat, &reader);
+   Semaphore_Unlock(&bt->sem);
+
+   if (r == tree_result_node_fault) {
+      ASSERT(reader.fault != NULL);
+
+      /* Move on to the next lookup while the node is paged in */
+      if (!LogFS_PagedTreeResumeOnFault(&reader,
+                                        LogFS_BTreeRangeMapResumeLookup, l)) {
+         LogFS_QueueDelayedLookup(l);
+      }
+      return;
+   }
+
+   l->callback(range, endsat, l->data);
+   free(l);
+}
+
+/* In cases where B-tree lookups cannot be answered optimistically, because
+ * the tree does not exist yet or keeps changing, these threads will retry
+ * the lookups from a blocking context, holding bt->sem */
+
+void LogFS_DelayedLookup(void *data)
+{
+   VMK_ReturnStatus status;
+   LookupWorker *w = data;
+   uint32 me = w - lookupWorkers;
+
+   for (;;) {
+      QueuedLookup *l = LogFS_LookupWorkerTake(w, FALSE);
+      uint32 i;
+
+      /* Nothing of our own, so help out the others */
+      for (i = 1; l == NULL && i < numLookupWorkers; i++) {
+         l = LogFS_LookupWorkerTake(&lookupWorkers[(me + i) % numLookupWorkers],
+                                    TRUE);
+      }
+
+      if (l != NULL) {
+         w->busy = TRUE;
+         LogFS_LookupWorkerProcess(l);
+         w->busy = FALSE;
+         continue;
+      }
+
+      SP_Lock(&w->lock);
+      if (List_IsEmpty(&w->queue) && !syncerExit) {
+         status = CpuSched_Wait(&w->waitQueue, CPUSCHED_WAIT_SCSI, &w->lock);
+         ASSERT(status == VMK_OK);
+      } else {
+         SP_Unlock(&w->lock);
+      }
 
       if (syncerExit)
          World_Exit(VMK_OK);
    }
 }
 
+/* Queue L with the worker for its rangemap. If that worker is busy, wake
+ * the next one as well, to steal it. */
+
+static void LogFS_QueueDelayedLookup(QueuedLookup *l)
+{
+   uint32 i = ((uint64)l->bt / sizeof(LogFS_BTreeRangeMap)) %
+              numLookupWorkers;
+   LookupWorker *w = &lookupWorkers[i];
+
+   SP_Lock(&w->lock);
+   List_Insert(&l->next, LIST_ATREAR(&w->queue));
+   SP_Unlock(&w->lock);
+
+   CpuSched_Wakeup(&w->waitQueue);
+   if (w->busy && numLookupWorkers > 1) {
+      CpuSched_Wakeup(&lookupWorkers[(i + 1) % numLookupWorkers].waitQueue);
+   }
+}
+
 /* This thread takes care of flushing B-tree buffers when they run full. */
 
 void LogFS_Flusher(void *data)
@@ -703,6 +1128,11 @@ void LogFS_Flusher(void *data)
          LogFS_HashCopy(e->value.currentId, currentId);
          LogFS_HashCopy(e->value.entropy, entropy);
 
+         /* Covers at least what was just flushed into the tree */
+         SP_Lock(&bt->lock);
+         memcpy(e->value.written, bt->written, sizeof(e->value.written));
+         SP_Unlock(&bt->lock);
+
          r = tree_iter_write(&it,e,NULL);
          ASSERT(r==tree_result_ok);
 
@@ -745,14 +1175,23 @@ abort:
    World_Exit(VMK_OK);
 }
 
-static void LogFS_KickDelayedLookup(void)
+void LogFS_KickFlusher(void)
 {
-   CpuSched_Wakeup(&lookupWaitQueue);
+   CpuSched_Wakeup(&flusherWaitQueue);
 }
 
-void LogFS_KickFlusher(void)
+/* Redo a lookup that ran into a tree node being paged in, from the
+ * completion of the page-in */
+
+static void LogFS_BTreeRangeMapResumeLookup(void *data)
 {
-   CpuSched_Wakeup(&flusherWaitQueue);
+   QueuedLookup *l = data;
+   VMK_ReturnStatus status;
+
+   status = LogFS_BTreeRangeMapAsyncLookup(l->bt, l->block, l->callback,
+                                           l->data, FS_CANTBLOCK, NULL, NULL);
+   ASSERT(status == VMK_OK);
+   free(l);
 }
 
 VMK_ReturnStatus LogFS_BTreeRangeMapAsyncLookup(LogFS_BTreeRangeMap *bt,
@@ -782,32 +1221,66 @@ VMK_ReturnStatus LogFS_BTreeRangeMapAsyncLookup(LogFS_BTreeRangeMap *bt,
    }
 
    else {
-      /* The block was not covered by any buffered inserts, look in the B-tree instead */
+      /* The block was not covered by any buffered inserts, look in the
+       * B-tree instead. This is done optimistically, without bt->sem, so
+       * that lookups need not wait for the flusher. A node that is not in
+       * memory gets paged in, and the lookup is redone from the completion
+       * of that. Only lookups that keep running into tree changes, or into
+       * a tree not created yet, are left to the syncer thread. */
+
+      int postpone = 1;
+      int tries;
+
+      for (tries = 0; tries < LOGFS_LOOKUP_TRIES; tries++) {
+         LogFS_PagedTreeReader reader = { NULL };
+         log_block_t endsat2 = MAXBLOCK;
+         btree_t *t = bt->tree;
+         uint32 seq;
+         tree_result_t r;
 
-      int postpone = 0;
+         if (t == NULL) {
+            break;
+         }
 
-      void *cant_block = (flags & FS_CANTBLOCK) ? (void *)1 : NULL;
+         seq = LogFS_PagedTreeReadBegin(t);
+         if (seq & 1) {
+            continue;
+         }
 
-      if (Semaphore_TryLock(&bt->sem)) {
-         log_block_t endsat2 = MAXBLOCK;
+         r = __rangemap_get(t, x, &range, &endsat2, &reader);
 
-         if (bt->tree != NULL) {
-            tree_result_t r =
-                __rangemap_get(bt->tree, x, &range, &endsat2, cant_block);
+         if (LogFS_PagedTreeReadRetry(t, seq)) {
+            LogFS_PagedTreeReaderDone(&reader);
+            continue;
+         }
 
-            endsat = MIN(endsat2, endsat);
+         if (r == tree_result_node_fault) {
+            if (reader.fault == NULL) {
+               break;
+            }
 
-            if (r == tree_result_node_fault) {
-               postpone = 1;
+            QueuedLookup *l = malloc(sizeof(QueuedLookup));
+            l->bt = bt;
+            l->block = x;
+            l->endsat = endsat;
+            l->callback = callback;
+            l->data = data;
+
+            if (LogFS_PagedTreeResumeOnFault(&reader,
+                                             LogFS_BTreeRangeMapResumeLookup,
+                                             l)) {
+               return VMK_OK;
             }
-         } else {
-            /* the tree has not been created yet, so postpone answering */
-            postpone = 1;
+
+            /* paged in meanwhile */
+            free(l);
+            continue;
          }
 
-         Semaphore_Unlock(&bt->sem);
-      } else
-         postpone = 1;
+         endsat = MIN(endsat2, endsat);
+         postpone = 0;
+         break;
+      }
 
       if (postpone) {
          QueuedLookup *l = malloc(sizeof(QueuedLookup));
@@ -817,11 +1290,7 @@ VMK_ReturnStatus LogFS_BTreeRangeMapAsyncLookup(LogFS_BTreeRangeMap *bt,
          l->callback = callback;
          l->data = data;
 
-         SP_Lock(&lookupQueueLock);
-         List_Insert(&l->next, LIST_ATREAR(&lookupQueue));
-         SP_Unlock(&lookupQueueLock);
-
-         LogFS_KickDelayedLookup();
+         LogFS_QueueDelayedLookup(l);
       }
 
       else {
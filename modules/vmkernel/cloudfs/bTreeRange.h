@@ -37,9 +37,11 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <system.h>
 
 #include "logtypes.h"
+#include "logfsConstants.h"
 // #include "lock.h"
 #include "logfsHash.h"
 #include "obsoleted.h"
+#include "insIndex.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -72,6 +74,15 @@ typedef struct {
 
    Atomic_uint32 numBuffered;
 
+   /* Which buffered insert is the newest for each block, so that lookups
+    * need not scan ins_buffer[]. Protected by lock. */
+   LogFS_InsIndex insIndex;
+
+   /* Regions that may have been written, see LOGFS_WRITTEN_REGION_SHIFT.
+    * Bits are only ever set, under lock, and before the insert that
+    * writes the region becomes visible. Complete once tree is set. */
+   uint8 written[LOGFS_WRITTEN_SUMMARY_BYTES];
+
    Hash diskId;
    uint64 lsn;
    Hash currentId;
@@ -89,6 +100,15 @@ typedef struct {
 
 } LogFS_BTreeRangeMap;
 
+/* One piece of a range lookup: blocks [from, to[ are found at version,
+ * or nowhere if version is invalid. */
+
+typedef struct {
+   log_block_t from;
+   log_block_t to;
+   log_id_t version;
+} LogFS_BTreeRangeExtent;
+
 struct _LogFS_VDisk;
 struct LogFS_MetaLog;
 
@@ -129,6 +149,11 @@ VMK_ReturnStatus LogFS_BTreeRangeMapAsyncLookup(LogFS_BTreeRangeMap *bt,
       range_t* range,
       log_block_t * retEndsAt);
 
+VMK_ReturnStatus LogFS_BTreeRangeMapLookupRange(LogFS_BTreeRangeMap *bt,
+      log_block_t start, log_block_t len,
+      LogFS_BTreeRangeExtent *extents, int max,
+      int *numExtents);
+
 static inline int LogFS_BTreeRangeMapHighWater(LogFS_BTreeRangeMap *bt)
 {
    return ((MAX_INSERTS - Atomic_Read(&bt->numBuffered) < 2048));
@@ -0,0 +1,399 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#include "globals.h"
+#include "common.h"
+#include "blockCache.h"
+
+/* Of the pages, this many percent go to a1in, and a1out remembers as many
+ * evicted pages as there is room for in the cache, plus half of that */
+
+#define LOGFS_BLOCK_CACHE_A1IN_PCT 25
+#define LOGFS_BLOCK_CACHE_A1OUT_PCT 50
+
+static inline uint64
+LogFS_BlockCacheKey(log_segment_id_t segment, uint32 blkOffset)
+{
+   return ((uint64) segment << 20) |
+      (blkOffset & ~(LOGFS_BLOCK_CACHE_PAGE_BLOCKS - 1));
+}
+
+static inline log_segment_id_t
+LogFS_BlockCacheKeySegment(uint64 key)
+{
+   return key >> 20;
+}
+
+static inline uint32
+LogFS_BlockCacheBucket(uint64 key)
+{
+   key /= LOGFS_BLOCK_CACHE_PAGE_BLOCKS;
+   return (key ^ (key >> 15) ^ (key >> 30)) & (LOGFS_BLOCK_CACHE_BUCKETS - 1);
+}
+
+void LogFS_BlockCacheInit(LogFS_BlockCache *bc, uint32 bytes)
+{
+   int i;
+
+   memset(bc, 0, sizeof(LogFS_BlockCache));
+   SP_InitLock("blockcachelock", &bc->lock, SP_RANK_BLOCKCACHE);
+
+   bc->maxPages = bytes / LOGFS_BLOCK_CACHE_PAGE_SIZE;
+   List_Init(&bc->a1in);
+   List_Init(&bc->am);
+   List_Init(&bc->a1out);
+
+   if (bc->maxPages == 0) {
+      return;
+   }
+
+   bc->buckets = malloc(LOGFS_BLOCK_CACHE_BUCKETS *
+                        sizeof(LogFS_BlockCachePage *));
+   bc->segments = malloc(MAX_NUM_SEGMENTS * sizeof(List_Links));
+   bc->generations = malloc(MAX_NUM_SEGMENTS * sizeof(uint32));
+   ASSERT(bc->buckets && bc->segments && bc->generations);
+
+   memset(bc->buckets, 0,
+          LOGFS_BLOCK_CACHE_BUCKETS * sizeof(LogFS_BlockCachePage *));
+   memset(bc->generations, 0, MAX_NUM_SEGMENTS * sizeof(uint32));
+   for (i = 0; i < MAX_NUM_SEGMENTS; i++) {
+      List_Init(&bc->segments[i]);
+   }
+}
+
+static void
+LogFS_BlockCacheFreeQueue(List_Links *queue)
+{
+   List_Links *curr, *next;
+
+   LIST_FORALL_SAFE(queue, curr, next) {
+      LogFS_BlockCachePage *p = List_Entry(curr, LogFS_BlockCachePage, queue);
+      aligned_free(p->data);
+      free(p);
+   }
+}
+
+void LogFS_BlockCacheCleanup(LogFS_BlockCache *bc)
+{
+   if (bc->maxPages > 0) {
+      LogFS_BlockCacheFreeQueue(&bc->a1in);
+      LogFS_BlockCacheFreeQueue(&bc->am);
+      LogFS_BlockCacheFreeQueue(&bc->a1out);
+      free(bc->buckets);
+      free(bc->segments);
+      free(bc->generations);
+   }
+   SP_CleanupLock(&bc->lock);
+}
+
+static LogFS_BlockCachePage *
+LogFS_BlockCacheLookup(LogFS_BlockCache *bc, uint64 key)
+{
+   LogFS_BlockCachePage *p = bc->buckets[LogFS_BlockCacheBucket(key)];
+
+   while (p != NULL && p->key != key) {
+      p = p->next;
+   }
+   return p;
+}
+
+static void
+LogFS_BlockCacheUnhash(LogFS_BlockCache *bc, LogFS_BlockCachePage *p)
+{
+   LogFS_BlockCachePage **pp = &bc->buckets[LogFS_BlockCacheBucket(p->key)];
+
+   while (*pp != p) {
+      pp = &(*pp)->next;
+   }
+   *pp = p->next;
+}
+
+/* Make room for one more page, returning the buffer of the page evicted.
+ * Pages that leave a1in are remembered in a1out for a while. */
+
+static char *
+LogFS_BlockCacheEvict(LogFS_BlockCache *bc)
+{
+   uint32 kin = bc->maxPages * LOGFS_BLOCK_CACHE_A1IN_PCT / 100;
+   uint32 kout = bc->maxPages * LOGFS_BLOCK_CACHE_A1OUT_PCT / 100;
+   LogFS_BlockCachePage *p;
+   char *data;
+
+   if (bc->numA1in > kin || List_IsEmpty(&bc->am)) {
+      p = List_Entry(List_Last(&bc->a1in), LogFS_BlockCachePage, queue);
+      --(bc->numA1in);
+   } else {
+      p = List_Entry(List_Last(&bc->am), LogFS_BlockCachePage, queue);
+   }
+
+   List_Remove(&p->queue);
+   List_Remove(&p->segmentPages);
+   data = p->data;
+   p->data = NULL;
+   --(bc->numPages);
+   ++(bc->evictions);
+
+   if (p->onMain) {
+      LogFS_BlockCacheUnhash(bc, p);
+      free(p);
+   } else {
+      List_Insert(&p->queue, LIST_ATFRONT(&bc->a1out));
+      ++(bc->numA1out);
+   }
+
+   if (bc->numA1out > kout) {
+      p = List_Entry(List_Last(&bc->a1out), LogFS_BlockCachePage, queue);
+      List_Remove(&p->queue);
+      LogFS_BlockCacheUnhash(bc, p);
+      free(p);
+      --(bc->numA1out);
+   }
+
+   return data;
+}
+
+/* Find or make the resident page for KEY. */
+
+static LogFS_BlockCachePage *
+LogFS_BlockCacheGetPage(LogFS_BlockCache *bc, uint64 key)
+{
+   LogFS_BlockCachePage *p = LogFS_BlockCacheLookup(bc, key);
+   char *data;
+
+   if (p != NULL && p->data != NULL) {
+      return p;
+   }
+
+   if (bc->numPages == bc->maxPages) {
+      data = LogFS_BlockCacheEvict(bc);
+   } else {
+      data = aligned_malloc(LOGFS_BLOCK_CACHE_PAGE_SIZE);
+      ASSERT(data);
+   }
+
+   /* Eviction may have forgotten about the page */
+
+   p = LogFS_BlockCacheLookup(bc, key);
+
+   if (p != NULL) {
+      /* Seen recently enough to deserve a place in the main queue */
+
+      List_Remove(&p->queue);
+      --(bc->numA1out);
+      List_Insert(&p->queue, LIST_ATFRONT(&bc->am));
+      p->onMain = TRUE;
+      ++(bc->ghostHits);
+   } else {
+      uint32 b = LogFS_BlockCacheBucket(key);
+
+      p = malloc(sizeof(LogFS_BlockCachePage));
+      ASSERT(p);
+      p->key = key;
+      p->next = bc->buckets[b];
+      bc->buckets[b] = p;
+      p->onMain = FALSE;
+      List_Insert(&p->queue, LIST_ATFRONT(&bc->a1in));
+      ++(bc->numA1in);
+   }
+
+   p->data = data;
+   p->valid = 0;
+   List_Insert(&p->segmentPages,
+               LIST_ATREAR(&bc->segments[LogFS_BlockCacheKeySegment(key)]));
+   ++(bc->numPages);
+
+   return p;
+}
+
+/* The mask of the blocks of the page at KEY that lie within NUMBLOCKS
+ * blocks starting at BLKOFFSET. */
+
+static inline uint8
+LogFS_BlockCacheMask(uint64 key, uint32 blkOffset, uint32 numBlocks,
+                     uint32 *first, uint32 *count)
+{
+   uint32 pageStart = key & ((1 << 20) - 1);
+   uint32 from = MAX(blkOffset, pageStart) - pageStart;
+   uint32 to = MIN(blkOffset + numBlocks,
+                   pageStart + LOGFS_BLOCK_CACHE_PAGE_BLOCKS) - pageStart;
+
+   *first = from;
+   *count = to - from;
+   return ((1 << to) - 1) & ~((1 << from) - 1);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LogFS_BlockCacheRead --
+ *
+ *      If the cache has all NUMBLOCKS blocks starting at log position POS,
+ *      hand them to COPY a page at a time, in order, straight from the
+ *      cache pages. COPY runs with the cache lock held.
+ *
+ * Results:
+ *      TRUE on a hit. Nothing is copied on a miss.
+ *
+ * Side effects:
+ *      Pages hit are moved to the front of the main queue.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+LogFS_BlockCacheRead(LogFS_BlockCache *bc, log_id_t pos, uint32 numBlocks,
+                     LogFS_BlockCacheCopyFn copy, void *data)
+{
+   uint32 blkOffset = pos.v.blk_offset;
+   uint64 key = LogFS_BlockCacheKey(pos.v.segment, blkOffset);
+   uint64 last = LogFS_BlockCacheKey(pos.v.segment, blkOffset + numBlocks - 1);
+   uint32 first, count;
+
+   SP_Lock(&bc->lock);
+
+   for (; key <= last; key += LOGFS_BLOCK_CACHE_PAGE_BLOCKS) {
+      LogFS_BlockCachePage *p = LogFS_BlockCacheLookup(bc, key);
+      uint8 mask = LogFS_BlockCacheMask(key, blkOffset, numBlocks,
+                                        &first, &count);
+
+      if (p == NULL || p->data == NULL || (p->valid & mask) != mask) {
+         ++(bc->misses);
+         SP_Unlock(&bc->lock);
+         return FALSE;
+      }
+   }
+
+   for (key = LogFS_BlockCacheKey(pos.v.segment, blkOffset); key <= last;
+        key += LOGFS_BLOCK_CACHE_PAGE_BLOCKS) {
+      LogFS_BlockCachePage *p = LogFS_BlockCacheLookup(bc, key);
+
+      LogFS_BlockCacheMask(key, blkOffset, numBlocks, &first, &count);
+      copy(data, p->data + first * BLKSIZE, count * BLKSIZE);
+
+      if (p->onMain) {
+         List_Remove(&p->queue);
+         List_Insert(&p->queue, LIST_ATFRONT(&bc->am));
+      }
+   }
+   ++(bc->hits);
+
+   SP_Unlock(&bc->lock);
+   return TRUE;
+}
+
+/* The generation to pass to LogFS_BlockCacheFill() for a read of SEGMENT
+ * that is about to start. */
+
+uint32
+LogFS_BlockCacheGeneration(LogFS_BlockCache *bc, log_segment_id_t segment)
+{
+   uint32 generation;
+
+   SP_Lock(&bc->lock);
+   generation = bc->generations[segment];
+   SP_Unlock(&bc->lock);
+
+   return generation;
+}
+
+/* Add NUMBLOCKS blocks, read from log position POS into BUF, to the cache,
+ * unless the segment has been freed since the read started. */
+
+void
+LogFS_BlockCacheFill(LogFS_BlockCache *bc, log_id_t pos, uint32 numBlocks,
+                     const char *buf, uint32 generation)
+{
+   uint32 blkOffset = pos.v.blk_offset;
+   uint64 key = LogFS_BlockCacheKey(pos.v.segment, blkOffset);
+   uint64 last = LogFS_BlockCacheKey(pos.v.segment, blkOffset + numBlocks - 1);
+   uint32 first, count;
+
+   SP_Lock(&bc->lock);
+
+   if (generation == bc->generations[pos.v.segment]) {
+      for (; key <= last; key += LOGFS_BLOCK_CACHE_PAGE_BLOCKS) {
+         LogFS_BlockCachePage *p = LogFS_BlockCacheGetPage(bc, key);
+         uint8 mask = LogFS_BlockCacheMask(key, blkOffset, numBlocks,
+                                           &first, &count);
+
+         memcpy(p->data + first * BLKSIZE, buf, count * BLKSIZE);
+         buf += count * BLKSIZE;
+         p->valid |= mask;
+      }
+      ++(bc->fills);
+   }
+
+   SP_Unlock(&bc->lock);
+}
+
+/* SEGMENT was freed, and may be written anew. */
+
+void
+LogFS_BlockCacheDropSegment(LogFS_BlockCache *bc, log_segment_id_t segment)
+{
+   List_Links *curr, *next;
+
+   if (bc->maxPages == 0) {
+      return;
+   }
+
+   SP_Lock(&bc->lock);
+
+   ++(bc->generations[segment]);
+
+   LIST_FORALL_SAFE(&bc->segments[segment], curr, next) {
+      LogFS_BlockCachePage *p = List_Entry(curr, LogFS_BlockCachePage,
+                                           segmentPages);
+      List_Remove(&p->segmentPages);
+      List_Remove(&p->queue);
+      if (!p->onMain) {
+         --(bc->numA1in);
+      }
+      LogFS_BlockCacheUnhash(bc, p);
+      aligned_free(p->data);
+      free(p);
+      --(bc->numPages);
+   }
+
+   SP_Unlock(&bc->lock);
+}
+
+void
+LogFS_BlockCacheShowStats(LogFS_BlockCache *bc)
+{
+   zprintf("block cache: %u/%u pages, %" FMT64 "u hits, %" FMT64
+           "u misses, %" FMT64 "u fills, %" FMT64 "u evictions, %" FMT64
+           "u second chances\n",
+           bc->numPages, bc->maxPages, bc->hits, bc->misses, bc->fills,
+           bc->evictions, bc->ghostHits);
+}
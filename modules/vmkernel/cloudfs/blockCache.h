@@ -0,0 +1,114 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+#ifndef __BLOCKCACHE_H__
+#define __BLOCKCACHE_H__
+
+#include "logfsConstants.h"
+#include "logtypes.h"
+
+/* A cache of log blocks, keyed by their position in the log. Data in the
+ * log never changes once written, so nothing needs invalidating when a vdisk
+ * block gets overwritten, only when a segment is freed and may be reused.
+ * Blocks are kept in pages of LOGFS_BLOCK_CACHE_PAGE_BLOCKS, evicted with
+ * the 2Q algorithm: pages seen once sit in a FIFO (a1in), and only pages
+ * referenced again, or shortly after being evicted from there (remembered
+ * in a1out), make it into the main LRU (am). A scan thus cannot flush out
+ * the blocks that are actually hot. */
+
+#define LOGFS_BLOCK_CACHE_PAGE_BLOCKS 8
+#define LOGFS_BLOCK_CACHE_PAGE_SIZE (LOGFS_BLOCK_CACHE_PAGE_BLOCKS * BLKSIZE)
+#define LOGFS_BLOCK_CACHE_BUCKETS 0x8000
+
+/* Only reads up to this size go through the cache */
+#define LOGFS_BLOCK_CACHE_MAX_READ (64 * 1024)
+
+typedef struct LogFS_BlockCachePage {
+   uint64 key;
+   struct LogFS_BlockCachePage *next;   /* in hash bucket */
+   List_Links queue;                    /* on a1in, am or a1out */
+   List_Links segmentPages;             /* if resident */
+   uint8 valid;                         /* bit per block */
+   uint8 onMain;
+   char *data;                          /* NULL if only remembered */
+} LogFS_BlockCachePage;
+
+typedef struct {
+   SP_SpinLock lock;
+   uint32 maxPages;             /* zero if disabled */
+   uint32 numPages;
+   uint32 numA1in;
+   uint32 numA1out;
+
+   LogFS_BlockCachePage **buckets;
+   List_Links a1in;
+   List_Links am;
+   List_Links a1out;
+
+   /* Pages of each segment, and a generation count to keep reads that
+    * started before a segment was freed from filling the cache */
+   List_Links *segments;
+   uint32 *generations;
+
+   uint64 hits;
+   uint64 misses;
+   uint64 fills;
+   uint64 evictions;
+   uint64 ghostHits;
+} LogFS_BlockCache;
+
+typedef void (*LogFS_BlockCacheCopyFn)(void *data, const char *src,
+                                       uint32 bytes);
+
+void LogFS_BlockCacheInit(LogFS_BlockCache *bc, uint32 bytes);
+void LogFS_BlockCacheCleanup(LogFS_BlockCache *bc);
+
+Bool LogFS_BlockCacheRead(LogFS_BlockCache *bc, log_id_t pos,
+                          uint32 numBlocks, LogFS_BlockCacheCopyFn copy,
+                          void *data);
+uint32 LogFS_BlockCacheGeneration(LogFS_BlockCache *bc,
+                                  log_segment_id_t segment);
+void LogFS_BlockCacheFill(LogFS_BlockCache *bc, log_id_t pos,
+                          uint32 numBlocks, const char *buf,
+                          uint32 generation);
+void LogFS_BlockCacheDropSegment(LogFS_BlockCache *bc,
+                                 log_segment_id_t segment);
+void LogFS_BlockCacheShowStats(LogFS_BlockCache *bc);
+
+static inline Bool
+LogFS_BlockCacheEnabled(LogFS_BlockCache *bc)
+{
+   return bc->maxPages > 0;
+}
+
+#endif                          /* __BLOCKCACHE_H__ */
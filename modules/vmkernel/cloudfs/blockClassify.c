@@ -0,0 +1,170 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * blockClassify.c --
+ *
+ *      Sorts the blocks of a write buffer into zero and non-zero ones in
+ *      a single pass, producing the refs bitmap of a log entry. The block
+ *      scan is written with gcc vector extensions and built both for the
+ *      baseline instruction set and for AVX2, and the best one available
+ *      is picked at run time.
+ */
+
+#include "system.h"
+#include "logtypes.h"
+#include "blockClassify.h"
+
+typedef uint64_t blk_vec256_t __attribute__ ((__vector_size__(32)));
+
+static inline int __attribute__ ((__always_inline__))
+ClassifyBlocks(const char *buf, int numBlocks, void *refs)
+{
+   uint8_t *bits = refs;
+   uint8_t byte = 0;
+   int i, nonZero = 0;
+
+   for (i = 0; i < numBlocks; i++) {
+      const char *blk = buf + (size_t)i * BLKSIZE;
+      unsigned int off, j;
+      int isZero = 1;
+
+      for (off = 0; off < BLKSIZE && isZero; off += 4 * sizeof(blk_vec256_t)) {
+         blk_vec256_t v, acc;
+
+         memcpy(&acc, blk + off, sizeof(acc));
+         for (j = 1; j < 4; j++) {
+            memcpy(&v, blk + off + j * sizeof(v), sizeof(v));
+            acc |= v;
+         }
+         isZero = !(acc[0] | acc[1] | acc[2] | acc[3]);
+      }
+
+      if (!isZero) {
+         byte |= 1 << (i % 8);
+         nonZero++;
+      }
+      if (i % 8 == 7) {
+         bits[i / 8] = byte;
+         byte = 0;
+      }
+   }
+   if (numBlocks % 8 != 0) {
+      bits[numBlocks / 8] = byte;
+   }
+
+   return nonZero;
+}
+
+static int
+ClassifyBlocksGeneric(const char *buf, int numBlocks, void *refs)
+{
+   return ClassifyBlocks(buf, numBlocks, refs);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && \
+    (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+
+#define CLASSIFY_AVX2 1
+
+static int __attribute__ ((__target__("avx2")))
+ClassifyBlocksAVX2(const char *buf, int numBlocks, void *refs)
+{
+   return ClassifyBlocks(buf, numBlocks, refs);
+}
+
+static int
+HaveAVX2(void)
+{
+   uint32_t a, b, c, d;
+   uint64_t xcr0;
+
+   __asm__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(0), "2"(0));
+   if (a < 7) {
+      return 0;
+   }
+
+   /* The OS has to save the ymm state for us. */
+   __asm__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(1), "2"(0));
+   if (!(c & (1 << 27))) {
+      return 0;
+   }
+   __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+   xcr0 = ((uint64_t) d << 32) | a;
+   if ((xcr0 & 6) != 6) {
+      return 0;
+   }
+
+   __asm__("cpuid" : "=a"(a), "=b"(b), "=c"(c), "=d"(d) : "0"(7), "2"(0));
+   return (b & (1 << 5)) != 0;
+}
+
+#endif
+
+typedef int (*ClassifyBlocksFunc)(const char *, int, void *);
+
+static ClassifyBlocksFunc classifyBlocks = NULL;
+static const char *classifyBlocksName;
+
+static void
+ClassifyBlocksSelect(void)
+{
+#ifdef CLASSIFY_AVX2
+   if (HaveAVX2()) {
+      classifyBlocksName = "avx2";
+      classifyBlocks = ClassifyBlocksAVX2;
+      return;
+   }
+#endif
+   classifyBlocksName = "generic";
+   classifyBlocks = ClassifyBlocksGeneric;
+}
+
+int
+LogFS_ClassifyBlocks(const char *buf, int numBlocks, void *refs)
+{
+   if (classifyBlocks == NULL) {
+      ClassifyBlocksSelect();
+   }
+   return classifyBlocks(buf, numBlocks, refs);
+}
+
+const char *
+LogFS_ClassifyBlocksName(void)
+{
+   if (classifyBlocks == NULL) {
+      ClassifyBlocksSelect();
+   }
+   return classifyBlocksName;
+}
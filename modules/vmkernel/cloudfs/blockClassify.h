@@ -0,0 +1,147 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * blockClassify.h --
+ *
+ *      Fast helpers for telling zero blocks from non-zero ones, and for
+ *      working with the refs bitmap of a log entry, where a set bit means
+ *      the block is stored in the entry body and a clear bit means it is
+ *      all zeroes.
+ *
+ *      Like logtypes.h, this gets included by user space tools, so only
+ *      stdint.h types are used here.
+ */
+
+#ifndef __BLOCKCLASSIFY_H__
+#define __BLOCKCLASSIFY_H__
+
+#include "system.h"
+
+/* 16-byte vectors compile to plain SSE2 loads and ors on x86, and to
+ * pairs of scalar operations elsewhere. */
+
+typedef uint64_t blk_vec_t __attribute__ ((__vector_size__(16)));
+
+static inline blk_vec_t blk_vec_load(const char *p)
+{
+   blk_vec_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+/* Is the LEN byte buffer at P all zeroes? LEN must be a multiple of 128. */
+
+static inline int mem_is_zero(const char *p, size_t len)
+{
+   blk_vec_t acc;
+   size_t i, j;
+
+   /* Check 128 bytes at a time, so that non-zero blocks, which usually
+    * have data near the start, are rejected quickly. */
+
+   for (i = 0; i < len; i += 8 * sizeof(blk_vec_t)) {
+      acc = blk_vec_load(p + i);
+      for (j = 1; j < 8; j++) {
+         acc |= blk_vec_load(p + i + j * sizeof(blk_vec_t));
+      }
+      if (acc[0] | acc[1]) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+/* Bitmaps may sit at any alignment inside packed structures, so words
+ * are fetched with memcpy. NBITS need not be a multiple of 8; no bytes
+ * past the end of the bitmap are touched. */
+
+static inline uint64_t BitWord(const void *v, int bit, int nbits)
+{
+   uint64_t w = 0;
+   int bytes = (nbits - bit + 7) / 8;
+
+   memcpy(&w, (const char *)v + bit / 8, bytes < 8 ? bytes : 8);
+   if (nbits - bit < 64) {
+      w &= (1ULL << (nbits - bit)) - 1;
+   }
+   return w;
+}
+
+/* Number of set bits among the first NBITS. */
+
+static inline int BitCount(const void *v, int nbits)
+{
+   int bit, count = 0;
+
+   for (bit = 0; bit < nbits; bit += 64) {
+      count += __builtin_popcountll(BitWord(v, bit, nbits));
+   }
+   return count;
+}
+
+/* Index of the N'th (counting from zero) set bit among the first NBITS,
+ * or -1 if there are not that many. In a refs bitmap this maps the N'th
+ * block of the entry body to its block offset in the entry. */
+
+static inline int BitFindNth(const void *v, int nbits, int n)
+{
+   int bit;
+
+   for (bit = 0; bit < nbits; bit += 64) {
+      uint64_t w = BitWord(v, bit, nbits);
+      int c = __builtin_popcountll(w);
+
+      if (n < c) {
+         while (n-- > 0) {
+            w &= w - 1;
+         }
+         return bit + __builtin_ctzll(w);
+      }
+      n -= c;
+   }
+   return -1;
+}
+
+/* Sets bit i of REFS if the i'th BLKSIZE block of BUF is non-zero, and
+ * clears it if the block is all zeroes, for NUMBLOCKS blocks. Bits past NUMBLOCKS in the
+ * last byte are cleared. Returns the number of non-zero blocks. */
+
+int LogFS_ClassifyBlocks(const char *buf, int numBlocks, void *refs);
+
+/* Name of the implementation in use, for logging. */
+
+const char *LogFS_ClassifyBlocksName(void);
+
+#endif                          /* __BLOCKCLASSIFY_H__ */
@@ -57,9 +57,9 @@ extern int refcount;
 	The B-Tree
 **/
 
-static int lower_bound(btree_t *t, const node_t *n, const elem_t * e)
+static int lower_bound_n(btree_t *t, const node_t *n, const elem_t * e,
+                         int len)
 {
-   int len = n->num_elems;
    int first = 0;
    int half, middle;
    while (len > 0) {
@@ -76,6 +76,33 @@ static int lower_bound(btree_t *t, const node_t *n, const elem_t * e)
    return first;
 }
 
+static int lower_bound(btree_t *t, const node_t *n, const elem_t * e)
+{
+   return lower_bound_n(t, n, e, n->num_elems);
+}
+
+/* An optimistic reader may see a node while it is being changed, so it
+ * must not trust the element count or the child pointers it finds. Counts
+ * are clamped to what a node holds, and a bad child or a tree deeper than
+ * TREE_MAX_DEPTH reads as a node fault. The reader notices the change
+ * afterwards and discards the result. */
+
+static inline int optimistic(btree_t *t, void *context)
+{
+   return (t->callbacks.optimistic != NULL &&
+           t->callbacks.optimistic(t, context));
+}
+
+static inline int node_num_elems(btree_t *t, const node_t *n, int opt)
+{
+   int num_elems = n->num_elems;
+
+   if (opt && num_elems > 2 * (int) t->branch - 1) {
+      num_elems = 2 * t->branch - 1;
+   }
+   return num_elems;
+}
+
 static int upper_bound(btree_t *t, const node_t *n, elem_t * e)
 {
    int len = n->num_elems;
@@ -577,24 +604,33 @@ tree_result_t tree_lower_bound(btree_t *t, btree_iter_t *it, elem_t *e,
    disk_block_t disk_node = root;
    int last_non_right_idx = -1;
    int num_elems;
+   int opt = optimistic(t, context);
 
    it->tree = t;
    it->depth = 0;
 
    for (i = 0;; i++) {
-#ifdef VMKERNEL
       if (it->depth == TREE_MAX_DEPTH) {
+         if (opt) {
+            return tree_result_node_fault;
+         }
+#ifdef VMKERNEL
          Panic("max depth reached at node %u, root %u\n", disk_node, root);
-      }
 #endif
+      }
+      if (opt && disk_node == tree_null_block) {
+         return tree_result_node_fault;
+      }
+
       n = get_node(t, disk_node, context);
 
       if (n == NULL) {
          return tree_result_node_fault;
       }
 
-      pos = lower_bound(t, n, e);
-      if (pos < n->num_elems) {
+      num_elems = node_num_elems(t, n, opt);
+      pos = lower_bound_n(t, n, e, num_elems);
+      if (pos < num_elems) {
          last_non_right_idx = i;
       }
 
@@ -603,7 +639,6 @@ tree_result_t tree_lower_bound(btree_t *t, btree_iter_t *it, elem_t *e,
       stop = n->leaf;
       disk_node = n->children[pos];
 
-      num_elems = n->num_elems;
       put_node(t, n, context);
 
       if (stop)
@@ -707,18 +742,30 @@ tree_result_t tree_iter_read(void *dst, btree_iter_t *it, void *context)
    disk_block_t disk_node;
    int i;
    int keyidx;
+   int num_elems;
+   int opt = optimistic(t, context);
 
    /* Loop down the tree guided by the iterator stack.  
     * Finish with n pointing to the node pointed to by the iterator. */
 
    for (i=0, disk_node=t->root ;; ) {
 
+      if (opt && disk_node == tree_null_block) {
+         return tree_result_node_fault;
+      }
+
       n = get_node(t, disk_node, context);
 
       if(n==NULL) {
          return tree_result_node_fault;
       }
 
+      num_elems = node_num_elems(t, n, opt);
+      if (opt && it->stack[i] > num_elems) {
+         put_node(t, n, context);
+         return tree_result_node_fault;
+      }
+
       disk_node = n->children[it->stack[i]];
 
       if(++i == it->depth) {
@@ -729,8 +776,12 @@ tree_result_t tree_iter_read(void *dst, btree_iter_t *it, void *context)
    }
 
    keyidx = it->stack[it->depth - 1];
-   if (keyidx > n->num_elems - 1) {
-      keyidx = n->num_elems - 1;
+   if (keyidx > num_elems - 1) {
+      keyidx = num_elems - 1;
+   }
+   if (keyidx < 0) {
+      put_node(t, n, context);
+      return tree_result_node_fault;
    }
    memcpy(dst, nth_elem(t, n, keyidx), elem_size(t));
    put_node(t, n, context);
@@ -782,10 +833,15 @@ tree_result_t tree_iter_inc(btree_iter_t *it, void *context)
    int num_elems;
 
    int last_non_right_idx = -1;
+   int opt = optimistic(t, context);
 
    int i;
 
    for (i = 0; i < it->depth - 1; i++) {
+      if (opt && disk_node == tree_null_block) {
+         return tree_result_node_fault;
+      }
+
       const node_t *n = get_node(t, disk_node, context);
 
       if (n == NULL) {
@@ -793,7 +849,12 @@ tree_result_t tree_iter_inc(btree_iter_t *it, void *context)
       }
 
       idx = it->stack[i];
-      if (idx < n->num_elems) {
+      num_elems = node_num_elems(t, n, opt);
+      if (opt && idx > num_elems) {
+         put_node(t, n, context);
+         return tree_result_node_fault;
+      }
+      if (idx < num_elems) {
          last_non_right_idx = i;
       }
 
@@ -801,6 +862,10 @@ tree_result_t tree_iter_inc(btree_iter_t *it, void *context)
       put_node(t, n, context);
    }
 
+   if (opt && disk_node == tree_null_block) {
+      return tree_result_node_fault;
+   }
+
    n = get_node(t, disk_node, context);
 
    if (n == NULL) {
@@ -809,7 +874,7 @@ tree_result_t tree_iter_inc(btree_iter_t *it, void *context)
 
    idx = it->stack[it->depth - 1];
    leaf = n->leaf;
-   num_elems = n->num_elems;
+   num_elems = node_num_elems(t, n, opt);
    put_node(t, n, context);
 
    if (leaf) {
@@ -840,6 +905,11 @@ tree_result_t tree_iter_inc(btree_iter_t *it, void *context)
       it->stack[it->depth - 1]++;
 
       for (;;) {
+         if (opt && (disk_node == tree_null_block ||
+                     it->depth == TREE_MAX_DEPTH)) {
+            return tree_result_node_fault;
+         }
+
          n = get_node(t, disk_node, context);
 
          if (n == NULL) {
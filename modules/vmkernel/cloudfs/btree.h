@@ -88,6 +88,10 @@ typedef struct {
                               void *context);
    void (*put_node) (struct btree * t, const node_t *n, void *context);
    int (*cmp) (const void *, const void *);
+
+   /* Optional. Whether CONTEXT walks the tree without locking, and may see
+    * nodes halfway through a change. */
+   int (*optimistic) (struct btree * t, void *context);
 } btree_callbacks_t;
 
 /* in-memory tree metadata that does not make sense to keep on disk */
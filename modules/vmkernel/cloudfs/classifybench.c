@@ -0,0 +1,211 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * classifybench.c --
+ *
+ *      Microbenchmark for the block classification helpers. Compares
+ *      LogFS_ClassifyBlocks() with testing each block on its own, and the
+ *      popcount based log_body_size() with testing the refs bitmap bit by
+ *      bit, and checks that the results agree.
+ *
+ *      Usage: classifybench [megabytes] [percent zero blocks]
+ */
+
+#include <sys/time.h>
+
+#include "system.h"
+#include "logtypes.h"
+#include "blockClassify.h"
+
+#define BENCH_BLOCKS 256        /* blocks per write, a 128kB I/O */
+
+static double
+now(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* The way things were done before, for comparison */
+
+static int
+is_block_zero_ints(const char *blkdata)
+{
+   const int *data = (const int *)blkdata;
+   unsigned int i;
+
+   for (i = 0; i < BLKSIZE / sizeof(int); i++) {
+      if (data[i]) {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+static size_t
+log_body_size_bits(struct log_head *head)
+{
+   size_t sum = 0;
+   int i;
+
+   for (i = 0; i < head->update.num_blocks; i++) {
+      if (BitTest(head->update.refs, i)) {
+         sum += BLKSIZE;
+      }
+   }
+   return sum;
+}
+
+int
+main(int argc, char **argv)
+{
+   int megabytes = argc > 1 ? atoi(argv[1]) : 1024;
+   int percentZero = argc > 2 ? atoi(argv[2]) : 50;
+   int iterations = megabytes * 1024 * 1024 / (BENCH_BLOCKS * BLKSIZE);
+   char *buf = malloc(BENCH_BLOCKS * BLKSIZE);
+   struct log_head *head = malloc(LOG_HEAD_SIZE);
+   struct log_head *ref = malloc(LOG_HEAD_SIZE);
+   volatile size_t sink = 0;
+   double t;
+   int i, n, status = 0;
+
+   memset(buf, 0, BENCH_BLOCKS * BLKSIZE);
+   memset(head, 0, LOG_HEAD_SIZE);
+   memset(ref, 0, LOG_HEAD_SIZE);
+
+   /* Non-zero blocks get a single byte set somewhere, which is the worst
+    * case for early exit */
+   for (i = 0; i < BENCH_BLOCKS; i++) {
+      if (rand() % 100 >= percentZero) {
+         buf[i * BLKSIZE + rand() % BLKSIZE] = 1 + rand() % 255;
+      }
+   }
+
+   head->tag = ref->tag = log_entry_type;
+   head->update.num_blocks = ref->update.num_blocks = BENCH_BLOCKS;
+
+   printf("classify: %s\n", LogFS_ClassifyBlocksName());
+
+   n = LogFS_ClassifyBlocks(buf, BENCH_BLOCKS, head->update.refs);
+   for (i = 0; i < BENCH_BLOCKS; i++) {
+      if (!is_block_zero_ints(buf + i * BLKSIZE)) {
+         BitSet(ref->update.refs, i);
+      }
+      if (is_block_zero(buf + i * BLKSIZE) !=
+          is_block_zero_ints(buf + i * BLKSIZE)) {
+         printf("is_block_zero MISMATCH at %d\n", i);
+         status = 1;
+      }
+   }
+   if (memcmp(head, ref, LOG_HEAD_SIZE) != 0 ||
+       n * BLKSIZE != log_body_size_bits(ref)) {
+      printf("classify MISMATCH\n");
+      status = 1;
+   }
+   if (log_body_size(head) != log_body_size_bits(ref)) {
+      printf("log_body_size MISMATCH\n");
+      status = 1;
+   }
+   for (i = 0; i < n; i++) {
+      int k = BitFindNth(head->update.refs, BENCH_BLOCKS, i);
+      if (k < 0 || !BitTest(head->update.refs, k) ||
+          BitCount(head->update.refs, k) != i) {
+         printf("BitFindNth MISMATCH at %d\n", i);
+         status = 1;
+      }
+   }
+   if (BitFindNth(head->update.refs, BENCH_BLOCKS, n) != -1) {
+      printf("BitFindNth MISMATCH past end\n");
+      status = 1;
+   }
+   if (status) {
+      return status;
+   }
+
+   t = now();
+   for (n = 0; n < iterations; n++) {
+      for (i = 0; i < BENCH_BLOCKS; i++) {
+         if (is_block_zero_ints(buf + i * BLKSIZE)) {
+            BitClear(ref->update.refs, i);
+         } else {
+            BitSet(ref->update.refs, i);
+         }
+      }
+   }
+   t = now() - t;
+   printf("per-block ints   %8.1f MB/s\n", megabytes / t);
+
+   t = now();
+   for (n = 0; n < iterations; n++) {
+      for (i = 0; i < BENCH_BLOCKS; i++) {
+         if (is_block_zero(buf + i * BLKSIZE)) {
+            BitClear(ref->update.refs, i);
+         } else {
+            BitSet(ref->update.refs, i);
+         }
+      }
+   }
+   t = now() - t;
+   printf("per-block vector %8.1f MB/s\n", megabytes / t);
+
+   t = now();
+   for (n = 0; n < iterations; n++) {
+      sink += LogFS_ClassifyBlocks(buf, BENCH_BLOCKS, head->update.refs);
+   }
+   t = now() - t;
+   printf("classify         %8.1f MB/s\n", megabytes / t);
+
+   t = now();
+   for (n = 0; n < iterations * 16; n++) {
+      __asm__ __volatile__("" : : "r"(ref) : "memory");
+      sink += log_body_size_bits(ref);
+   }
+   t = now() - t;
+   printf("body size bits     %8.1f ns\n", t * 1e9 / (iterations * 16));
+
+   t = now();
+   for (n = 0; n < iterations * 16; n++) {
+      __asm__ __volatile__("" : : "r"(head) : "memory");
+      sink += log_body_size(head);
+   }
+   t = now() - t;
+   printf("body size popcount %8.1f ns\n", t * 1e9 / (iterations * 16));
+
+   free(buf);
+   free(head);
+   free(ref);
+   return 0;
+}
@@ -77,7 +77,7 @@ void LogFS_DedupeSegment(LogFS_MetaLog *ml,
 #if 1
    for(i=1, begin=0; ; ++i, prev=duplicate) {
 
-      Bool stop = (i==LOG_MAX_SEGMENT_BLOCKS);
+      Bool stop = (i==fp->numBlocks);
 
       pos.v.segment = LogFS_LogGetSegment(log);
       pos.v.blk_offset = i;
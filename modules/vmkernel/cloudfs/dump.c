@@ -174,7 +174,7 @@ static inline log_offset_t _cursor(log_segment_id_t segment,
                                    log_offset_t offset)
 {
    return LogFS_DiskLayoutGetOffset(&layout, LogFS_LogSegmentsSection) +
-       segment * LOG_MAX_SEGMENT_SIZE + offset;
+       segment * LogFS_DiskLayoutGetSegmentSize(&layout) + offset;
 }
 
 int main(int argc, char **argv)
@@ -190,8 +190,12 @@ int main(int argc, char **argv)
    printf("size %d\n", sizeof(layout));
    int r = pread(f, &layout, sizeof(layout), 0);
    printf("r %d\n", r);
+   printf("version %u\n", layout.version);
+   assert(layout.version == LOGFS_DISK_VERSION);
 
    printf("magic %s\n", layout.magic);
+   printf("checksum %s\n", log_checksum_name(layout.checksumType));
+   printf("segment blocks %u\n", layout.segmentBlocks);
 
    nodes = malloc(TREE_BLOCK_SIZE * 1024);
    assert(nodes);
@@ -38,11 +38,14 @@ struct LogFS_VDisk;
 
 extern int compare_u64(const void *a, const void *b);
 
-void LogFS_FingerPrintInit(LogFS_FingerPrint *fp)
+void LogFS_FingerPrintInit(LogFS_FingerPrint *fp, int numBlocks)
 {
    memset(fp,0,sizeof(LogFS_FingerPrint));
-   fp->tmp = malloc(sizeof(uint64) * LOG_MAX_SEGMENT_BLOCKS);
-   fp->fullHashes = malloc(LOG_MAX_SEGMENT_BLOCKS*SHA1_DIGEST_SIZE);
+   fp->numBlocks = numBlocks;
+   fp->entries = malloc(sizeof(HashEntry) * numBlocks);
+   fp->owners = malloc(sizeof(struct FingerPrintOwner) * numBlocks);
+   fp->tmp = malloc(sizeof(uint64) * numBlocks);
+   fp->fullHashes = malloc(numBlocks*SHA1_DIGEST_SIZE);
 }
 
 
@@ -62,7 +65,7 @@ LogFS_FingerPrintLookupHash(LogFS_FingerPrint* fp, Hash h)
 
    if(he==NULL)
    {
-      ASSERT(fp->numHashEntries<sizeof(fp->entries)/sizeof(fp->entries[0]));
+      ASSERT(fp->numHashEntries<fp->numBlocks);
       he = &fp->entries[fp->numHashEntries++];
       if(prev==NULL)
       {
@@ -91,7 +94,7 @@ void LogFS_FingerPrintAddHash(
    struct LogFS_VDisk *vd,
    log_block_t blkno)
 {
-   ASSERT(fp->numFullHashes<LOG_MAX_SEGMENT_BLOCKS);
+   ASSERT(fp->numFullHashes<fp->numBlocks);
 
    int n = fp->numFullHashes++;
    /* Store full hash for use in log manifest */
@@ -106,6 +109,25 @@ void LogFS_FingerPrintAddHash(
 
 }
 
+/* Like LogFS_FingerPrintAddHash(), but for block N of the segment. Appenders
+ * that reserved disjoint parts of the segment may call this concurrently,
+ * and blocks never set keep the nil hash. */
+
+void LogFS_FingerPrintSetHash(
+   LogFS_FingerPrint* fp,
+   int n,
+   Hash h,
+   struct LogFS_VDisk *vd,
+   log_block_t blkno)
+{
+   ASSERT(n<fp->numBlocks);
+
+   uint8* dst = fp->fullHashes + SHA1_DIGEST_SIZE * n;
+   memcpy(dst,h.raw,SHA1_DIGEST_SIZE);
+   fp->owners[n].vd = vd;
+   fp->owners[n].blkno = blkno;
+}
+
 void LogFS_FingerPrintFinish(LogFS_FingerPrint *fp,
       LogFS_VebTree* vt,
       uint32 value)
@@ -115,7 +137,7 @@ void LogFS_FingerPrintFinish(LogFS_FingerPrint *fp,
 
    /* Mangle repeated hashes to ensure proportional representation */
 
-   for(i=0; i<LOG_MAX_SEGMENT_BLOCKS; ++i) {
+   for(i=0; i<fp->numBlocks; ++i) {
 
       Hash h = LogFS_FingerPrintLookupHash(fp, LogFS_HashFromRaw(
                fp->fullHashes + SHA1_DIGEST_SIZE * i));
@@ -130,7 +152,7 @@ void LogFS_FingerPrintFinish(LogFS_FingerPrint *fp,
 
       if((h.raw[9]&0xf)==0) /* Arbitrarily subsample hashes 1:16 */
       {
-         ASSERT(fp->numHashes<LOG_MAX_SEGMENT_BLOCKS);
+         ASSERT(fp->numHashes<fp->numBlocks);
          tmp[fp->numHashes++] = key;
       }
 
@@ -158,4 +180,8 @@ void LogFS_FingerPrintCleanup(LogFS_FingerPrint* fp)
    fp->tmp = NULL;
    free(fp->fullHashes);
    fp->fullHashes = NULL;
+   free(fp->entries);
+   fp->entries = NULL;
+   free(fp->owners);
+   fp->owners = NULL;
 }
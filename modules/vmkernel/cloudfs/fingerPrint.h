@@ -45,7 +45,8 @@ struct _HashEntry* next;
 struct LogFS_VDisk;
 
 typedef struct LogFS_FingerPrint {
-   HashEntry entries[LOG_MAX_SEGMENT_BLOCKS];
+   int numBlocks;              /* in the segment */
+   HashEntry *entries;
    HashEntry* hashTable[0x10000];
    int numHashEntries;
    uint64 *tmp;
@@ -57,7 +58,7 @@ typedef struct LogFS_FingerPrint {
    struct FingerPrintOwner {
       struct LogFS_VDisk *vd;
       log_block_t blkno;
-   } owners[LOG_MAX_SEGMENT_BLOCKS];
+   } *owners;
 
 } LogFS_FingerPrint;
 
@@ -69,7 +70,7 @@ LogFS_FingerPrintIsFull(LogFS_FingerPrint* fp)
 
 struct LogFS_VebTree;
 
-void LogFS_FingerPrintInit(LogFS_FingerPrint* fp);
+void LogFS_FingerPrintInit(LogFS_FingerPrint* fp, int numBlocks);
 
 void LogFS_FingerPrintAddHash(
    LogFS_FingerPrint* fp,
@@ -77,6 +78,13 @@ void LogFS_FingerPrintAddHash(
    struct LogFS_VDisk *vd,
    log_block_t blkno);
 
+void LogFS_FingerPrintSetHash(
+   LogFS_FingerPrint* fp,
+   int n,
+   Hash h,
+   struct LogFS_VDisk *vd,
+   log_block_t blkno);
+
 void LogFS_FingerPrintFinish(LogFS_FingerPrint *fp,
       struct LogFS_VebTree* vt,
       uint32 value);
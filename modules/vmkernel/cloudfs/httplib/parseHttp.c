@@ -143,6 +143,18 @@ static int parseSecret(char *in, void *data)
    return 1;
 }
 
+static int parseLease(char *in, void *data)
+{
+   HTTPSession *session = data;
+   size_t ms;
+
+   if (parseSize(&ms, in) == in)
+      return 0;
+
+   session->leaseMS = ms;
+   return 1;
+}
+
 static int parseConnection(char *in, void *data)
 {
    HTTPSession *session = data;
@@ -238,6 +250,7 @@ HTTPState header = {
               {"If-None-Match: *", &header, parseId},
               {"ETag: *", &header, parseId},
               {"Secret: *", &header, parseSecret},
+              {"Lease: *", &header, parseLease},
               {"\r\n", NULL, setComplete},
               {NULL, &header}}
 };
@@ -66,6 +66,8 @@ typedef struct {
    Hash secret;
    Hash secretView;
 
+   uint32_t leaseMS;
+
 } HTTPSession;
 
 typedef struct {
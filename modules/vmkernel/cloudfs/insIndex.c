@@ -0,0 +1,270 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * insIndex.c --
+ *
+ *      Treap of disjoint block segments, tagged with the buffered insert
+ *      visible in each. See insIndex.h.
+ */
+
+#include "system.h"
+#include "insIndex.h"
+
+#define NIL 0
+
+static uint16_t
+LogFS_InsIndexAlloc(LogFS_InsIndex *ix, uint64_t from, uint64_t to,
+                    uint32_t tag)
+{
+   uint16_t i = ix->freeList;
+   LogFS_InsIndexNode *n;
+
+   ASSERT(i != NIL);
+   n = &ix->nodes[i];
+   ix->freeList = n->left;
+   ++(ix->numUsed);
+
+   /* xorshift, priorities only need to look random */
+   ix->seed ^= ix->seed << 13;
+   ix->seed ^= ix->seed >> 17;
+   ix->seed ^= ix->seed << 5;
+
+   n->from = from;
+   n->to = to;
+   n->tag = tag;
+   n->prio = ix->seed;
+   n->left = n->right = NIL;
+   return i;
+}
+
+static void
+LogFS_InsIndexFree(LogFS_InsIndex *ix, uint16_t i)
+{
+   ix->nodes[i].left = ix->freeList;
+   ix->freeList = i;
+   --(ix->numUsed);
+}
+
+void
+LogFS_InsIndexInit(LogFS_InsIndex *ix, uint32_t maxInserts)
+{
+   uint32_t i;
+
+   ix->numNodes = LOGFS_INSINDEX_NODES(maxInserts);
+   ASSERT(ix->numNodes <= 0xffff);
+
+   ix->nodes = malloc(ix->numNodes * sizeof(LogFS_InsIndexNode));
+   ASSERT(ix->nodes);
+
+   ix->root = NIL;
+   ix->numUsed = 0;
+   ix->seed = 0x9e3779b9;
+
+   ix->freeList = NIL;
+   for (i = ix->numNodes - 1; i > 0; i--) {
+      ix->nodes[i].left = ix->freeList;
+      ix->freeList = i;
+   }
+}
+
+void
+LogFS_InsIndexCleanup(LogFS_InsIndex *ix)
+{
+   free(ix->nodes);
+   ix->nodes = NULL;
+}
+
+/* Split T into the segments starting before KEY, and the rest. */
+
+static void
+LogFS_InsIndexSplit(LogFS_InsIndex *ix, uint16_t t, uint64_t key,
+                    uint16_t *l, uint16_t *r)
+{
+   if (t == NIL) {
+      *l = *r = NIL;
+   } else if (ix->nodes[t].from < key) {
+      LogFS_InsIndexSplit(ix, ix->nodes[t].right, key,
+                          &ix->nodes[t].right, r);
+      *l = t;
+   } else {
+      LogFS_InsIndexSplit(ix, ix->nodes[t].left, key,
+                          l, &ix->nodes[t].left);
+      *r = t;
+   }
+}
+
+/* Join L and R, where all of L comes before all of R. */
+
+static uint16_t
+LogFS_InsIndexMerge(LogFS_InsIndex *ix, uint16_t l, uint16_t r)
+{
+   if (l == NIL) {
+      return r;
+   }
+   if (r == NIL) {
+      return l;
+   }
+   if (ix->nodes[l].prio > ix->nodes[r].prio) {
+      ix->nodes[l].right = LogFS_InsIndexMerge(ix, ix->nodes[l].right, r);
+      return l;
+   } else {
+      ix->nodes[r].left = LogFS_InsIndexMerge(ix, l, ix->nodes[r].left);
+      return r;
+   }
+}
+
+/* If a segment straddles KEY, cut it in two there. */
+
+static void
+LogFS_InsIndexCut(LogFS_InsIndex *ix, uint64_t key)
+{
+   uint16_t t = ix->root;
+
+   while (t != NIL) {
+      LogFS_InsIndexNode *n = &ix->nodes[t];
+
+      if (key <= n->from) {
+         t = n->left;
+      } else if (key >= n->to) {
+         t = n->right;
+      } else {
+         uint16_t l, r;
+         uint16_t i = LogFS_InsIndexAlloc(ix, key, n->to, n->tag);
+
+         n->to = key;
+         LogFS_InsIndexSplit(ix, ix->root, key, &l, &r);
+         ix->root = LogFS_InsIndexMerge(ix, LogFS_InsIndexMerge(ix, l, i), r);
+         return;
+      }
+   }
+}
+
+static void
+LogFS_InsIndexFreeAll(LogFS_InsIndex *ix, uint16_t t)
+{
+   if (t != NIL) {
+      LogFS_InsIndexFreeAll(ix, ix->nodes[t].left);
+      LogFS_InsIndexFreeAll(ix, ix->nodes[t].right);
+      LogFS_InsIndexFree(ix, t);
+   }
+}
+
+/* Make TAG the newest insert over [from, to[. */
+
+void
+LogFS_InsIndexPaint(LogFS_InsIndex *ix, uint64_t from, uint64_t to,
+                    uint32_t tag)
+{
+   uint16_t l, m, r;
+
+   ASSERT(from < to);
+
+   LogFS_InsIndexCut(ix, from);
+   LogFS_InsIndexCut(ix, to);
+
+   LogFS_InsIndexSplit(ix, ix->root, from, &l, &m);
+   LogFS_InsIndexSplit(ix, m, to, &m, &r);
+   LogFS_InsIndexFreeAll(ix, m);
+
+   m = LogFS_InsIndexAlloc(ix, from, to, tag);
+   ix->root = LogFS_InsIndexMerge(ix, LogFS_InsIndexMerge(ix, l, m), r);
+}
+
+static uint16_t
+LogFS_InsIndexFilter(LogFS_InsIndex *ix, uint16_t t, uint32_t tag)
+{
+   uint16_t l, r;
+
+   if (t == NIL) {
+      return NIL;
+   }
+
+   l = LogFS_InsIndexFilter(ix, ix->nodes[t].left, tag);
+   r = LogFS_InsIndexFilter(ix, ix->nodes[t].right, tag);
+
+   if (ix->nodes[t].tag == tag) {
+      LogFS_InsIndexFree(ix, t);
+      return LogFS_InsIndexMerge(ix, l, r);
+   }
+
+   ix->nodes[t].left = l;
+   ix->nodes[t].right = r;
+   return t;
+}
+
+/* Forget the insert TAG over [from, to[, where it was painted. Parts
+ * that newer inserts have been painted over are left alone. */
+
+void
+LogFS_InsIndexRemove(LogFS_InsIndex *ix, uint64_t from, uint64_t to,
+                     uint32_t tag)
+{
+   uint16_t l, m, r;
+
+   LogFS_InsIndexSplit(ix, ix->root, from, &l, &m);
+   LogFS_InsIndexSplit(ix, m, to, &m, &r);
+   m = LogFS_InsIndexFilter(ix, m, tag);
+   ix->root = LogFS_InsIndexMerge(ix,
+                                  LogFS_InsIndexMerge(ix, l, m), r);
+}
+
+/* Find the segment holding block X. Returns 1 and its start and tag if
+ * there is one, 0 otherwise. Either way *endsat is lowered to where the
+ * answer for the blocks following X may change. */
+
+int
+LogFS_InsIndexLookup(const LogFS_InsIndex *ix, uint64_t x,
+                     uint64_t *from, uint32_t *tag, uint64_t *endsat)
+{
+   uint16_t t = ix->root;
+
+   while (t != NIL) {
+      const LogFS_InsIndexNode *n = &ix->nodes[t];
+
+      if (x < n->from) {
+         *endsat = MIN(*endsat, n->from);
+         t = n->left;
+      } else if (x >= n->to) {
+         t = n->right;
+      } else {
+         *from = n->from;
+         *tag = n->tag;
+         *endsat = MIN(*endsat, n->to);
+         return 1;
+      }
+   }
+
+   return 0;
+}
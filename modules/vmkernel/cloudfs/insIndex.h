@@ -0,0 +1,87 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * insIndex.h --
+ *
+ *      Index over the buffered inserts of a BTreeRangeMap, answering which
+ *      of them is the newest to cover a given block. The inserts are
+ *      painted onto a set of disjoint segments, each tagged with the
+ *      insert that is visible there, kept in a treap ordered by block.
+ *      Since the inserts are flushed oldest first, flushing one simply
+ *      removes the segments still tagged with it.
+ *
+ *      Like logtypes.h, this gets included by user space tools, so only
+ *      stdint.h types are used here.
+ */
+
+#ifndef __INSINDEX_H__
+#define __INSINDEX_H__
+
+#include "system.h"
+
+typedef struct {
+   uint64_t from;
+   uint64_t to;
+   uint32_t tag;
+   uint32_t prio;
+   uint16_t left;
+   uint16_t right;
+} LogFS_InsIndexNode;
+
+typedef struct {
+   LogFS_InsIndexNode *nodes;   /* nodes[0] is the null node */
+   uint32_t numNodes;
+   uint32_t numUsed;
+   uint16_t root;
+   uint16_t freeList;           /* linked through 'left' */
+   uint32_t seed;
+} LogFS_InsIndex;
+
+/* Room for MAXINSERTS buffered inserts. Every segment boundary is an end
+ * of one of them, so two nodes per insert, and a few for the splits done
+ * while painting, are always enough. */
+
+#define LOGFS_INSINDEX_NODES(_maxInserts) (2 * (_maxInserts) + 4)
+
+void LogFS_InsIndexInit(LogFS_InsIndex *ix, uint32_t maxInserts);
+void LogFS_InsIndexCleanup(LogFS_InsIndex *ix);
+void LogFS_InsIndexPaint(LogFS_InsIndex *ix, uint64_t from, uint64_t to,
+                         uint32_t tag);
+void LogFS_InsIndexRemove(LogFS_InsIndex *ix, uint64_t from, uint64_t to,
+                          uint32_t tag);
+int LogFS_InsIndexLookup(const LogFS_InsIndex *ix, uint64_t x,
+                         uint64_t *from, uint32_t *tag, uint64_t *endsat);
+
+#endif                          /* __INSINDEX_H__ */
@@ -0,0 +1,184 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * insIndexbench.c --
+ *
+ *      Microbenchmark for the index over buffered rangemap inserts.
+ *      Compares the time per lookup of scanning the insert buffer from
+ *      the newest entry backwards, as LogFS_BTreeRangeMapLookupInBuffer()
+ *      used to, with LogFS_InsIndexLookup(), at a range of buffer fill
+ *      levels, and checks that the answers agree.
+ *
+ *      Usage: insIndexbench [lookups per fill level] [disk size in blocks]
+ */
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "system.h"
+#include "insIndex.h"
+
+#define BENCH_MAX_INSERTS 0x1800        /* MAX_INSERTS in bTreeRange.h */
+
+struct bench_insert {
+   uint64_t from;
+   uint64_t to;
+};
+
+static double
+now(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* The way things were done before, for comparison */
+
+static int
+lookup_scan(const struct bench_insert *ins, uint32_t n, uint64_t x,
+            uint32_t *tag, uint64_t *endsat)
+{
+   uint32_t i;
+
+   for (i = n; i != 0;) {
+      --i;
+
+      if (ins[i].to <= x) {
+         continue;
+      } else if (x < ins[i].from) {
+         *endsat = MIN(ins[i].from, *endsat);
+      } else {
+         *tag = i;
+         *endsat = MIN(ins[i].to, *endsat);
+         return 1;
+      }
+   }
+   return 0;
+}
+
+int
+main(int argc, char **argv)
+{
+   static const uint32_t fills[] = { 64, 256, 1024, 2048, 4096, 6144 };
+   uint32_t lookups = argc > 1 ? atoi(argv[1]) : 200000;
+   uint64_t diskBlocks = argc > 2 ? atoll(argv[2]) : (1 << 21);
+   struct bench_insert *ins = malloc(BENCH_MAX_INSERTS * sizeof(*ins));
+   uint64_t *xs = malloc(lookups * sizeof(uint64_t));
+   unsigned f;
+   int status = 0;
+
+   printf("%8s %12s %12s %8s\n", "inserts", "scan ns", "index ns", "hits");
+
+   for (f = 0; f < sizeof(fills) / sizeof(fills[0]); f++) {
+      LogFS_InsIndex ix;
+      uint32_t n = fills[f];
+      uint32_t i, hits = 0;
+      volatile uint32_t sink = 0;
+      double tScan, tIndex;
+
+      srand(f + 1);
+      LogFS_InsIndexInit(&ix, BENCH_MAX_INSERTS);
+
+      /* Guest-like writes: mostly small, a few large, some rewrites of
+       * recent ones */
+
+      for (i = 0; i < n; i++) {
+         uint64_t len = (rand() % 8 == 0) ? 8 + rand() % 248 : 1 + rand() % 16;
+
+         if (i > 0 && rand() % 4 == 0) {
+            ins[i].from = ins[rand() % i].from + rand() % 8;
+         } else {
+            ins[i].from = rand() % (diskBlocks - len);
+         }
+         ins[i].to = ins[i].from + len;
+         LogFS_InsIndexPaint(&ix, ins[i].from, ins[i].to, i);
+      }
+
+      for (i = 0; i < lookups; i++) {
+         xs[i] = (i % 2) ? ins[rand() % n].from + rand() % 4 :
+                           (uint64_t) rand() % diskBlocks;
+      }
+
+      for (i = 0; i < lookups; i++) {
+         uint64_t e1 = ~0ULL, e2 = ~0ULL, from;
+         uint32_t t1 = 0, t2 = 0;
+         int r1 = lookup_scan(ins, n, xs[i], &t1, &e1);
+         int r2 = LogFS_InsIndexLookup(&ix, xs[i], &from, &t2, &e2);
+
+         if (r1 != r2 || e1 != e2 || (r1 && t1 != t2)) {
+            printf("MISMATCH at block %llu\n", (unsigned long long) xs[i]);
+            status = 1;
+            break;
+         }
+         hits += r1;
+      }
+
+      tScan = now();
+      for (i = 0; i < lookups; i++) {
+         uint64_t e = ~0ULL;
+         uint32_t t = 0;
+         sink += lookup_scan(ins, n, xs[i], &t, &e);
+      }
+      tScan = now() - tScan;
+
+      tIndex = now();
+      for (i = 0; i < lookups; i++) {
+         uint64_t e = ~0ULL, from;
+         uint32_t t = 0;
+         sink += LogFS_InsIndexLookup(&ix, xs[i], &from, &t, &e);
+      }
+      tIndex = now() - tIndex;
+
+      printf("%8u %12.1f %12.1f %8u\n", n, tScan * 1e9 / lookups,
+             tIndex * 1e9 / lookups, hits);
+
+      /* Flushing oldest first has to leave the index empty */
+
+      for (i = 0; i < n; i++) {
+         LogFS_InsIndexRemove(&ix, ins[i].from, ins[i].to, i);
+      }
+      if (ix.numUsed != 0) {
+         printf("%u segments left after flushing\n", ix.numUsed);
+         status = 1;
+      }
+
+      LogFS_InsIndexCleanup(&ix);
+   }
+
+   free(ins);
+   free(xs);
+   return status;
+}
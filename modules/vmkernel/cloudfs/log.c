@@ -32,15 +32,15 @@ OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
 IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 #include "globals.h"
+#include "common.h"
 #include "logfsLog.h"
 #include "logfsIO.h"
 #include "metaLog.h"
 
 typedef struct LogFS_LogWriteContext {
    LogFS_Log *log;
-   log_offset_t logEnd;
-   struct LogFS_LogWriteContext *prev;
-   List_Links tokenChain;
+   LogFS_LogRingSlot slot;      /* in log->ring while in flight */
+   List_Links acked;
 
    /* Information needed if retrying the write */
    Async_Token *token;
@@ -53,13 +53,30 @@ typedef struct LogFS_LogWriteContext {
 
 } LogFS_LogWriteContext;
 
-typedef struct {
-   Async_Token *token;
+/* Group commit. Appends from many VMs tend to be small, and they all go to
+ * the tail of the same log segment. Rather than issuing a device write for
+ * each of them, writes that arrive while an earlier write to the segment is
+ * still in flight are collected in a batch, which goes to disk as a single
+ * IO once the write in flight completes, the batch holds groupCommitBytes,
+ * or a write arrives more than groupCommitWindowUS after the batch was
+ * opened. A lone writer never has to wait. */
+
+#define LOGFS_BATCH_MAX_WRITES 64
+#define LOGFS_BATCH_MAX_SG 512
+
+typedef struct LogFS_LogBatch {
    LogFS_Log *log;
-   log_offset_t logEnd;
+   SG_Array *sgArr;
+   log_offset_t end;            /* where the next write has to start */
+   size_t bytes;
+   uint64 openedCycles;
+   uint64 queuedCycles;         /* sum of enqueue times, for stats */
+   int flags;                   /* union of the writes' flags */
+   int retries;
 
-   List_Links tokenChain;
-} LogFS_LogTokenChainElement;
+   int numWrites;
+   Async_Token *tokens[LOGFS_BATCH_MAX_WRITES];
+} LogFS_LogBatch;
 
 void LogFS_LogInit(LogFS_Log *log,
                    struct LogFS_MetaLog *metaLog, log_segment_id_t index)
@@ -67,13 +84,34 @@ void LogFS_LogInit(LogFS_Log *log,
    log->alive = 1;
    log->index = index;
    log->metaLog = metaLog;
+   log->segmentSize = metaLog->segmentSize;
    SP_InitLock("logWriteLock", &log->writeLock, SP_RANK_APPENDLOG);
    Atomic_Write(&log->isAppendLog, 0);
    log->buffer = NULL;
-   log->prevWriteContext = NULL;
-
-   Atomic_Write(&log->end, LOG_MAX_SEGMENT_SIZE);
-   log->stableEnd = LOG_MAX_SEGMENT_SIZE;
+   log->fingerPrint = NULL;
+   log->nextRetired = NULL;
+
+   LogFS_LogRingInit(&log->ring);
+   log->stableFn = NULL;
+   log->stableData = NULL;
+   log->stableTarget = 0;
+
+   log->failed = FALSE;
+   log->failedAt = 0;
+   log->linked = FALSE;
+   log->linkPos = 0;
+   log->forward = 0;
+
+   log->pendingBatch = NULL;
+   log->batchesInFlight = 0;
+   log->batches = 0;
+   log->batchedWrites = 0;
+   log->batchedBytes = 0;
+   log->batchDelayCycles = 0;
+   log->maxBatchWrites = 0;
+
+   Atomic_Write(&log->end, log->segmentSize);
+   log->stableEnd = log->segmentSize;
 }
 
 void LogFS_AppendLogInit(LogFS_Log *log,
@@ -89,9 +127,9 @@ void LogFS_AppendLogInit(LogFS_Log *log,
 
 char *LogFS_LogEnableBuffering(LogFS_Log *log)
 {
-   log->buffer = aligned_malloc(LOG_MAX_SEGMENT_SIZE);
+   log->buffer = aligned_malloc(log->segmentSize);
    ASSERT(log->buffer);
-   memset(log->buffer, 0, LOG_MAX_SEGMENT_SIZE);
+   memset(log->buffer, 0, log->segmentSize);
    return log->buffer;
 }
 
@@ -100,11 +138,20 @@ log_segment_id_t LogFS_LogGetSegment(LogFS_Log *log)
    return log->index;
 }
 
+static inline LogFS_LogWriteContext *
+LogFS_LogSlotContext(LogFS_LogRingSlot *s)
+{
+   return (LogFS_LogWriteContext *)
+      ((char *)s - offsetof(LogFS_LogWriteContext, slot));
+}
+
+static void LogFS_LogWriteLink(LogFS_Log *log, log_offset_t pos, Bool seal,
+                               int flags);
+
 void LogFS_LogWriteDone(Async_Token * token, void *data)
 {
    LogFS_LogWriteContext *c = data;
-   Bool postponeCallback;
-   //VMK_ReturnStatus transientStatus = token->transientStatus;
+   VMK_ReturnStatus status = token->transientStatus;
 
    /* If the write gets aborted we will have no other choice than to 
     * retry the write until it succeeds, XXX implement that */
@@ -118,8 +165,10 @@ void LogFS_LogWriteDone(Async_Token * token, void *data)
    if (token->transientStatus == VMK_ABORTED
        || token->transientStatus == VMK_BUSY
        || token->transientStatus == VMK_STORAGE_RETRY_OPERATION) {
+      /* The write keeps its slot in the ring, which only gets marked done
+       * once the retried IO is over */
+
       zprintf("WARNING retry aborted write!\n");
-      VMK_ReturnStatus status;
       Async_Token *retryToken = Async_AllocToken(0);
 
       LogFS_LogWriteContext *rc = Async_PushCallbackFrame(retryToken,
@@ -140,11 +189,14 @@ void LogFS_LogWriteDone(Async_Token * token, void *data)
                                     LogFS_LogSegmentsSection);
       } while (status == VMK_STORAGE_RETRY_OPERATION);
 
-      ASSERT(status == VMK_OK);
+      if (status != VMK_OK) {
+         retryToken->transientStatus = status;
+         Async_TokenCallback(retryToken);
+      }
       return;
    }
 
-   /* The IO went well, now lets release the temp tokens used for retries, if any */
+   /* The IO is over, now lets release the temp tokens used for retries, if any */
 
    while (c->origContext != NULL) {
       Async_Token *tmp = c->origContext->token;
@@ -154,88 +206,288 @@ void LogFS_LogWriteDone(Async_Token * token, void *data)
       token = tmp;
    }
 
-   if (token->transientStatus != VMK_OK
-       && token->transientStatus != VMK_ABORTED
-       && token->transientStatus != VMK_STORAGE_RETRY_OPERATION)
-      Panic("token not ok %s\n",
-            VMK_ReturnStatusToString(token->transientStatus));
+   if (status != VMK_OK) {
+      zprintf("log write failed: %s\n", VMK_ReturnStatusToString(status));
+
+      /* Without the seal, nothing after the failure is ever stable */
+      if (c->slot.seal)
+         Panic("cannot seal log %ld at %" FMT64 "u: %s!\n", c->log->index,
+               c->slot.start, VMK_ReturnStatusToString(status));
+   }
 
-   /* If we are completing ahead of an IO that happened-before us, we set
-    * it's logEnd counter to ours, and unlink ourself from the list */
+   /* Writes that complete ahead of their predecessors stay in the ring
+    * and are acknowledged once the gap in front of them closes. */
 
    LogFS_Log *log = c->log;
+   LogFS_LogStableFn *stableFn = NULL;
+   void *stableData = NULL;
+   LogFS_LogRingSlot *slot;
+   List_Links acked;
+   List_Links *curr, *next;
+   Bool failed, relink = FALSE;
+
+   List_Init(&acked);
 
    SP_Lock(&log->writeLock);
 
-   if (c->prev) {
-      /* In case we finished before our predecessor, We cannot acknowledge the write yet.
-       * Instead we link it on the to-be-acknowledged list of our predecessor */
-      LogFS_LogTokenChainElement *tc =
-          malloc(sizeof(LogFS_LogTokenChainElement));
-      tc->token = token;
-      tc->log = c->log;
-      tc->logEnd = c->logEnd;
-      List_Insert(&tc->tokenChain, LIST_ATREAR(&c->prev->tokenChain));
-      postponeCallback = TRUE;
-   } else {
-      log->stableEnd = MAX(c->logEnd, log->stableEnd);
-      postponeCallback = FALSE;
+   failed = log->failed;
+   LogFS_LogRingComplete(&c->slot, status);
+   while ((slot = LogFS_LogRingRetire(&log->ring, &log->stableEnd)) != NULL) {
+      List_Insert(&LogFS_LogSlotContext(slot)->acked, LIST_ATREAR(&acked));
    }
 
-   /* Is this IO the tail of the list of pending writes? */
-   if (c == log->prevWriteContext) {
-      /* Make our predecessor the new tail */
-      log->prevWriteContext = c->prev;
+   /* Recovery cannot get past the first failed write, so the segment ends
+    * where stableEnd stopped. Appenders move on to a new segment, and if
+    * this one already points to it, the pointer moves back to the end. */
+
+   if (!failed && log->ring.status != 0) {
+      log->failed = TRUE;
+      log->failedAt = log->stableEnd;
+      if (log->linked && log->failedAt <= log->linkPos) {
+         ASSERT(log->stableFn != NULL);
+         log->linkPos = log->failedAt;
+         log->stableTarget = log->failedAt + LOG_HEAD_SIZE;
+         relink = TRUE;
+      }
    }
-   /* If not, then find the next down from us so we can unlink */
-   else {
-      LogFS_LogWriteContext *successor;
 
-      for (successor = log->prevWriteContext; successor->prev != c; successor = successor->prev)   //;
-      {
-         if (successor->log != log) {
-            Panic("%p != %p\n", successor->log, log);
-         }
-         ASSERT(successor->log == log);
-      }
+   if (log->stableFn != NULL && log->stableEnd >= log->stableTarget) {
+      stableFn = log->stableFn;
+      stableData = log->stableData;
+      log->stableFn = NULL;
+   }
+
+   SP_Unlock(&log->writeLock);
 
-      ASSERT(successor->prev == c);
+   if (!failed && log->failed) {
+      zprintf("log %ld sealed at %ld\n", log->index, log->failedAt);
+   }
+   if (relink) {
+      LogFS_LogWriteLink(log, log->failedAt, TRUE, c->flags);
+   }
 
-      successor->prev = c->prev;
-      c->prev = NULL;
+   if (stableFn != NULL) {
+      stableFn(log, stableData);
    }
 
+   /* Acknowledging may drop the last reference to the log */
+
+   LIST_FORALL_SAFE(&acked, curr, next) {
+      LogFS_LogWriteContext *p = List_Entry(curr, LogFS_LogWriteContext, acked);
+      Async_Token *t = p->token;
+
+      List_Remove(curr);
+      t->transientStatus = p->slot.status;
+      LogFS_MetaLogPutLog(log->metaLog, log);
+      Async_TokenCallback(t);
+   }
+}
+
+/* Takes the pending batch off the log for submission. Called with
+ * writeLock held. */
+
+static LogFS_LogBatch *
+LogFS_LogBatchDetach(LogFS_Log *log)
+{
+   LogFS_LogBatch *b = log->pendingBatch;
+
+   log->pendingBatch = NULL;
+   ++(log->batchesInFlight);
+
+   ++(log->batches);
+   log->batchedWrites += b->numWrites;
+   log->batchedBytes += b->bytes;
+   log->batchDelayCycles += b->numWrites * Timer_GetCycles() - b->queuedCycles;
+   log->maxBatchWrites = MAX(log->maxBatchWrites, b->numWrites);
+
+   return b;
+}
+
+static void LogFS_LogBatchSubmit(LogFS_LogBatch *b);
+
+/* Hand STATUS to every write in batch B and free it. If the device went
+ * idle, the batch that queued up behind B goes out first, as completing
+ * the writes may drop the last reference to the log. */
+
+static void
+LogFS_LogBatchComplete(LogFS_LogBatch *b, VMK_ReturnStatus status)
+{
+   LogFS_Log *log = b->log;
+   LogFS_LogBatch *next = NULL;
+   int i;
+
+   SP_Lock(&log->writeLock);
+   --(log->batchesInFlight);
+   if (log->batchesInFlight == 0 && log->pendingBatch != NULL) {
+      next = LogFS_LogBatchDetach(log);
+   }
    SP_Unlock(&log->writeLock);
 
-   List_Links *curr, *next;
-   LIST_FORALL_SAFE(&c->tokenChain, curr, next) {
-      LogFS_LogTokenChainElement *tc =
-          List_Entry(curr, LogFS_LogTokenChainElement, tokenChain);
-      LogFS_Log *l = tc->log;
+   if (next != NULL) {
+      LogFS_LogBatchSubmit(next);
+   }
 
-      SP_Lock(&l->writeLock);
-      l->stableEnd = MAX(l->stableEnd, tc->logEnd);
-      SP_Unlock(&l->writeLock);
+   for (i = 0; i < b->numWrites; i++) {
+      b->tokens[i]->transientStatus = status;
+      Async_TokenCallback(b->tokens[i]);
+   }
+
+   SG_Free(LogFS_GetHeap(), &b->sgArr);
+   free(b);
+}
 
-      LogFS_MetaLogPutLog(l->metaLog, l);
+static void LogFS_LogBatchDone(Async_Token * token, void *data);
 
-      List_Remove(curr);
-      Async_TokenCallback(tc->token);
-      free(tc);
+/* Send batch B to the device. If that fails, the writes in it complete
+ * with the error right away. */
+
+static void
+LogFS_LogBatchSubmit(LogFS_LogBatch *b)
+{
+   LogFS_MetaLog *ml = b->log->metaLog;
+   Async_Token *token = Async_AllocToken(0);
+   VMK_ReturnStatus status;
+
+   *((LogFS_LogBatch **)Async_PushCallbackFrame(token, LogFS_LogBatchDone,
+                                                sizeof(LogFS_LogBatch *))) = b;
+
+   status = LogFS_DeviceWrite(ml->device, token, b->sgArr,
+                              LogFS_LogSegmentsSection);
+   if (status != VMK_OK) {
+      zprintf("batch write failed: %s\n", VMK_ReturnStatusToString(status));
+      Async_ReleaseToken(token);
+      LogFS_LogBatchComplete(b, status);
    }
+}
 
-   if (!postponeCallback) {
-      LogFS_MetaLogPutLog(log->metaLog, log);
-      Async_TokenCallback(token);
+static void
+LogFS_LogBatchDone(Async_Token * token, void *data)
+{
+   LogFS_LogBatch *b = *((LogFS_LogBatch **)data);
+   int i;
+
+   if (token->transientStatus == VMK_BUSY && (b->flags & FS_CANTBLOCK) == 0) {
+      zprintf("got busy\n");
+      if ((!PRDA_BHInProgress()) && (!PRDA_InInterruptHandler()))
+         CpuSched_Sleep(1);
+   }
+
+   if (token->transientStatus == VMK_ABORTED
+       || token->transientStatus == VMK_BUSY
+       || token->transientStatus == VMK_STORAGE_RETRY_OPERATION) {
+      LogFS_MetaLog *ml = b->log->metaLog;
+      log_offset_t diskOffset =
+          LogFS_DiskLayoutGetOffset(&ml->device->diskLayout,
+                                    LogFS_LogSegmentsSection);
+
+      zprintf("WARNING retry aborted batch write!\n");
+      if (++(b->retries) > 50)
+         Panic(">50 retries %d %s!\n", b->retries,
+               VMK_ReturnStatusToString(token->transientStatus));
+
+      /* LogFS_DeviceWrite() made the offsets absolute */
+      for (i = 0; i < b->sgArr->length; i++) {
+         b->sgArr->sg[i].offset -= diskOffset;
+      }
+
+      Async_ReleaseToken(token);
+      LogFS_LogBatchSubmit(b);
+      return;
+   }
+
+   if (token->transientStatus != VMK_OK)
+      zprintf("batch write failed: %s\n",
+              VMK_ReturnStatusToString(token->transientStatus));
+
+   LogFS_LogBatchComplete(b, token->transientStatus);
+   Async_ReleaseToken(token);
+}
+
+/* Queue a write for the device, batching it with others if the device is
+ * busy with this log already. From here on the outcome of the write,
+ * including a failure to submit it, is reported through TOKEN. */
+
+static void
+LogFS_LogGroupCommit(LogFS_Log *log, Async_Token *token, SG_Array *sgArr,
+                     int flags)
+{
+   LogFS_MetaLog *ml = log->metaLog;
+   LogFS_LogBatch *b, *full = NULL, *submit = NULL;
+   log_offset_t offset = sgArr->sg[0].offset;
+   size_t length = SG_TotalLength(sgArr);
+   uint64 now = Timer_GetCycles();
+   int i;
+
+   SP_Lock(&log->writeLock);
+
+   /* Writes are batched only if they follow each other on disk */
+
+   b = log->pendingBatch;
+   if (b != NULL && (b->end != offset ||
+                     b->numWrites == LOGFS_BATCH_MAX_WRITES ||
+                     b->sgArr->length + sgArr->length > LOGFS_BATCH_MAX_SG)) {
+      full = LogFS_LogBatchDetach(log);
+      b = NULL;
+   }
+
+   if (b == NULL) {
+      b = malloc(sizeof(LogFS_LogBatch));
+      b->log = log;
+      b->sgArr = SG_Alloc(LogFS_GetHeap(), LOGFS_BATCH_MAX_SG);
+      b->sgArr->addrType = sgArr->addrType;
+      b->sgArr->length = 0;
+      b->end = offset;
+      b->openedCycles = now;
+      log->pendingBatch = b;
+   }
+
+   ASSERT(b->sgArr->addrType == sgArr->addrType);
+   for (i = 0; i < sgArr->length; i++) {
+      b->sgArr->sg[b->sgArr->length++] = sgArr->sg[i];
+   }
+   b->tokens[b->numWrites++] = token;
+   b->flags |= flags;
+   b->end += length;
+   b->bytes += length;
+   b->queuedCycles += now;
+
+   if (log->batchesInFlight == 0 ||
+       b->bytes >= ml->groupCommitBytes ||
+       Timer_AbsTCToUS(now - b->openedCycles) >= ml->groupCommitWindowUS) {
+      submit = LogFS_LogBatchDetach(log);
+   }
+
+   SP_Unlock(&log->writeLock);
+
+   if (full != NULL) {
+      LogFS_LogBatchSubmit(full);
+   }
+   if (submit != NULL) {
+      LogFS_LogBatchSubmit(submit);
    }
 }
 
+void
+LogFS_LogShowBatchStats(LogFS_Log *log)
+{
+   if (log->batches == 0) {
+      return;
+   }
+   zprintf("segment %" FMT64 "u: %" FMT64 "u writes in %" FMT64
+           "u batches, avg %" FMT64 "u bytes, max %d writes, "
+           "avg added latency %" FMT64 "uus\n",
+           log->index, log->batchedWrites, log->batches,
+           log->batchedBytes / log->batches, log->maxBatchWrites,
+           Timer_AbsTCToUS(log->batchDelayCycles) / log->batchedWrites);
+}
+
 /*
  *-----------------------------------------------------------------------------
  *
  * LogFS_LogWriteBody --
  *
- *      Random write to a log segment.
+ *      Random write to a log segment. An async write that SEALs the segment
+ *      at its first failure may be written where stableEnd stopped.
  *
  * Results:
  *      VMK_LIMIT_EXCEEDED if out of bounds, or IO result.
@@ -246,14 +498,16 @@ void LogFS_LogWriteDone(Async_Token * token, void *data)
  *-----------------------------------------------------------------------------
  */
 
-VMK_ReturnStatus
-LogFS_LogWriteBody(LogFS_Log *log,
-                   Async_Token *token,
-                   SG_Array *sgArr,
-                   int flags)
+static VMK_ReturnStatus
+LogFS_LogWriteBodyInt(LogFS_Log *log,
+                      Async_Token *token,
+                      SG_Array *sgArr,
+                      int flags,
+                      Bool seal)
 {
    int i;
    VMK_ReturnStatus status;
+   LogFS_LogWriteContext *c = NULL;
 
    LogFS_MetaLog *ml = log->metaLog;
    LogFS_Device *device = ml->device;
@@ -266,7 +520,7 @@ LogFS_LogWriteBody(LogFS_Log *log,
 
    log_offset_t newEnd = sgArr->sg[0].offset + SG_TotalLength(sgArr);
 
-   if (newEnd > LOG_MAX_SEGMENT_SIZE) {
+   if (newEnd > log->segmentSize) {
       return VMK_LIMIT_EXCEEDED;
    }
 
@@ -303,19 +557,18 @@ LogFS_LogWriteBody(LogFS_Log *log,
 
       /* For async IO, we do not know in which order the writes will complete.
        * Because of the way log recovery works, we cannot ack writes back to
-       * the caller before all previous writes in the log have completed. We
-       * maintain a reverse linked list so that we each write knows about any
-       * incomplete predecessors and we can delay the ack if necessary. */
+       * the caller before all previous writes in the log have completed.
+       * LogFS_LogWriteDone() holds back the ack if necessary. */
 
       if (token) {
-         LogFS_LogWriteContext *c = Async_PushCallbackFrame(token,
-                                                            LogFS_LogWriteDone,
-                                                            sizeof
-                                                            (LogFS_LogWriteContext));
+         c = Async_PushCallbackFrame(token, LogFS_LogWriteDone,
+                                     sizeof(LogFS_LogWriteContext));
          memset(c, 0, sizeof(LogFS_LogWriteContext));
 
          c->log = log;
-         c->logEnd = newEnd;
+         c->slot.start = newEnd - SG_TotalLength(sgArr);
+         c->slot.end = newEnd;
+         c->slot.seal = seal;
 
          c->token = token;
          c->device = device;
@@ -324,40 +577,31 @@ LogFS_LogWriteBody(LogFS_Log *log,
          c->flags = flags;
          c->retries = 0;
 
-         List_Init(&c->tokenChain);
          Atomic_Inc(&log->refCount);
 
          SP_Lock(&log->writeLock);
+         LogFS_LogRingArm(&log->ring, &c->slot);
+         SP_Unlock(&log->writeLock);
+      }
 
-         LogFS_LogWriteContext *next = NULL;
-         LogFS_LogWriteContext *e;
-
-         for (e = log->prevWriteContext; e && e->logEnd > c->logEnd;
-              next = e, e = e->prev) {
-            /* we reached the last element */
-            if (e->prev == NULL) {
-               e->prev = c;
-               c->prev = NULL;
-               goto done;
-            }
-         }
-
-         if (e == log->prevWriteContext) {
-            log->prevWriteContext = c;
-            c->prev = e;
-         } else {
-            c->prev = next->prev;
-            next->prev = c;
-         }
+      if (token != NULL && ml->groupCommitWindowUS > 0 &&
+          sgArr->length <= LOGFS_BATCH_MAX_SG) {
+         LogFS_LogGroupCommit(log, token, sgArr, flags);
+         status = VMK_OK;
+      } else {
+         status = LogFS_DeviceWrite(device, token, sgArr,
+                                    LogFS_LogSegmentsSection);
 
- done:
+         /* The write already holds a slot and a reference to the log,
+          * so it has to go through LogFS_LogWriteDone() either way */
 
-         SP_Unlock(&log->writeLock);
+         if (status != VMK_OK && c != NULL) {
+            token->transientStatus = status;
+            Async_TokenCallback(token);
+            status = VMK_OK;
+         }
       }
 
-      status = LogFS_DeviceWrite(device, token, sgArr,
-                                 LogFS_LogSegmentsSection);
-
       /* If synchronous IO, update the stableEnd pointer for the log segments
        * right away. Otherwise that will happen in the completion callback. */
 
@@ -374,6 +618,71 @@ LogFS_LogWriteBody(LogFS_Log *log,
    return status;
 }
 
+VMK_ReturnStatus
+LogFS_LogWriteBody(LogFS_Log *log,
+                   Async_Token *token,
+                   SG_Array *sgArr,
+                   int flags)
+{
+   return LogFS_LogWriteBodyInt(log, token, sgArr, flags, FALSE);
+}
+
+/* Write the pointer to the segment following LOG at POS. Nobody waits for
+ * this; the head is freed when done. */
+
+static void
+LogFS_LogWriteLink(LogFS_Log *log, log_offset_t pos, Bool seal, int flags)
+{
+   VMK_ReturnStatus status;
+   Async_Token *token = Async_AllocToken(0);
+   void *head = aligned_malloc(LOG_HEAD_SIZE);
+   log_id_t next;
+   SG_Array sg;
+
+   ASSERT(head);
+   next.v.segment = log->forward;
+   next.v.blk_offset = 0;
+   init_forward_pointer(head, next);
+
+   *((void **)Async_PushCallbackFrame(token, LogFS_FreeSimpleBufferAndToken,
+                                      sizeof(void *))) = head;
+
+   SG_SingletonSGArray(&sg, pos, (VA) head, LOG_HEAD_SIZE, SG_VIRT_ADDR);
+   do {
+      status = LogFS_LogWriteBodyInt(log, token, &sg, flags, seal);
+   } while (status == VMK_STORAGE_RETRY_OPERATION);
+   ASSERT(status == VMK_OK);
+}
+
+/* Point LOG, sealed at END, to the segment NEXT, and have FN called, once,
+ * when everything up to and including the pointer is on disk. If a write
+ * to LOG has failed, the pointer goes where stableEnd stopped instead.
+ * Returns where the pointer went, which may still move back if a write
+ * fails later. */
+
+log_offset_t
+LogFS_LogLinkNext(LogFS_Log *log, log_offset_t end, log_segment_id_t next,
+                  LogFS_LogStableFn *fn, void *data, int flags)
+{
+   log_offset_t pos;
+   Bool seal;
+
+   SP_Lock(&log->writeLock);
+   ASSERT(log->stableFn == NULL && !log->linked);
+   seal = log->failed;
+   pos = seal ? log->failedAt : end;
+   log->forward = next;
+   log->linked = TRUE;
+   log->linkPos = pos;
+   log->stableFn = fn;
+   log->stableData = data;
+   log->stableTarget = pos + LOG_HEAD_SIZE;
+   SP_Unlock(&log->writeLock);
+
+   LogFS_LogWriteLink(log, pos, seal, flags);
+   return pos;
+}
+
 /*
  *-----------------------------------------------------------------------------
  *
@@ -491,11 +800,6 @@ LogFS_AppendLogAppend(LogFS_Log *log,
                       SG_Array *sgArr,
                       log_id_t *result, int flags)
 {
-   VMK_ReturnStatus status;
-   log_offset_t position;
-   size_t count = SG_TotalLength(sgArr);
-   int i;
-
    if (!LogFS_LogIsAppendLog(log)) {
       mk_invalid_version(inv);
       zprintf("%lu is not an appendlog!\n",log->index);
@@ -505,7 +809,70 @@ LogFS_AppendLogAppend(LogFS_Log *log,
       return VMK_BAD_PARAM;
    }
 
-   position = Atomic_FetchAndAdd(&log->end, count);
+   return LogFS_AppendLogAppendAt(log, token, sgArr,
+                                  Atomic_FetchAndAdd(&log->end,
+                                                     SG_TotalLength(sgArr)),
+                                  result, flags);
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LogFS_AppendLogReserve --
+ *
+ *      Reserve COUNT bytes at the end of an appendable log segment, leaving
+ *      at least TAIL bytes free after them. Lock-free, so that appenders on
+ *      different CPUs do not serialize.
+ *
+ * Results:
+ *      FALSE if the segment is too full, sealed, or a write to it failed.
+ *
+ * Side effects:
+ *      log->end is moved past the reservation, which starts at *position.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+Bool
+LogFS_AppendLogReserve(LogFS_Log *log, log_size_t count, log_size_t tail,
+                       log_offset_t *position)
+{
+   uint32 end;
+
+   do {
+      end = Atomic_Read(&log->end);
+      if (log->failed || end + count + tail > log->segmentSize) {
+         return FALSE;
+      }
+   } while (Atomic_ReadIfEqualWrite(&log->end, end, end + count) != end);
+
+   *position = end;
+   return TRUE;
+}
+
+/* Make all further reservations fail, and return where the segment ends. */
+
+log_offset_t
+LogFS_AppendLogSeal(LogFS_Log *log)
+{
+   log_offset_t end = Atomic_FetchAndAdd(&log->end, 2 * log->segmentSize);
+
+   ASSERT(end <= log->segmentSize);
+   return end;
+}
+
+/* Write SGARR to space reserved at POSITION. */
+
+VMK_ReturnStatus
+LogFS_AppendLogAppendAt(LogFS_Log *log,
+                        Async_Token * token,
+                        SG_Array *sgArr,
+                        log_offset_t position,
+                        log_id_t *result, int flags)
+{
+   VMK_ReturnStatus status;
+   size_t count = SG_TotalLength(sgArr);
+   int i;
 
    for(i=0;i<sgArr->length;++i) {
       sgArr->sg[i].offset += position;
@@ -557,6 +924,19 @@ int LogFS_LogIsAppendLog(LogFS_Log *log)
 
 VMK_ReturnStatus
 LogFS_AppendLogClose(LogFS_Log *log, Async_Token * token, int flags)
+{
+   SP_Lock(&log->writeLock);
+   log_offset_t end = Atomic_FetchAndAdd(&log->end, BLKSIZE);
+   SP_Unlock(&log->writeLock);
+
+   return LogFS_AppendLogCloseAt(log, token, end, flags);
+}
+
+/* Close a log segment, zeroing it from END onwards. */
+
+VMK_ReturnStatus
+LogFS_AppendLogCloseAt(LogFS_Log *log, Async_Token * token, log_offset_t end,
+                       int flags)
 {
    VMK_ReturnStatus status;
 
@@ -569,11 +949,7 @@ LogFS_AppendLogClose(LogFS_Log *log, Async_Token * token, int flags)
 
    Atomic_Write(&log->isAppendLog, 0);
 
-   SP_Lock(&log->writeLock);
-   log_offset_t end = Atomic_FetchAndAdd(&log->end, BLKSIZE);
-   SP_Unlock(&log->writeLock);
-
-   ASSERT(end + BLKSIZE <= LOG_MAX_SEGMENT_SIZE);
+   ASSERT(end + BLKSIZE <= log->segmentSize);
 
    if(token==NULL)
    {
@@ -585,7 +961,7 @@ LogFS_AppendLogClose(LogFS_Log *log, Async_Token * token, int flags)
    Async_Token *bodyToken = Async_PrepareOneIO(ioh, NULL);
 
    /* Zero the rest of the blocks in the segment to prevent data leaks */
-   size_t left = BLKSIZE*LOG_MAX_SEGMENT_BLOCKS - end;
+   size_t left = log->segmentSize - end;
 
    if (log->buffer) {
 
@@ -600,7 +976,7 @@ LogFS_AppendLogClose(LogFS_Log *log, Async_Token * token, int flags)
       /* Write the log buffer */
 
       do {
-         status = LogFS_DeviceWriteSimple(device, bodyToken, log->buffer, LOG_MAX_SEGMENT_SIZE,
+         status = LogFS_DeviceWriteSimple(device, bodyToken, log->buffer, log->segmentSize,
                                     _cursor(log, 0), LogFS_LogSegmentsSection);
       } while (status == VMK_STORAGE_RETRY_OPERATION);
 
@@ -642,5 +1018,6 @@ LogFS_AppendLogClose(LogFS_Log *log, Async_Token * token, int flags)
 void LogFS_LogClose(LogFS_Log *log)
 {
    log->alive = 0;
+   LogFS_LogRingCleanup(&log->ring);
    SP_CleanupLock(&log->writeLock);
 }
@@ -308,7 +308,7 @@ static LogFS_Log *reserve(struct OutLogWrapper *wrapper, size_t sz)
       wrapper->outlog = (LogFS_Log *)malloc(sizeof(LogFS_Log));
       ASSERT(wrapper->outlog != NULL);
 
-      wrapper->spaceLeft = LOG_MAX_SEGMENT_SIZE;
+      wrapper->spaceLeft = ml->segmentSize;
       LogFS_AppendLogInit(wrapper->outlog, ml, id, 0);
       LogFS_LogEnableBuffering(wrapper->outlog);
 
@@ -365,17 +365,18 @@ void LogFS_MetaLogCompact(LogFS_MetaLog *ml, LogFS_Log **logs, int num_segments)
    batched_updates.num_referers = 0;
    batched_updates.num_remaps = 0;
 
-   char *buffer = (char *)aligned_malloc(LOG_MAX_SEGMENT_SIZE);
+   char *buffer = (char *)aligned_malloc(ml->segmentSize);
    ASSERT(buffer);
 
-   struct log_head *outhead = (struct log_head *)aligned_malloc(LOG_HEAD_SIZE);
+   const size_t outheadMax = LOG_HEAD_SIZE * (1 + LOG_MAX_REFS_BLOCKS);
+   struct log_head *outhead = (struct log_head *)aligned_malloc(outheadMax);
 
    for (i = 0; i < num_segments; i++) {
       char *b = buffer;
 
       LogFS_Log *log = logs[i];
       printf("gc segment %" FMT64 "d\n", log->index);
-      LogFS_LogReadBody(log, NULL, b, LOG_MAX_SEGMENT_SIZE, 0);
+      LogFS_LogReadBody(log, NULL, b, ml->segmentSize, 0);
 
       schedule_gc();
 
@@ -386,12 +387,7 @@ void LogFS_MetaLogCompact(LogFS_MetaLog *ml, LogFS_Log **logs, int num_segments)
 
          if (head->tag == log_entry_type) {
             size_t sz;
-            struct sha1_ctx ctx;
-            unsigned short num_blocks = head->update.num_blocks;
-            sha1_init(&ctx);
-            sha1_update(&ctx, sizeof(log_block_t),
-                        (const uint8_t *)&head->update.blkno);
-            sha1_update(&ctx, sizeof(num_blocks), (const uint8_t *)&num_blocks);
+            log_checksum_ctx ctx;
 
             LogFS_VDisk *vd =
                 LogFS_DiskMapLookupDisk(LogFS_HashFromRaw(head->disk));
@@ -406,12 +402,22 @@ void LogFS_MetaLogCompact(LogFS_MetaLog *ml, LogFS_Log **logs, int num_segments)
 
             size_t entrySize = (char *)head->update.refs - (char *)head;
             memcpy(outhead, head, entrySize);
-            memset((char *)outhead + entrySize, 0, LOG_HEAD_SIZE - entrySize);
+            memset((char *)outhead + entrySize, 0, outheadMax - entrySize);
+
+            /* Large entries keep their overflow refs blocks, as the extent
+             * stays the same */
+            size_t headSize = log_entry_head_size(head);
+            log_ref_t *refs = log_entry_refs(head);
+            log_ref_t *outrefs = log_entry_refs(outhead);
+
+            /* The compacted entry keeps the checksum algorithm of the
+             * original */
+            log_entry_checksum_begin(&ctx, outhead);
 
             int j;
-            for (i = 0, j = 0, sz = LOG_HEAD_SIZE; i < head->update.num_blocks;
+            for (i = 0, j = 0, sz = headSize; i < head->update.num_blocks;
                  i++) {
-               if (BitTest(head->update.refs,i)) {
+               if (BitTest(refs,i)) {
                   log_block_t endsat = MAXBLOCK;
 
                   log_id_t v =
@@ -419,13 +425,13 @@ void LogFS_MetaLogCompact(LogFS_MetaLog *ml, LogFS_Log **logs, int num_segments)
                                                 &endsat);
 
                   if (is_invalid_version(v) || v.v.segment == log->index) {
-                     char *blkdata = b + LOG_HEAD_SIZE + j * BLKSIZE;
-                     BitSet(outhead->update.refs,i);
-                     sha1_update(&ctx, BLKSIZE, (const uint8_t *)blkdata);
+                     char *blkdata = b + headSize + j * BLKSIZE;
+                     BitSet(outrefs,i);
+                     log_checksum_update(&ctx, BLKSIZE, blkdata);
 
                      sz += BLKSIZE;
                   } else {
-                     BitClear(outhead->update.refs,i);
+                     BitClear(outrefs,i);
                   }
 
                   ++j;
@@ -437,13 +443,14 @@ void LogFS_MetaLogCompact(LogFS_MetaLog *ml, LogFS_Log **logs, int num_segments)
                                                 LogFS_LogGetSegment(log),
                                                 LogFS_LogGetSegment(outlog));
 
-            sha1_update(&ctx, LOG_HEAD_SIZE - sizeof(struct log_head),
-                        (const uint8_t *)outhead->update.refs);
-            sha1_digest(&ctx, SHA1_DIGEST_SIZE, outhead->update.checksum);
+            if (log_entry_refs_blocks(outhead) > 0) {
+               log_entry_set_body_blocks(outhead, (sz - headSize) / BLKSIZE);
+            }
+            log_entry_checksum_end(&ctx, outhead, outhead->update.checksum);
 
             log_id_t newver;
             status =
-                LogFS_AppendLogAppendSimple(outlog, NULL, outhead, LOG_HEAD_SIZE,
+                LogFS_AppendLogAppendSimple(outlog, NULL, outhead, headSize,
                                       &newver, 0);
             ASSERT(status == VMK_OK);
 
@@ -507,12 +514,15 @@ void LogFS_MetaLogCompact(LogFS_MetaLog *ml, LogFS_Log **logs, int num_segments)
           * the actual blocks have not. Do this, and increment the input 
           * pointer to consume all blocks from the input entry */
 
-         b += LOG_HEAD_SIZE;
+         b += log_entry_head_size(head);
 
          if (head->tag == log_entry_type) {
+            log_ref_t *refs = log_entry_refs(head);
+            log_ref_t *outrefs = log_entry_refs(outhead);
+
             for (i = 0; i < head->update.num_blocks; i++) {
                /* if present in new vector, append to output */
-               if (BitTest(outhead->update.refs,i)) {
+               if (BitTest(outrefs,i)) {
                   status =
                       LogFS_AppendLogAppendSimple(outlog, NULL, b, BLKSIZE,
                                             NULL, 0);
@@ -522,7 +532,7 @@ void LogFS_MetaLogCompact(LogFS_MetaLog *ml, LogFS_Log **logs, int num_segments)
                }
 
                /* if present in old one, consume from input */
-               if (BitTest(head->update.refs,i)) {
+               if (BitTest(refs,i)) {
                   b += BLKSIZE;
                }
             }
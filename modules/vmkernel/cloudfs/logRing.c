@@ -0,0 +1,153 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * logRing.c --
+ *
+ *      Completion ring for the async writes to a log segment. See
+ *      logRing.h.
+ */
+
+#include "system.h"
+#include "logRing.h"
+
+void
+LogFS_LogRingInit(LogFS_LogRing *r)
+{
+   r->slots = NULL;
+   r->size = 0;
+   r->head = 0;
+   r->tail = 0;
+   r->status = 0;
+   r->failedEnd = 0;
+}
+
+void
+LogFS_LogRingCleanup(LogFS_LogRing *r)
+{
+   ASSERT(LogFS_LogRingIsEmpty(r));
+   free(r->slots);
+   r->slots = NULL;
+   r->size = 0;
+}
+
+/* Give the write in S a slot in the ring. */
+
+void
+LogFS_LogRingArm(LogFS_LogRing *r, LogFS_LogRingSlot *s)
+{
+   uint64_t i;
+
+   if (r->tail - r->head == r->size) {
+      uint32_t size = r->size ? 2 * r->size : LOGFS_LOG_RING_SLOTS;
+      LogFS_LogRingSlot **slots = malloc(size * sizeof(*slots));
+
+      ASSERT(slots);
+      for (i = r->head; i < r->tail; i++) {
+         slots[i & (size - 1)] = r->slots[i & (r->size - 1)];
+      }
+      free(r->slots);
+      r->slots = slots;
+      r->size = size;
+   }
+
+   /* A write that was submitted after one following it in the segment
+    * moves in front of it */
+
+   for (i = r->tail; i > r->head; i--) {
+      LogFS_LogRingSlot *p = r->slots[(i - 1) & (r->size - 1)];
+      if (p->start < s->start) {
+         break;
+      }
+      r->slots[i & (r->size - 1)] = p;
+   }
+   r->slots[i & (r->size - 1)] = s;
+   ++(r->tail);
+
+   s->done = 0;
+   s->status = 0;
+}
+
+/* The write in S is finished, with STATUS 0 if it reached the disk. A
+ * retried write only completes once, when the retry is over. */
+
+void
+LogFS_LogRingComplete(LogFS_LogRingSlot *s, int32_t status)
+{
+   ASSERT(!s->done);
+   s->done = 1;
+   s->status = status;
+}
+
+/* Take the oldest slot off the ring, if it is done and nothing in front of
+ * it in the segment is still missing, and advance *STABLEEND over it. The
+ * slot's status then says whether its write can be acknowledged. Returns
+ * NULL if no slot can be retired yet.
+ *
+ * Once a write has failed, *STABLEEND stays at its start, and later slots
+ * retire in order with its error. Only a seal slot written at *STABLEEND
+ * moves it on. */
+
+LogFS_LogRingSlot *
+LogFS_LogRingRetire(LogFS_LogRing *r, uint64_t *stableEnd)
+{
+   LogFS_LogRingSlot *s;
+
+   if (r->head == r->tail) {
+      return NULL;
+   }
+   s = r->slots[r->head & (r->size - 1)];
+   if (!s->done ||
+       (!s->seal && s->start > (r->status ? r->failedEnd : *stableEnd))) {
+      return NULL;
+   }
+   ++(r->head);
+
+   if (s->seal) {
+      if (s->status == 0 && s->start == *stableEnd) {
+         *stableEnd = s->end;
+      }
+   } else if (r->status != 0) {
+      if (s->status == 0) {
+         s->status = r->status;
+      }
+      r->failedEnd = MAX(r->failedEnd, s->end);
+   } else if (s->status != 0) {
+      r->status = s->status;
+      r->failedEnd = s->end;
+   } else {
+      *stableEnd = MAX(*stableEnd, s->end);
+   }
+   return s;
+}
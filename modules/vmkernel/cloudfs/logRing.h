@@ -0,0 +1,96 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * logRing.h --
+ *
+ *      Completion ring for the async writes to a log segment. Log recovery
+ *      stops at the first hole in a segment, so a write cannot be
+ *      acknowledged until everything before it in the segment is on disk.
+ *      Every async write gets a slot in the ring when submitted, with slots
+ *      in the order of position in the segment. A completion marks its
+ *      slot done, and the done slots at the head of the ring are then
+ *      retired in order, advancing the stable end of the segment as they
+ *      go. Writes nearly always reach the ring in the order their space
+ *      was reserved, so arming a slot and retiring one are both O(1)
+ *      amortized. The ring grows when full.
+ *
+ *      A write that fails still retires, so that it does not hold up the
+ *      ring forever. Recovery cannot see past it though, so the stable end
+ *      stops at its start, and the writes behind it in the segment retire
+ *      with its error as well. The log then seals the segment with a
+ *      pointer head written where the stable end stopped, in a seal slot,
+ *      which moves the stable end over just that head.
+ *
+ *      Like insIndex.h, this gets included by user space tools, so only
+ *      stdint.h types are used here.
+ */
+
+#ifndef __LOGRING_H__
+#define __LOGRING_H__
+
+#include "system.h"
+
+#define LOGFS_LOG_RING_SLOTS 64   /* initial size, a power of two */
+
+typedef struct {
+   uint64_t start;
+   uint64_t end;
+   int32_t status;              /* 0, or why the write failed */
+   uint8_t done;
+   uint8_t seal;                /* ends the segment at the first failure */
+} LogFS_LogRingSlot;
+
+typedef struct {
+   LogFS_LogRingSlot **slots;   /* oldest at head, ordered by position */
+   uint32_t size;
+   uint64_t head;
+   uint64_t tail;
+   int32_t status;              /* first failure retired, sticky */
+   uint64_t failedEnd;          /* end of the writes retired since then */
+} LogFS_LogRing;
+
+static inline int
+LogFS_LogRingIsEmpty(const LogFS_LogRing *r)
+{
+   return r->head == r->tail;
+}
+
+void LogFS_LogRingInit(LogFS_LogRing *r);
+void LogFS_LogRingCleanup(LogFS_LogRing *r);
+void LogFS_LogRingArm(LogFS_LogRing *r, LogFS_LogRingSlot *s);
+void LogFS_LogRingComplete(LogFS_LogRingSlot *s, int32_t status);
+LogFS_LogRingSlot *LogFS_LogRingRetire(LogFS_LogRing *r, uint64_t *stableEnd);
+
+#endif                          /* __LOGRING_H__ */
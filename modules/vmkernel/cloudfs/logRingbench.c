@@ -0,0 +1,236 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+/*
+ * logRingbench.c --
+ *
+ *      Stress test for the log write completion ring. Simulates appends to
+ *      a log segment that are submitted slightly out of reservation order
+ *      and complete in random order, some of them failing, and checks that
+ *      the ring acknowledges them strictly in segment order, never ahead
+ *      of a write still in flight, and that everything behind a failed
+ *      write reports the failure. The stable end must stop at the first
+ *      failed write, until a seal write there moves it over just the seal.
+ *      Also reports the cost per write, at a range of queue depths.
+ *
+ *      Usage: logRingbench [writes per depth] [1 in N writes fails]
+ */
+
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "system.h"
+#include "logRing.h"
+
+#define BENCH_EIO 5
+#define BENCH_SEAL_SIZE 512
+
+struct bench_write {
+   LogFS_LogRingSlot slot;
+   int fail;
+   int retired;
+};
+
+static double
+now(void)
+{
+   struct timeval tv;
+   gettimeofday(&tv, NULL);
+   return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* Retire whatever the ring lets go of, and check it against what the log
+ * expects. On the first failure, arm SEAL where the stable end stopped.
+ * Returns the number of errors found. */
+
+static int
+retire(LogFS_LogRing *r, uint64_t *stableEnd, struct bench_write *w,
+       uint32_t n, uint32_t *nextAck, int32_t *failed,
+       struct bench_write *seal, uint64_t *failedAt)
+{
+   LogFS_LogRingSlot *s;
+   int errors = 0;
+
+   while ((s = LogFS_LogRingRetire(r, stableEnd)) != NULL) {
+      struct bench_write *p = (struct bench_write *) s;
+      uint32_t i = p - w;
+
+      if (p == seal) {
+         if (*stableEnd != *failedAt + BENCH_SEAL_SIZE) {
+            printf("stable end %llu after the seal, expected %llu\n",
+                   (unsigned long long) *stableEnd,
+                   (unsigned long long) *failedAt + BENCH_SEAL_SIZE);
+            errors++;
+         }
+         p->retired = 1;
+         continue;
+      }
+
+      if (i != *nextAck || i >= n) {
+         printf("write %u acknowledged, expected %u\n", i, *nextAck);
+         return errors + 1;
+      }
+      if (!p->slot.done || p->retired) {
+         printf("write %u acknowledged while not done\n", i);
+         errors++;
+      }
+      if (p->fail && *failed == 0) {
+         *failed = BENCH_EIO;
+         *failedAt = p->slot.start;
+
+         seal->slot.start = *failedAt;
+         seal->slot.end = *failedAt + BENCH_SEAL_SIZE;
+         seal->slot.seal = 1;
+         seal->fail = 0;
+         seal->retired = 0;
+         LogFS_LogRingArm(r, &seal->slot);
+      }
+      if (*failed == 0 ? *stableEnd != p->slot.end :
+          (*stableEnd != *failedAt &&
+           *stableEnd != *failedAt + BENCH_SEAL_SIZE)) {
+         printf("stable end %llu after write %u, expected %llu\n",
+                (unsigned long long) *stableEnd, i,
+                (unsigned long long) (*failed ? *failedAt : p->slot.end));
+         errors++;
+      }
+      if (p->slot.status != *failed) {
+         printf("write %u status %d, expected %d\n", i, p->slot.status,
+                *failed);
+         errors++;
+      }
+      p->retired = 1;
+      ++(*nextAck);
+   }
+   return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+   static const uint32_t depths[] = { 1, 4, 32, 256, 2048 };
+   uint32_t n = argc > 1 ? atoi(argv[1]) : 200000;
+   uint32_t failEvery = argc > 2 ? atoi(argv[2]) : 0;
+   struct bench_write *w = malloc(n * sizeof(*w));
+   uint32_t *order = malloc(n * sizeof(uint32_t));
+   uint32_t *inflight = malloc(n * sizeof(uint32_t));
+   unsigned d;
+   int status = 0;
+
+   printf("%8s %12s %12s\n", "depth", "ns/write", "max slots");
+
+   for (d = 0; d < sizeof(depths) / sizeof(depths[0]); d++) {
+      LogFS_LogRing r;
+      uint64_t stableEnd = 0, pos = 0;
+      uint32_t depth = depths[d];
+      uint32_t i, armed = 0, numInflight = 0, nextAck = 0, maxSlots = 0;
+      int32_t failed = 0;
+      uint64_t failedAt = 0;
+      struct bench_write seal;
+      int errors = 0;
+      double t;
+
+      srand(d + 1);
+      LogFS_LogRingInit(&r);
+
+      /* Space is reserved in order, but a writer can get preempted
+       * between reserving and submitting, so submission order is the
+       * reservation order with some neighbours swapped */
+
+      for (i = 0; i < n; i++) {
+         uint64_t len = 512 * (1 + rand() % 16);
+
+         w[i].slot.start = pos;
+         w[i].slot.end = pos + len;
+         w[i].slot.seal = 0;
+         w[i].fail = failEvery != 0 && rand() % failEvery == 0;
+         w[i].retired = 0;
+         pos += len;
+         order[i] = i;
+      }
+      for (i = 0; i + 1 < n; i++) {
+         if (rand() % 8 == 0) {
+            uint32_t j = i + 1 + rand() % MIN(4, n - i - 1);
+            uint32_t tmp = order[i];
+            order[i] = order[j];
+            order[j] = tmp;
+         }
+      }
+
+      t = now();
+      while ((nextAck < n || (failed && !seal.retired)) && errors == 0) {
+         if (armed < n && (numInflight < depth || numInflight == 0)) {
+            struct bench_write *p = &w[order[armed++]];
+
+            LogFS_LogRingArm(&r, &p->slot);
+            inflight[numInflight++] = p - w;
+            maxSlots = MAX(maxSlots, r.size);
+         } else if (failed && !seal.slot.done &&
+                    (numInflight == 0 || rand() % 4 == 0)) {
+            LogFS_LogRingComplete(&seal.slot, 0);
+            errors += retire(&r, &stableEnd, w, n, &nextAck, &failed,
+                             &seal, &failedAt);
+         } else if (numInflight > 0) {
+            uint32_t k = rand() % numInflight;
+            struct bench_write *p = &w[inflight[k]];
+
+            inflight[k] = inflight[--numInflight];
+            LogFS_LogRingComplete(&p->slot, p->fail ? BENCH_EIO : 0);
+            errors += retire(&r, &stableEnd, w, n, &nextAck, &failed,
+                             &seal, &failedAt);
+         }
+      }
+      t = now() - t;
+
+      if (errors == 0 &&
+          (!LogFS_LogRingIsEmpty(&r) ||
+           stableEnd != (failed ? failedAt + BENCH_SEAL_SIZE : pos))) {
+         printf("ring not drained, stable end %llu of %llu\n",
+                (unsigned long long) stableEnd, (unsigned long long) pos);
+         errors++;
+      }
+      if (errors != 0) {
+         printf("depth %u: %d errors\n", depth, errors);
+         status = 1;
+         break;
+      }
+
+      printf("%8u %12.1f %12u\n", depth, t * 1e9 / n, maxSlots);
+      LogFS_LogRingCleanup(&r);
+   }
+
+   free(w);
+   free(order);
+   free(inflight);
+   return status;
+}
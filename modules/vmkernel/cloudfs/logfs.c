@@ -441,8 +441,16 @@ LogFS_AppendEntry(LogFS_RefCountedBuffer *rb,
 
    struct log_head *head = rb->buffer;
 
+   if (!log_entry_checksum_supported(head)) {
+      zprintf("unsupported entry version %u checksum %u\n",
+              head->update.version, head->update.checksum_type);
+      status = VMK_NOT_SUPPORTED;
+      goto out;
+   }
+
    unsigned char checksum[SHA1_DIGEST_SIZE];
-   log_entry_checksum(checksum, head, ((char *)head) + BLKSIZE,
+   log_entry_checksum(checksum, head,
+                      ((char *)head) + log_entry_head_size(head),
                       log_body_size(head));
 
    if (memcmp(checksum, head->update.checksum, SHA1_DIGEST_SIZE) != 0) {
@@ -596,9 +604,11 @@ LogFS_AppendRawBytes(Async_Token * token,
             {
                size_t take = inputleft < d->headleft ? inputleft : d->headleft;
 
-               if (d->headleft == LOG_HEAD_SIZE) {
-                  sz = log_entry_size((struct log_head *)in);
-                  d->buffer = aligned_malloc(sz);
+               /* Buffer the first block of the head until we know how
+                * large the entry is */
+
+               if (d->buf_offs == 0) {
+                  d->buffer = aligned_malloc(LOG_HEAD_SIZE);
                }
 
                memcpy(d->buffer + d->buf_offs, in, take);
@@ -608,26 +618,31 @@ LogFS_AppendRawBytes(Async_Token * token,
                d->headleft -= take;
                inputleft -= take;
 
-               if (d->headleft == 0) {
+               if (d->headleft == 0 && d->buf_offs == LOG_HEAD_SIZE) {
                   struct log_head *head = (struct log_head *)d->buffer;
 
                   printf("%" FMT64 "d + %d\n", head->blkno, head->num_blocks);
                   if (head->tag == log_entry_type
-                      && (head->update.num_blocks > LOG_HEAD_MAX_BLOCKS
+                      && (!log_entry_extent_valid(head)
                           || head->update.num_blocks == 0)) {
                      zprintf("too many blocks %d\n", head->update.num_blocks);
                      status = VMK_WRITE_ERROR;
                      goto out;
                   }
 
-                  d->bodyleft = log_body_size(head);
+                  sz = log_entry_size(head);
+                  char *entry = aligned_malloc(sz);
+                  memcpy(entry, d->buffer, LOG_HEAD_SIZE);
+                  aligned_free(d->buffer);
+                  d->buffer = entry;
 
-                  if (d->bodyleft > LOG_HEAD_MAX_BLOCKS * BLKSIZE) {
-                     zprintf("too large %" FMT64 "u\n", d->bodyleft);
-                     status = VMK_WRITE_ERROR;
-                     goto out;
-                  }
+                  /* Large entries continue with overflow refs blocks */
+                  head = (struct log_head *)d->buffer;
+                  d->headleft = log_entry_head_size(head) - LOG_HEAD_SIZE;
+                  d->bodyleft = log_body_size(head);
+               }
 
+               if (d->headleft == 0) {
                   d->state = 2;
                }
             }
@@ -935,6 +950,87 @@ char *logfsControlNodeStrings[] = {
    NULL,
 };
 
+/* Can the blocks of a vdisk IO go straight to or from SGARR? That needs
+ * each element to hold whole blocks, and the elements to follow each other
+ * on the disk. */
+
+static Bool
+LogFS_SgIsBlockAligned(const SG_Array *sgArr)
+{
+   uint64 offset = sgArr->sg[0].offset;
+   int i;
+
+   if (offset % BLKSIZE != 0) {
+      return FALSE;
+   }
+   for (i = 0; i < sgArr->length; i++) {
+      if (sgArr->sg[i].offset != offset ||
+          sgArr->sg[i].length == 0 || sgArr->sg[i].length % BLKSIZE != 0) {
+         return FALSE;
+      }
+      offset += sgArr->sg[i].length;
+   }
+   return TRUE;
+}
+
+typedef struct {
+   SG_Array *view;
+   Bool mapped;
+} LogFS_GuestSgContext;
+
+static void
+LogFS_UnmapGuestSg(Async_Token * token, void *data)
+{
+   LogFS_GuestSgContext *c = data;
+   int i;
+
+   if (c->mapped) {
+      for (i = 0; i < c->view->length; i++) {
+         Kseg_ReleaseVA((void *)c->view->sg[i].addr);
+      }
+   }
+   SG_Free(LogFS_GetHeap(), &c->view);
+
+   Async_TokenCallback(token);
+}
+
+/* Return a virtually addressed copy of the guest SGARR, mapping machine
+ * addresses as needed. The mappings are held, and the view kept around,
+ * until TOKEN completes, so that the log can write from the guest pages
+ * directly rather than from a copy. */
+
+static SG_Array *
+LogFS_MapGuestSg(const SG_Array *sgArr, Async_Token * token)
+{
+   LogFS_GuestSgContext *c;
+   SG_Array *view = SG_Alloc(LogFS_GetHeap(), sgArr->length);
+   int i;
+
+   ASSERT(view);
+   view->addrType = SG_VIRT_ADDR;
+   view->length = sgArr->length;
+
+   for (i = 0; i < sgArr->length; i++) {
+      view->sg[i].offset = sgArr->sg[i].offset;
+      view->sg[i].length = sgArr->sg[i].length;
+
+      if (sgArr->addrType == SG_MACH_ADDR) {
+         view->sg[i].addr = (VA) Kseg_MapMA(sgArr->sg[i].addr,
+                                            sgArr->sg[i].length);
+         ASSERT(view->sg[i].addr);
+      } else {
+         view->sg[i].addr = sgArr->sg[i].addr;
+      }
+   }
+
+   c = Async_PushCallbackFrame(token, LogFS_UnmapGuestSg,
+                               sizeof(LogFS_GuestSgContext));
+   c->view = view;
+   c->mapped = (sgArr->addrType == SG_MACH_ADDR);
+
+   return view;
+}
+
 static VMK_ReturnStatus
 LogFS_AsyncIO(FDS_HandleID fdsHandleID,
               const SG_Array * sgArr, IO_Flags ioFlags, Async_Token * token)
@@ -1102,7 +1198,15 @@ LogFS_AsyncIO(FDS_HandleID fdsHandleID,
 
       uint32 bytes = SG_TotalLength(sgArr);
 
-      if (ioFlags & FS_WRITE_OP) {
+      if ((ioFlags & FS_WRITE_OP) && LogFS_SgIsBlockAligned(sgArr)) {
+         SG_Array *view = LogFS_MapGuestSg(sgArr, token);
+
+         status =
+             LogFS_VDiskWriteSg(vd, token, view, sgArr->sg[0].offset / BLKSIZE,
+                                bytes / BLKSIZE, ioFlags);
+      }
+
+      else if (ioFlags & FS_WRITE_OP) {
          printf("writing %u bytes\n", bytes);
          char *buffer = aligned_malloc(bytes);
          ASSERT(buffer);
@@ -1135,6 +1239,15 @@ LogFS_AsyncIO(FDS_HandleID fdsHandleID,
                               bytes / BLKSIZE, ioFlags);
       }
 
+      /* Reads land directly in the guest buffer, except for the parts that
+       * have to be fetched from elsewhere */
+
+      else if ((ioFlags & FS_READ_OP) && LogFS_SgIsBlockAligned(sgArr)) {
+         status = LogFS_VDiskReadSg(vd, token, sgArr,
+                                    sgArr->sg[0].offset / BLKSIZE,
+                                    bytes / BLKSIZE, ioFlags);
+      }
+
       else if (ioFlags & FS_READ_OP) {
          char *buffer = aligned_malloc(bytes);
          ASSERT(buffer);
@@ -1157,13 +1270,160 @@ LogFS_AsyncIO(FDS_HandleID fdsHandleID,
    return status;
 }
 
-VMK_ReturnStatus LogFS_AddPhysicalDevice(const char *deviceName)
+/* Options that can be given when adding a device, as in
+ * "devname,option=value,...". The checksum, segment size and block size
+ * default to what the device was formatted with, see
+ * LogFS_AddPhysicalDevice. */
+
+typedef struct {
+   log_checksum_type_t checksumType;
+   uint32 groupCommitWindowUS;
+   uint32 groupCommitBytes;
+   uint32 coalesceWindowUS;
+   uint32 coalesceBytes;
+   uint32 readAheadBytes;
+   uint32 readGapBytes;
+   uint32 blockCacheBytes;
+   uint32 lookupWorkers;
+   uint32 localReadMS;
+   uint32 segmentBlocks;
+} LogFS_DeviceOptions;
+
+static VMK_ReturnStatus
+LogFS_ParseUint(const char *s, uint32 *val)
+{
+   for (*val = 0; '0' <= *s && *s <= '9'; ++s) {
+      *val = (*val * 10) + (*s - '0');
+   }
+   return (*s == '\0') ? VMK_OK : VMK_BAD_PARAM;
+}
+
+/* Parse the options following the device name, and strip them from it. */
+
+static VMK_ReturnStatus
+LogFS_ParseDeviceOptions(char *deviceName, LogFS_DeviceOptions *options)
+{
+   VMK_ReturnStatus status = VMK_OK;
+   char *s = strchr(deviceName, ',');
+
+   options->checksumType = log_checksum_num_types;
+   options->groupCommitWindowUS = LOGFS_GROUP_COMMIT_WINDOW_US;
+   options->groupCommitBytes = LOGFS_GROUP_COMMIT_BYTES;
+   options->coalesceWindowUS = LOGFS_COALESCE_WINDOW_US;
+   options->coalesceBytes = LOGFS_COALESCE_BYTES;
+   options->readAheadBytes = LOGFS_READAHEAD_BYTES;
+   options->readGapBytes = LOGFS_READ_GAP_BYTES;
+   options->blockCacheBytes = LOGFS_BLOCK_CACHE_BYTES;
+   options->lookupWorkers = LOGFS_LOOKUP_WORKERS;
+   options->localReadMS = LOGFS_LOCAL_READ_MS;
+   options->segmentBlocks = 0;
+
+   while (s != NULL) {
+      char *option = s + 1;
+
+      *s = '\0';
+      s = strchr(option, ',');
+      if (s != NULL) {
+         *s = '\0';
+      }
+
+      if (strncmp(option, "checksum=", 9) == 0) {
+         log_checksum_type_t type;
+         for (type = 0; type < log_checksum_num_types; type++) {
+            if (strcmp(option + 9, log_checksum_name(type)) == 0) {
+               break;
+            }
+         }
+         if (type == log_checksum_num_types) {
+            zprintf("unknown checksum %s\n", option + 9);
+            return VMK_BAD_PARAM;
+         }
+         options->checksumType = type;
+      } else if (strncmp(option, "gcwindow=", 9) == 0) {
+         status = LogFS_ParseUint(option + 9, &options->groupCommitWindowUS);
+      } else if (strncmp(option, "gcbytes=", 8) == 0) {
+         status = LogFS_ParseUint(option + 8, &options->groupCommitBytes);
+      } else if (strncmp(option, "cwindow=", 8) == 0) {
+         status = LogFS_ParseUint(option + 8, &options->coalesceWindowUS);
+      } else if (strncmp(option, "cbytes=", 7) == 0) {
+         status = LogFS_ParseUint(option + 7, &options->coalesceBytes);
+         if (status == VMK_OK &&
+             (options->coalesceBytes < 4 * BLKSIZE ||
+              options->coalesceBytes > LOG_ENTRY_MAX_BLOCKS * BLKSIZE)) {
+            status = VMK_BAD_PARAM;
+         }
+      } else if (strncmp(option, "rabytes=", 8) == 0) {
+         status = LogFS_ParseUint(option + 8, &options->readAheadBytes);
+         if (status == VMK_OK &&
+             options->readAheadBytes > LOG_ENTRY_MAX_BLOCKS * BLKSIZE) {
+            status = VMK_BAD_PARAM;
+         }
+      } else if (strncmp(option, "rgap=", 5) == 0) {
+         status = LogFS_ParseUint(option + 5, &options->readGapBytes);
+         if (status == VMK_OK &&
+             options->readGapBytes > LOGFS_READ_MAX_GAP_BYTES) {
+            status = VMK_BAD_PARAM;
+         }
+      } else if (strncmp(option, "bcache=", 7) == 0) {
+         uint32 mb;
+         status = LogFS_ParseUint(option + 7, &mb);
+         options->blockCacheBytes = mb * 1024 * 1024;
+         if (status == VMK_OK && mb > 256) {
+            status = VMK_BAD_PARAM;
+         }
+      } else if (strncmp(option, "lookupworkers=", 14) == 0) {
+         status = LogFS_ParseUint(option + 14, &options->lookupWorkers);
+         if (status == VMK_OK &&
+             (options->lookupWorkers < 1 ||
+              options->lookupWorkers > LOGFS_LOOKUP_MAX_WORKERS)) {
+            status = VMK_BAD_PARAM;
+         }
+      } else if (strncmp(option, "localreadms=", 12) == 0) {
+         status = LogFS_ParseUint(option + 12, &options->localReadMS);
+         if (status == VMK_OK &&
+             options->localReadMS > LOGFS_LOCAL_READ_MAX_MS) {
+            status = VMK_BAD_PARAM;
+         }
+      } else if (strncmp(option, "segsize=", 8) == 0) {
+         uint32 mb;
+         status = LogFS_ParseUint(option + 8, &mb);
+         options->segmentBlocks = mb * ((1024 * 1024) / BLKSIZE);
+         if (status == VMK_OK &&
+             !LogFS_DiskLayoutValidSegmentBlocks(options->segmentBlocks)) {
+            status = VMK_BAD_PARAM;
+         }
+      } else {
+         status = VMK_BAD_PARAM;
+      }
+
+      if (status != VMK_OK) {
+         zprintf("bad device option %s\n", option);
+         return status;
+      }
+   }
+   return VMK_OK;
+}
+
+VMK_ReturnStatus LogFS_AddPhysicalDevice(const char *deviceSpec)
 {
    VMK_ReturnStatus status;
    FDS_Handle *logfsFDSHandle = NULL;
    uint64 generation;
    log_id_t logEnd;
    disk_block_t superTreeRoot;
+   LogFS_DeviceOptions options;
+   char deviceName[256];
+   LogFS_MetaLog *ml = NULL;
+   LogFS_Device *device = NULL;
+   char *buf = NULL;
+
+   strncpy(deviceName, deviceSpec, sizeof(deviceName) - 1);
+   deviceName[sizeof(deviceName) - 1] = '\0';
+
+   status = LogFS_ParseDeviceOptions(deviceName, &options);
+   if (status != VMK_OK) {
+      return status;
+   }
 
    /* Increase module refcount to prevent a parallel unload of the module
     * before we are completely done here */
@@ -1174,40 +1434,131 @@ VMK_ReturnStatus LogFS_AddPhysicalDevice(const char *deviceName)
 
    if (status != VMK_OK) {
       zprintf("bad status: %s\n", VMK_ReturnStatusToString(status));
+      vmk_ModuleDecUseCount(logfsModuleID);
       return status;
    }
 
    /************* global init ***************/
 
-   LogFS_MetaLog *ml = (LogFS_MetaLog *)malloc(sizeof(LogFS_MetaLog));
+   ml = (LogFS_MetaLog *)malloc(sizeof(LogFS_MetaLog));
 
    FDSI_GetCapacity result;
    status = FDS_Ioctl(logfsFDSHandle, FDS_IOCTL_GET_CAPACITY, &result);
    if (status != VMK_OK) {
-      return status;
+      goto fail;
    }
    zprintf("capacity %" FMT64 "d\n",
            result.diskBlockSize * result.numDiskBlocks);
 
-   LogFS_Device *device = malloc(sizeof(LogFS_Device));
+   /* Log heads and entries are packed at BLKSIZE offsets, so the device
+    * must take BLKSIZE writes. */
+
+   if (result.diskBlockSize != BLKSIZE) {
+      zprintf("unsupported device block size %u\n",
+              (uint32) result.diskBlockSize);
+      status = VMK_NOT_SUPPORTED;
+      goto fail;
+   }
+
+   device = malloc(sizeof(LogFS_Device));
    LogFS_DeviceInit(device, logfsFDSHandle);
    LogFS_DiskLayoutInit(&device->diskLayout,
                         result.diskBlockSize * result.numDiskBlocks);
-   char *buf = aligned_malloc(BLKSIZE);
-   memset(buf, 0, BLKSIZE);
-   memcpy(buf, &device->diskLayout, sizeof(LogFS_DiskLayout));
 
-   status = LogFS_DeviceWriteSimple(device, NULL, buf, BLKSIZE, 0,
-                              LogFS_DiskHeaderSection);
+   /* A device that already has a header keeps the layout it was formatted
+    * with, as the log segments on it are laid out by that. Only a fresh
+    * device gets a header built from the options. */
+
+   buf = aligned_malloc(BLKSIZE);
+   status = LogFS_DeviceRead(device, NULL, buf, BLKSIZE, 0,
+                             LogFS_DiskHeaderSection);
+   if (status != VMK_OK) {
+      zprintf("read header bad status %s\n", VMK_ReturnStatusToString(status));
+      goto fail;
+   }
+
+   Bool format = !LogFS_DiskLayoutIsValid((LogFS_DiskLayout *) buf);
+
+   if (format) {
+      zprintf("formatting %s\n", deviceName);
+      if (options.checksumType != log_checksum_num_types) {
+         device->diskLayout.checksumType = options.checksumType;
+      }
+      if (options.segmentBlocks != 0) {
+         device->diskLayout.segmentBlocks = options.segmentBlocks;
+      }
+      memset(buf, 0, BLKSIZE);
+      memcpy(buf, &device->diskLayout, sizeof(LogFS_DiskLayout));
+
+      status = LogFS_DeviceWriteSimple(device, NULL, buf, BLKSIZE, 0,
+                                       LogFS_DiskHeaderSection);
+      if (status != VMK_OK) {
+         zprintf("write header bad status %s\n",
+                 VMK_ReturnStatusToString(status));
+      }
+   } else {
+      memcpy(&device->diskLayout, buf, sizeof(LogFS_DiskLayout));
+
+      /* Volumes of another format version decode log positions and tree
+       * elements differently, so they cannot be mounted. */
+
+      if (device->diskLayout.version != LOGFS_DISK_VERSION) {
+         zprintf("unsupported format version %u, expected %u\n",
+                 device->diskLayout.version, LOGFS_DISK_VERSION);
+         status = VMK_NOT_SUPPORTED;
+      } else if (!LogFS_DiskLayoutValidSegmentBlocks(
+                    device->diskLayout.segmentBlocks)) {
+         zprintf("bad segment size in header\n");
+         status = VMK_BAD_PARAM;
+      } else if (options.segmentBlocks != 0 &&
+                 options.segmentBlocks != device->diskLayout.segmentBlocks) {
+         zprintf("segsize conflicts with the formatted %" FMT64 "u bytes\n",
+                 LogFS_DiskLayoutGetSegmentSize(&device->diskLayout));
+         status = VMK_BAD_PARAM;
+      }
+
+      /* Each entry records its own checksum type, so this one may differ
+       * from the header for the length of the mount. */
+
+      if (options.checksumType != log_checksum_num_types) {
+         device->diskLayout.checksumType = options.checksumType;
+      }
+   }
 
    aligned_free(buf);
+   buf = NULL;
 
    if (status != VMK_OK) {
-      zprintf("write header bad status %s\n", VMK_ReturnStatusToString(status));
-      return status;
+      goto fail;
    }
 
+   zprintf("using %s entry checksums\n",
+           log_checksum_name(device->diskLayout.checksumType));
+   zprintf("log segments of %" FMT64 "u bytes\n",
+           LogFS_DiskLayoutGetSegmentSize(&device->diskLayout));
+
    LogFS_MetaLogInit(ml, device);
+   ml->groupCommitWindowUS = options.groupCommitWindowUS;
+   ml->groupCommitBytes = options.groupCommitBytes;
+   zprintf("group commit window %uus, %u bytes\n",
+           ml->groupCommitWindowUS, ml->groupCommitBytes);
+   ml->coalesceWindowUS = options.coalesceWindowUS;
+   ml->coalesceBytes = options.coalesceBytes;
+   zprintf("write coalescing window %uus, %u bytes\n",
+           ml->coalesceWindowUS, ml->coalesceBytes);
+   ml->readAheadBytes = options.readAheadBytes;
+   zprintf("readahead up to %u bytes\n", ml->readAheadBytes);
+   ml->readGapBytes = options.readGapBytes;
+   zprintf("merging reads up to %u bytes apart\n", ml->readGapBytes);
+   if (options.blockCacheBytes != LOGFS_BLOCK_CACHE_BYTES) {
+      LogFS_BlockCacheCleanup(&ml->blockCache);
+      LogFS_BlockCacheInit(&ml->blockCache, options.blockCacheBytes);
+   }
+   zprintf("block cache %u bytes\n", options.blockCacheBytes);
+   ml->lookupWorkers = options.lookupWorkers;
+   zprintf("%u rangemap lookup workers\n", ml->lookupWorkers);
+   ml->localReadMS = options.localReadMS;
+   zprintf("granting replicas %ums read leases\n", ml->localReadMS);
 
    status = LogFS_InitHttpd(ml);
 
@@ -1253,6 +1604,18 @@ VMK_ReturnStatus LogFS_AddPhysicalDevice(const char *deviceName)
 
    vmk_ModuleDecUseCount(logfsModuleID);
    return status;
+
+ fail:
+   if (buf != NULL) {
+      aligned_free(buf);
+   }
+   if (device != NULL) {
+      free(device);
+   }
+   free(ml);
+   FDS_CloseDevice(logfsFDSHandle);
+   vmk_ModuleDecUseCount(logfsModuleID);
+   return status;
 }
 
 VMK_ReturnStatus LogFS_RemovePhysicalDevice(LogFS_Device *device)
@@ -1596,6 +1959,11 @@ VMK_ReturnStatus LogFS_Init(void)
 
    }
 
+   /* Pick the fastest SHA-1 implementation before anything gets hashed */
+   sha1_select_compress();
+   zprintf("using %s sha1\n", sha1_compress_name());
+   zprintf("using %s block classification\n", LogFS_ClassifyBlocksName());
+
    LogFS_DiskMapInit();
 
    List_Init(&vDiskInfoList);
@@ -221,6 +221,9 @@ LogFS_CheckPointPrepare(LogFS_MetaLog *ml, LogFS_CheckPoint *cp, uint64 generati
    cp->generation = generation;
    memcpy(cp->bitmap, ml->segment_list.bitmap, sizeof(cp->bitmap));
 
+   /* append_lock only keeps the active log from changing under us;
+    * appends reserve space without it. */
+
    SP_Lock(&ml->append_lock);
 
    if (ml->activeLog) {
@@ -230,12 +233,16 @@ LogFS_CheckPointPrepare(LogFS_MetaLog *ml, LogFS_CheckPoint *cp, uint64 generati
       cp->logEnd = inv;
    }
 
+   SP_Unlock(&ml->append_lock);
+
+   SP_Lock(&ml->obsoleted.lock);
+
    LogFS_BinHeap *heap = &ml->obsoleted.heap;
    for (i = 0; i < MAX_NUM_SEGMENTS; i++) {
       cp->heap[i] = heap->nodes[i].value;
    }
 
-   SP_Unlock(&ml->append_lock);
+   SP_Unlock(&ml->obsoleted.lock);
 
    return VMK_OK;
 }
@@ -48,7 +48,7 @@ typedef struct {
    log_id_t logEnd;
    disk_block_t superTreeRoot;
    uint8 bitmap[MAX_NUM_SEGMENTS / 8 + 1];
-   uint16 heap[MAX_NUM_SEGMENTS];
+   uint32 heap[MAX_NUM_SEGMENTS];
    uint8 nodesBitmap[TREE_MAX_BLOCKS / 8 + 1];
 } __attribute__ ((__packed__))
 LogFS_CheckPoint;
@@ -40,6 +40,12 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define TREE_BLOCK_SIZE (8*4096)
 #define MAX_FILE_SIZE (TREE_BLOCK_SIZE*TREE_MAX_BLOCKS)
 
+/* Each vdisk keeps one bit per region of 1MB telling whether it was ever
+ * written, see bTreeRange.c. Regions past the end of the bitmap fold back
+ * onto it. */
+#define LOGFS_WRITTEN_REGION_SHIFT 11
+#define LOGFS_WRITTEN_SUMMARY_BYTES 512
+
 // KJO: copied from older version.. Revisit the lock hierarchy and see what we really need
 
 
@@ -54,6 +60,9 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define SP_RANK_APPENDLOG (SP_RANK_METALOG+1)
 #define SP_RANK_REFCOUNTS (SP_RANK_METALOG+1)
 #define SP_RANK_SEGMENTLIST (SP_RANK_METALOG+1)
+#define SP_RANK_FINGERPRINT (SP_RANK_METALOG+1)
+#define SP_RANK_RETIREDLOGS (SP_RANK_METALOG+1)
+#define SP_RANK_HASHBUFFERS (SP_RANK_METALOG+1)
 
 #define SP_RANK_DDISK (SP_RANK_VDISK+1)
 #define SP_RANK_REMOTELOG (SP_RANK_VDISK+1)
@@ -66,4 +75,6 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #define SP_RANK_OBSOLETED (SP_RANK_BTREERANGE+1)
 
+#define SP_RANK_BLOCKCACHE (SP_RANK_RANGEMAPNODES+1)
+
 #endif                          /* __LOGFSCONSTANTS_H__ */
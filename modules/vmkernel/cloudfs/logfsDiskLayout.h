@@ -55,9 +55,34 @@ struct __section {
    log_offset_t offset;
 } __attribute__ ((__packed__));
 
+/* Version of the on-disk format, bumped whenever a change makes older
+ * volumes unreadable:
+ *
+ * 1: log_id_t split 20/44 between block offset and segment, and the
+ *    segment size recorded in the header.
+ * 2: SuperTreeElement carries the written summary, which changes the
+ *    size of every element in the super tree.
+ * 3: log entries no longer have a block_shift, and entry version 2 is
+ *    the one with overflow refs blocks.
+ *
+ * Headers from before the version was recorded have the type of the first
+ * section, LogFS_DiskHeaderSection (0), where the version now is. */
+
+#define LOGFS_DISK_VERSION 3
+
 typedef struct __LogFS_DiskLayout {
    char magic[8];
+   uint32 version;
    struct __section sections[LogFS_LogNumDiskSegments];
+
+   /* Checksum for new log entries, a log_checksum_type_t. Each entry
+    * records its own type, so a mount can override this without rewriting
+    * the header. */
+   uint8 checksumType;
+
+   /* Size of each log segment in blocks. This is fixed when the device is
+    * formatted, as the log segments are laid out back to back. */
+   uint32 segmentBlocks;
 } __attribute__ ((__packed__))
 LogFS_DiskLayout;
 
@@ -69,6 +94,8 @@ typedef struct {
       uint64 lsn;
       uint8 currentId[SHA1_DIGEST_SIZE];
       uint8 entropy[SHA1_DIGEST_SIZE];
+      /* Since format version 2, see LOGFS_DISK_VERSION */
+      uint8 written[LOGFS_WRITTEN_SUMMARY_BYTES];
    } __attribute__ ((__packed__)) value;
 } __attribute__ ((__packed__))
 SuperTreeElement;
@@ -91,6 +118,9 @@ LogFS_DiskLayoutInit(LogFS_DiskLayout *dl, log_size_t diskCapacity)
    log_offset_t pos;
 
    strcpy(dl->magic, "CloudFS");
+   dl->version = LOGFS_DISK_VERSION;
+   dl->checksumType = log_checksum_sha1;
+   dl->segmentBlocks = LOG_DEFAULT_SEGMENT_BLOCKS;
 
    for (type = LogFS_DiskHeaderSection, pos = 0;
         type != LogFS_LogNumDiskSegments; type++) {
@@ -102,6 +132,29 @@ LogFS_DiskLayoutInit(LogFS_DiskLayout *dl, log_size_t diskCapacity)
    return VMK_OK;
 }
 
+static inline Bool
+LogFS_DiskLayoutIsValid(const LogFS_DiskLayout *dl)
+{
+   return memcmp(dl->magic, "CloudFS", sizeof(dl->magic)) == 0;
+}
+
+/* Segment sizes are powers of two, between the default and the largest a
+ * log_id_t can address. */
+
+static inline Bool
+LogFS_DiskLayoutValidSegmentBlocks(uint32 segmentBlocks)
+{
+   return (segmentBlocks >= LOG_DEFAULT_SEGMENT_BLOCKS &&
+           segmentBlocks <= LOG_MAX_SEGMENT_BLOCKS &&
+           (segmentBlocks & (segmentBlocks - 1)) == 0);
+}
+
+static inline log_size_t
+LogFS_DiskLayoutGetSegmentSize(LogFS_DiskLayout *dl)
+{
+   return (log_size_t) dl->segmentBlocks * BLKSIZE;
+}
+
 static inline log_offset_t
 LogFS_DiskLayoutGetOffset(LogFS_DiskLayout *dl, LogFS_DiskSegmentType type)
 {
@@ -77,6 +77,26 @@ static inline LogFS_Hash LogFS_HashChecksum(const void *in, size_t sz)
    return h;
 }
 
+/* Checksum n independent buffers of sz bytes each, in[i] into out[i].
+ * Much faster than n calls to LogFS_HashChecksum for small buffers. */
+
+static inline void LogFS_HashChecksumMulti(LogFS_Hash *out, const void **in,
+                                           int n, size_t sz)
+{
+   uint8_t *digests[SHA1_MULTI_LANES];
+   int i, j;
+
+   for (i = 0; i < n; i += SHA1_MULTI_LANES) {
+      int m = MIN(n - i, SHA1_MULTI_LANES);
+
+      for (j = 0; j < m; j++) {
+         digests[j] = out[i + j].raw;
+         out[i + j].isValid = 1;
+      }
+      sha1_multi_digest(digests, (const uint8_t **)in + i, m, sz);
+   }
+}
+
 static inline void LogFS_HashCopy(unsigned char *buf, LogFS_Hash h)
 {
 #ifdef VMKERNEL
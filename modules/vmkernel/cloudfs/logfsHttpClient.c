@@ -74,6 +74,9 @@ typedef struct {
 
    int retries;
 
+   /* When the request was last sent, for timing a read lease */
+   uint64 sentCycles;
+
    List_Links next;
 } LogFS_HttpClientFetch;
 
@@ -269,6 +272,7 @@ static void LogFS_HttpClientThread(void *data)
 
          LogFS_HashPrint(sDiskId, &fetch->diskId);
 
+         fetch->sentCycles = Timer_GetCycles();
          sprintf(cmd, "%s /blocks?%40s HTTP/1.1",
                  (fetch->flags & FS_WRITE_OP) ? "PUT" : "GET", sDiskId);
          wr(cmd);
@@ -388,6 +392,10 @@ static void LogFS_HttpClientThread(void *data)
 
                   if (fetch->flags & FS_READ_OP) {
                      ASSERT(fetch->token->refCount > 0);
+                     if (ss->leaseMS != 0) {
+                        LogFS_VDiskSetLease(vd, fetch->id, fetch->sentCycles,
+                                            ss->leaseMS);
+                     }
                      status =
                          LogFS_VDiskContinueRead(vd, fetch->token, fetch->buf,
                                                  fetch->blkno,
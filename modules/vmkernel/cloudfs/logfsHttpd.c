@@ -634,6 +634,19 @@ LogFS_HttpResponseWorldlet(vmk_Worldlet wdt, void *data,
                      /* In case we managed to extract the secret, 
                       * return it the client in an HTTP header */
 
+                     /* A replica that reads may keep doing so from its own
+                      * copy for a while, if we grant it a lease */
+
+                     if (ss->verb == HTTP_GET) {
+                        uint32 ms = LogFS_VDiskGrantLease(vd, ss->id);
+
+                        if (ms != 0) {
+                           char s[32];
+                           sprintf(s, "Lease: %u", ms);
+                           wr(s);
+                        }
+                     }
+
                      if (LogFS_HashIsValid(secret)) {
                         zprintf("give away secret %s\n",
                                 LogFS_HashShow(&secret));
@@ -36,24 +36,61 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "bTreeRange.h"
 #include "logfsHash.h"
+#include "logRing.h"
 
 #include "logtypes.h"
 // #include "lock.h"
 
+struct LogFS_Log;
+typedef void LogFS_LogStableFn(struct LogFS_Log *log, void *data);
+
 typedef struct LogFS_Log {
    void *metaLog;
    int alive;
    log_segment_id_t index;
+   log_size_t segmentSize;
    Atomic_uint32 isAppendLog;
    Atomic_uint32 refCount;
    char *buffer;
 
    /* if AppendLog */
-   SP_SpinLock writeLock;       /* protects write contexts chain */
+   SP_SpinLock writeLock;       /* protects the write ring and stableEnd */
    Atomic_uint32 end;
    log_offset_t stableEnd;
 
-   void *prevWriteContext;
+   /* Async writes in flight */
+   LogFS_LogRing ring;
+
+   /* Called once stableEnd reaches stableTarget */
+   LogFS_LogStableFn *stableFn;
+   void *stableData;
+   log_offset_t stableTarget;
+
+   /* The first failed write ends the segment at failedAt, where stableEnd
+    * stopped. The pointer to the next segment goes at linkPos, which moves
+    * back to failedAt if the write fails after the segment got linked. */
+   volatile Bool failed;
+   log_offset_t failedAt;
+   Bool linked;
+   log_offset_t linkPos;
+   log_segment_id_t forward;
+
+   /* Dedupe fingerprint of the blocks appended to this segment */
+   struct LogFS_FingerPrint *fingerPrint;
+
+   /* In the metaLog's list of retired logs waiting to be released */
+   struct LogFS_Log *nextRetired;
+
+   /* Group commit, protected by writeLock */
+   struct LogFS_LogBatch *pendingBatch;
+   int batchesInFlight;
+
+   /* Group commit stats */
+   uint64 batches;
+   uint64 batchedWrites;
+   uint64 batchedBytes;
+   uint64 batchDelayCycles;
+   int maxBatchWrites;
 } LogFS_Log;
 
 static inline log_offset_t _cursor(LogFS_Log *log, log_offset_t offset)
@@ -63,7 +100,7 @@ static inline log_offset_t _cursor(LogFS_Log *log, log_offset_t offset)
       zprintf("appendlog? %d\n", Atomic_Read(&log->isAppendLog));
    }
    ASSERT(log->alive);
-   return log->index * LOG_MAX_SEGMENT_SIZE + offset;
+   return log->index * log->segmentSize + offset;
 }
 
 static inline log_id_t
@@ -101,12 +138,24 @@ VMK_ReturnStatus LogFS_LogForceReadBody(LogFS_Log *log, Async_Token * token,
 VMK_ReturnStatus LogFS_AppendLogAppend(LogFS_Log *log, Async_Token * token,
       SG_Array *sgArr, log_id_t * result, int flags);
 
+Bool LogFS_AppendLogReserve(LogFS_Log *log, log_size_t count,
+                            log_size_t tail, log_offset_t *position);
+VMK_ReturnStatus LogFS_AppendLogAppendAt(LogFS_Log *log, Async_Token * token,
+      SG_Array *sgArr, log_offset_t position, log_id_t * result, int flags);
+log_offset_t LogFS_AppendLogSeal(LogFS_Log *log);
+log_offset_t LogFS_LogLinkNext(LogFS_Log *log, log_offset_t end,
+                               log_segment_id_t next,
+                               LogFS_LogStableFn *fn, void *data, int flags);
+
 VMK_ReturnStatus LogFS_AppendLogAppendSimple(LogFS_Log *log, Async_Token *
       token, const void *buf, log_size_t count, log_id_t *result, int flags);
 
 int LogFS_LogIsAppendLog(LogFS_Log *log);
 VMK_ReturnStatus LogFS_AppendLogClose(LogFS_Log *log, Async_Token * token,
                                       int flags);
+VMK_ReturnStatus LogFS_AppendLogCloseAt(LogFS_Log *log, Async_Token * token,
+                                        log_offset_t end, int flags);
 void LogFS_AppendLogPushEnd(LogFS_Log *log, log_offset_t end);
+void LogFS_LogShowBatchStats(LogFS_Log *log);
 
 #endif                          /* __LOG_H__ */
@@ -56,7 +56,9 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define __LOGTYPES_H__
 
 #include "shalib/sha.h"
+#include "shalib/crc32c.h"
 #include "bitops.h"
+#include "blockClassify.h"
 
 typedef uint64_t log_segment_id_t;
 typedef uint64_t log_size_t;
@@ -81,16 +83,18 @@ typedef int log_device_handle_t;
 #define BLKSIZE 512
 #define BLKSIZE_ALIGNUP(_a) ( (_a+BLKSIZE-1)/BLKSIZE * BLKSIZE )
 
-/* Log segments are 16MB each. We are planning to change this to be 32MB soon. */
+/* Log segments are 16MB, unless the device was formatted with larger ones,
+ * see LogFS_DiskLayout. Any offset into a segment of up to
+ * LOG_MAX_SEGMENT_BLOCKS blocks, 256MB, fits in a log_id_t. */
 
-#define LOG_MAX_SEGMENT_BLOCKS (0x8000)
-#define LOG_MAX_SEGMENT_SIZE (LOG_MAX_SEGMENT_BLOCKS*BLKSIZE)
+#define LOG_DEFAULT_SEGMENT_BLOCKS (0x8000)
+#define LOG_MAX_SEGMENT_BLOCKS (0x80000)
 
 typedef struct __log_id {
    union {
       struct {
-         unsigned short blk_offset:16;
-         unsigned long long segment:48;
+         unsigned int blk_offset:20;
+         unsigned long long segment:44;
       } v;
       uint64_t raw;
    };
@@ -101,8 +105,8 @@ log_id_t;
 
 #define LOGID_TO_UINT64(_a)  (_a.raw)
 
-#define INVALID_SEGMENT 0xffffffffffffULL
-#define INVALID_BLK_OFFSET 0xffff
+#define INVALID_SEGMENT 0xfffffffffffULL
+#define INVALID_BLK_OFFSET 0xfffff
 #define mk_invalid_version(__name) log_id_t __name; __name.raw = 0xffffffffffffffffULL;
 #define equal_version(__a,__b) ( __a.raw==__b.raw )
 #define is_invalid_version(__a) ( (__a).raw==0xffffffffffffffffULL )
@@ -114,6 +118,29 @@ typedef enum { log_eof = 0,
 
 typedef enum { log_prev_ptr = 1, log_next_ptr } log_pointer_t;
 
+/* Entry format version, stored in every log entry. Version 0 entries
+ * predate the field and always have SHA-1 body checksums. Version 2
+ * entries may carry overflow refs blocks. */
+
+#define LOG_ENTRY_VERSION 2
+
+/* Algorithms for the checksum covering an entry's extent info and body.
+ * The choice is made per device when it gets formatted, and recorded in
+ * each entry so that entries can be verified anywhere, e.g. after being
+ * shipped to a replica. The checksum only guards against media and
+ * transmission errors, so it does not need to be cryptographic. The
+ * id/parent/entropy hash chain stays SHA-1, but takes the contents in
+ * through this checksum, so a CRC saves the write path a SHA-1 pass over
+ * each entry's body. What makes the chain hard to extend is the secret
+ * parent id, which the CRC does not weaken. */
+
+typedef enum {
+   log_checksum_sha1 = 0,
+   log_checksum_crc32c,
+
+   log_checksum_num_types
+} log_checksum_type_t;
+
 struct log_head {
 
    log_tag_t tag:32;
@@ -137,7 +164,10 @@ struct log_head {
          uint16_t slice;
          uint16_t slices_total;
          uint16_t num_parity;
-         uint16_t ununsed;
+
+         uint8_t version;        /* LOG_ENTRY_VERSION */
+         uint8_t checksum_type;  /* log_checksum_type_t */
+
          /* We conclude with a bit-vector used for compressing away all-zero blocks.
           * This is both to save space and bandwidth, but also to simplify log-
           * compaction, where blocks that are later overwritten can be compressed
@@ -175,44 +205,170 @@ static inline void init_backward_pointer(struct log_head *head, log_id_t target)
    head->target = target;
 }
 
-static inline size_t log_body_size(struct log_head *head)
+/* A large write can go in a single entry of up to LOG_ENTRY_MAX_BLOCKS
+ * blocks, a quarter of the smallest log segment, whatever the entry
+ * version. When its refs bitmap does not fit in the head, the bitmap goes
+ * in overflow blocks between the head and the body, and the refs area of
+ * the head holds the number of body blocks instead, so that the entry size
+ * can still be told from the head alone. */
+
+#define LOG_ENTRY_MAX_BLOCKS (LOG_DEFAULT_SEGMENT_BLOCKS / 4)
+#define LOG_MAX_REFS_BLOCKS (LOG_ENTRY_MAX_BLOCKS / (8 * BLKSIZE))
+
+/* Largest entry of any version */
+#define LOG_MAX_ENTRY_SIZE (LOG_HEAD_SIZE * (1 + LOG_MAX_REFS_BLOCKS) + \
+                            LOG_ENTRY_MAX_BLOCKS * BLKSIZE)
+
+static inline int log_entry_refs_blocks(const struct log_head *head)
 {
-   size_t sum;
-   log_block_t i;
+   int numBlocks = head->update.num_blocks;
 
+   if (head->update.version < 2 || numBlocks <= (int) LOG_HEAD_MAX_BLOCKS)
+      return 0;
+
+   return (numBlocks + 8 * BLKSIZE - 1) / (8 * BLKSIZE);
+}
+
+static inline size_t log_entry_head_size(const struct log_head *head)
+{
+   if (head->tag != log_entry_type)
+      return LOG_HEAD_SIZE;
+
+   return LOG_HEAD_SIZE * (1 + log_entry_refs_blocks(head));
+}
+
+/* The refs bitmap. For entries with overflow refs blocks, these must follow
+ * the head in memory. */
+
+static inline log_ref_t *log_entry_refs(struct log_head *head)
+{
+   if (log_entry_refs_blocks(head) > 0)
+      return (log_ref_t *)((char *)head + LOG_HEAD_SIZE);
+
+   return head->update.refs;
+}
+
+static inline uint32_t log_entry_body_blocks(const struct log_head *head)
+{
+   uint32_t n;
+   memcpy(&n, head->update.refs, sizeof(n));
+   return n;
+}
+
+static inline void log_entry_set_body_blocks(struct log_head *head, uint32_t n)
+{
+   memcpy(head->update.refs, &n, sizeof(n));
+}
+
+static inline size_t log_body_size(struct log_head *head)
+{
    if (head->tag != log_entry_type)
       return 0;
 
-   for (i = 0, sum = 0; i < head->update.num_blocks; i++) {
-      if (BitTest(head->update.refs,i))
-         sum += BLKSIZE;
-   }
+   if (log_entry_refs_blocks(head) > 0)
+      return (size_t) log_entry_body_blocks(head) * BLKSIZE;
 
-   return sum;
+   return (size_t) BitCount(head->update.refs, head->update.num_blocks) *
+          BLKSIZE;
 }
 
 static inline size_t log_entry_size(struct log_head *head)
 {
-   return log_body_size(head) + LOG_HEAD_SIZE;
+   return log_body_size(head) + log_entry_head_size(head);
+}
+
+static inline int is_block_zero(const char *blkdata)
+{
+   return mem_is_zero(blkdata, BLKSIZE);
+}
+
+/* Incremental computation of a log entry checksum, with the algorithm
+ * chosen at run time. Digests are always SHA1_DIGEST_SIZE bytes, shorter
+ * checksums are zero padded. */
+
+typedef struct {
+   log_checksum_type_t type;
+   union {
+      struct sha1_ctx sha1;
+      uint32_t crc;
+   };
+} log_checksum_ctx;
+
+static inline const char *log_checksum_name(log_checksum_type_t type)
+{
+   switch (type) {
+   case log_checksum_sha1:
+      return "sha1";
+   case log_checksum_crc32c:
+      return "crc32c";
+   default:
+      return "unknown";
+   }
 }
 
-static inline int is_block_zero(char *blkdata)
+static inline void log_checksum_init(log_checksum_ctx *ctx,
+                                     log_checksum_type_t type)
 {
-   unsigned int i;
-   int *data = (int *)blkdata;
+   ctx->type = type;
+   if (type == log_checksum_crc32c)
+      ctx->crc = 0;
+   else
+      sha1_init(&ctx->sha1);
+}
+
+static inline void log_checksum_update(log_checksum_ctx *ctx, size_t sz,
+                                       const void *data)
+{
+   if (ctx->type == log_checksum_crc32c)
+      ctx->crc = crc32c(ctx->crc, (const uint8_t *)data, sz);
+   else
+      sha1_update(&ctx->sha1, sz, (const uint8_t *)data);
+}
+
+static inline void log_checksum_digest(log_checksum_ctx *ctx,
+                                       unsigned char *sum)
+{
+   if (ctx->type == log_checksum_crc32c) {
+      memset(sum, 0, SHA1_DIGEST_SIZE);
+      memcpy(sum, &ctx->crc, sizeof(ctx->crc));
+   } else
+      sha1_digest(&ctx->sha1, SHA1_DIGEST_SIZE, sum);
+}
+
+/* Do the extent fields of this entry make sense? Entries from the network
+ * must be checked before their size is trusted. */
 
-   for (i = 0; i < BLKSIZE / sizeof(int); i++) {
-      if (data[i])
-         return 0;
+static inline int log_entry_extent_valid(struct log_head *head)
+{
+   if (head->update.num_blocks > LOG_ENTRY_MAX_BLOCKS) {
+      return 0;
+   }
+   if (head->update.version < 2) {
+      return head->update.num_blocks <= (int) LOG_HEAD_MAX_BLOCKS;
    }
-   return 1;
+   return (log_entry_refs_blocks(head) == 0 ||
+           log_entry_body_blocks(head) <= (uint32_t) head->update.num_blocks);
 }
 
-static inline void log_entry_checksum(unsigned char *sum, struct log_head *head,
-                                      const void *body, size_t sz)
+/* Can we verify this entry, i.e. is it from a format we know? */
+
+static inline int log_entry_checksum_supported(struct log_head *head)
 {
-   struct sha1_ctx ctx;
+   return (head->update.version <= LOG_ENTRY_VERSION &&
+           (head->update.version == 0 ||
+            head->update.checksum_type < log_checksum_num_types) &&
+           log_entry_extent_valid(head));
+}
 
+/* The entry checksum covers lsn, extent info, body and refs bitmap, in
+ * that order. Writers that produce the body piecemeal call
+ * log_entry_checksum_begin(), feed the body blocks to
+ * log_checksum_update(), and finish with log_entry_checksum_end() once
+ * the refs are final. */
+
+static inline void log_entry_checksum_begin(log_checksum_ctx *ctx,
+                                            struct log_head *head)
+{
    /* We hash from copies on the stack to prevent the compiler messing with the
     * field sizes. */
 
@@ -220,17 +376,36 @@ static inline void log_entry_checksum(unsigned char *sum, struct log_head *head,
    uint16_t n = head->update.num_blocks;
    uint64_t l = head->update.lsn;
 
-   sha1_init(&ctx);
-   sha1_update(&ctx, sizeof(l), (const uint8_t *)&l);
-   sha1_update(&ctx, sizeof(b), (const uint8_t *)&b);
-   sha1_update(&ctx, sizeof(n), (const uint8_t *)&n);
-   sha1_update(&ctx, sz, (const uint8_t *)body);
+   log_checksum_init(ctx, head->update.version >= 1 ?
+                     (log_checksum_type_t) head->update.checksum_type :
+                     log_checksum_sha1);
+   log_checksum_update(ctx, sizeof(l), &l);
+   log_checksum_update(ctx, sizeof(b), &b);
+   log_checksum_update(ctx, sizeof(n), &n);
+}
 
+static inline void log_entry_checksum_end(log_checksum_ctx *ctx,
+                                          struct log_head *head,
+                                          unsigned char *sum)
+{
    /* digest the refs last for practical reasons */
-   sha1_update(&ctx, LOG_HEAD_SIZE - sizeof(struct log_head),
-               (const uint8_t *)head->update.refs);
+   log_checksum_update(ctx, LOG_HEAD_SIZE - sizeof(struct log_head),
+                       head->update.refs);
+   if (log_entry_refs_blocks(head) > 0) {
+      log_checksum_update(ctx, log_entry_head_size(head) - LOG_HEAD_SIZE,
+                          (char *)head + LOG_HEAD_SIZE);
+   }
+   log_checksum_digest(ctx, sum);
+}
+
+static inline void log_entry_checksum(unsigned char *sum, struct log_head *head,
+                                      const void *body, size_t sz)
+{
+   log_checksum_ctx ctx;
 
-   sha1_digest(&ctx, SHA1_DIGEST_SIZE, sum);
+   log_entry_checksum_begin(&ctx, head);
+   log_checksum_update(&ctx, sz, body);
+   log_entry_checksum_end(&ctx, head, sum);
 }
 
 #endif                          /* __LOGTYPES_H__ */
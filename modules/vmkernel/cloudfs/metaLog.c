@@ -68,9 +68,30 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 void LogFS_MetaLogInit(LogFS_MetaLog *ml, LogFS_Device *device)
 {
    ml->device = device;
+   ml->checksumType = device->diskLayout.checksumType;
+   ml->segmentBlocks = device->diskLayout.segmentBlocks;
+   ml->segmentSize = LogFS_DiskLayoutGetSegmentSize(&device->diskLayout);
+   ml->groupCommitWindowUS = LOGFS_GROUP_COMMIT_WINDOW_US;
+   ml->groupCommitBytes = LOGFS_GROUP_COMMIT_BYTES;
+   ml->coalesceWindowUS = LOGFS_COALESCE_WINDOW_US;
+   ml->coalesceBytes = LOGFS_COALESCE_BYTES;
+   ml->readAheadBytes = LOGFS_READAHEAD_BYTES;
+   ml->readGapBytes = LOGFS_READ_GAP_BYTES;
+   ml->readGapBuffer = aligned_malloc(LOGFS_READ_MAX_GAP_BYTES);
+   ASSERT(ml->readGapBuffer);
+   LogFS_BlockCacheInit(&ml->blockCache, LOGFS_BLOCK_CACHE_BYTES);
+   ml->lookupWorkers = LOGFS_LOOKUP_WORKERS;
+   ml->localReadMS = LOGFS_LOCAL_READ_MS;
 
    SP_InitLock("appendlock", &ml->append_lock, SP_RANK_METALOG);
    SP_InitLock("refcountslock", &ml->refcounts_lock, SP_RANK_REFCOUNTS);
+   SP_InitLock("fingerprintlock", &ml->fingerprint_lock, SP_RANK_FINGERPRINT);
+   SP_InitLock("retiredlock", &ml->retired_lock, SP_RANK_RETIREDLOGS);
+   SP_InitLock("hashbufferlock", &ml->hashbuffer_lock, SP_RANK_HASHBUFFERS);
+
+   ml->appendLockAcquired = 0;
+   ml->appendLockContended = 0;
+   ml->appendLockWaitCycles = 0;
 
    LogFS_SegmentListInit(&ml->segment_list);
 
@@ -79,10 +100,17 @@ void LogFS_MetaLogInit(LogFS_MetaLog *ml, LogFS_Device *device)
    ml->compactionInProgress = FALSE;
 
    ml->activeLog = NULL;
-   ml->spaceLeft = 0;
-
-   LogFS_ObsoletedSegmentsInit(&ml->obsoleted);
-   LogFS_ObsoletedSegmentsInit(&ml->dupes);
+   ml->retiredLog = NULL;
+   Atomic_Write(&ml->appendEpoch, 0);
+   Atomic_Write(&ml->appenders[0], 0);
+   Atomic_Write(&ml->appenders[1], 0);
+   ml->releaseLogs[0] = NULL;
+   ml->releaseLogs[1] = NULL;
+   ml->hashBuffers = NULL;
+   ml->numHashBuffers = 0;
+
+   LogFS_ObsoletedSegmentsInit(&ml->obsoleted, ml->segmentBlocks);
+   LogFS_ObsoletedSegmentsInit(&ml->dupes, ml->segmentBlocks);
 
    ml->vt = malloc(sizeof(LogFS_VebTree));
    LogFS_VebTreeInit(ml->vt,NULL,0x200,0x10000);
@@ -98,6 +126,8 @@ void LogFS_MetaLogInit(LogFS_MetaLog *ml, LogFS_Device *device)
    //LogFS_DedupeInit(ml);
 }
 
+static void LogFS_MetaLogFreeHashBuffers(LogFS_MetaLog *ml);
+
 void LogFS_MetaLogCleanup(LogFS_MetaLog *ml)
 {
    int i;
@@ -105,6 +135,13 @@ void LogFS_MetaLogCleanup(LogFS_MetaLog *ml)
    LogFS_ObsoletedSegmentsCleanup(&ml->obsoleted);
    LogFS_ObsoletedSegmentsCleanup(&ml->dupes);
    free(ml->hd);
+   aligned_free(ml->readGapBuffer);
+   if (LogFS_BlockCacheEnabled(&ml->blockCache)) {
+      LogFS_BlockCacheShowStats(&ml->blockCache);
+   }
+   LogFS_BlockCacheCleanup(&ml->blockCache);
+
+   LogFS_MetaLogFreeHashBuffers(ml);
 
    for (i = 0; i < MAX_OPEN_LOGS; i++) {
       LogFS_Log *log;
@@ -142,6 +179,7 @@ void LogFS_MetaLogFreeLog(LogFS_MetaLog *ml, LogFS_Log *log)
       }
    }
    LogFS_MetaLogPutLog(ml, log);
+   LogFS_BlockCacheDropSegment(&ml->blockCache, index);
    LogFS_SegmentListFreeSegment(&ml->segment_list, index);
 }
 
@@ -213,21 +251,226 @@ LogFS_Log *LogFS_MetaLogPutLog(LogFS_MetaLog *ml, LogFS_Log *log)
 }
 
 
+/* Nobody waits for the close itself, beyond LogFS_MetaLogPrevStable() */
+
+static void
+LogFS_MetaLogCloseDone(Async_Token * token, void *data)
+{
+   Async_TokenCallback(token);
+   Async_ReleaseToken(token);
+}
+
+/* Write one of the pointer heads that link log segments together, at
+ * OFFSET in LOG. Nobody waits for this; the head is freed when done. */
+
+static void
+LogFS_MetaLogWriteHead(LogFS_Log *log, void *head, log_offset_t offset,
+                       int flags)
+{
+   VMK_ReturnStatus status;
+   Async_Token *token = Async_AllocToken(0);
+   SG_Array sg;
+
+   *((void **)Async_PushCallbackFrame(token, LogFS_FreeSimpleBufferAndToken,
+                                      sizeof(void *))) = head;
+
+   SG_SingletonSGArray(&sg, offset, (VA) head, LOG_HEAD_SIZE, SG_VIRT_ADDR);
+   do {
+      status = LogFS_LogWriteBody(log, token, &sg, flags);
+   } while (status == VMK_STORAGE_RETRY_OPERATION);
+   ASSERT(status == VMK_OK);
+}
+
 typedef struct {
-   LogFS_MetaLog *ml;
-   LogFS_Log *log;
-   void *endHead, *beginHead;
-} LogFS_MetaLogCloseContext;
+   LogFS_Log *nextLog;
+   void *beginHead;
+   int flags;
+} LogFS_MetaLogRolloverContext;
+
+/* Everything in the closed segment, up to and including the pointer to its
+ * successor, is on disk. Only now may the successor start with its
+ * backward pointer head, as none of the appends that follow that head may
+ * be acknowledged before recovery is certain to find them. A failed write
+ * may have moved the pointer back since the rollover, so the backward
+ * pointer is only filled in now. */
+
+static void
+LogFS_MetaLogPrevStable(LogFS_Log *prevLog, void *data)
+{
+   LogFS_MetaLogRolloverContext *r = data;
+   log_id_t prev;
+
+   prev.v.segment = LogFS_LogGetSegment(prevLog);
+   prev.v.blk_offset = prevLog->linkPos / BLKSIZE;
+   init_backward_pointer(r->beginHead, prev);
+
+   LogFS_MetaLogWriteHead(r->nextLog, r->beginHead, 0, r->flags);
+   free(r);
+}
+
+/* Appenders find the active log segment and reserve space in it without
+ * any locks. ml->activeLog only changes under append_lock, and the log it
+ * pointed to keeps its reference until one rollover later, when everyone
+ * who may have looked it up has left. To know when that is, appenders
+ * count themselves in one of two counters, and each rollover switches
+ * new appenders to the other one. The rollover does not wait for the
+ * counter it switches away from to drain, but leaves the retired log with
+ * it, and whoever leaves last releases it. */
+
+static void
+LogFS_MetaLogReleaseRetired(LogFS_MetaLog *ml, int e)
+{
+   LogFS_Log *log, *next;
+
+   SP_Lock(&ml->retired_lock);
+   log = ml->releaseLogs[e];
+   ml->releaseLogs[e] = NULL;
+   SP_Unlock(&ml->retired_lock);
+
+   for (; log != NULL; log = next) {
+      LogFS_FingerPrint *fp = log->fingerPrint;
+      log_segment_id_t s = LogFS_LogGetSegment(log);
+
+      next = log->nextRetired;
+      log->nextRetired = NULL;
+      LogFS_MetaLogPutLog(ml, log);
+
+      /* No one appends to the segment anymore, so its fingerprint is
+       * complete */
+      if (fp != NULL) {
+         SP_Lock(&ml->fingerprint_lock);
+         LogFS_FingerPrintFinish(fp, ml->vt, s);
+         SP_Unlock(&ml->fingerprint_lock);
+      }
+   }
+}
 
-void LogFS_MetaLogCloseDone(Async_Token * token, void *data)
+static void
+LogFS_MetaLogExitAppend(LogFS_MetaLog *ml, int e)
 {
-   LogFS_MetaLogCloseContext *c = data;
+   if (Atomic_FetchAndDec(&ml->appenders[e]) == 1 &&
+       *((LogFS_Log * volatile *) &ml->releaseLogs[e]) != NULL) {
+      LogFS_MetaLogReleaseRetired(ml, e);
+   }
+}
 
-   if (c->log)
-      LogFS_MetaLogPutLog(c->ml, c->log);
-   aligned_free(c->endHead);
-   aligned_free(c->beginHead);
-   Async_TokenCallback(token);
+static int
+LogFS_MetaLogEnterAppend(LogFS_MetaLog *ml)
+{
+   for (;;) {
+      int e = Atomic_Read(&ml->appendEpoch) & 1;
+      Atomic_Inc(&ml->appenders[e]);
+      if ((Atomic_Read(&ml->appendEpoch) & 1) == e) {
+         return e;
+      }
+
+      /* May be the last one out of the old epoch */
+      LogFS_MetaLogExitAppend(ml, e);
+   }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LogFS_MetaLogRollover --
+ *
+ *      Close the active log segment and start a new one. Called with
+ *      append_lock held.
+ *
+ * Results:
+ *      The epoch the caller is now counted in as an appender, to leave
+ *      with LogFS_MetaLogExitAppend() once it has dropped append_lock.
+ *
+ * Side effects:
+ *      ml->activeLog is replaced.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static int
+LogFS_MetaLogRollover(LogFS_MetaLog *ml, int flags)
+{
+   VMK_ReturnStatus status;
+   LogFS_Log *prevLog = ml->activeLog;
+   log_offset_t pos;
+   Bool reserved;
+   int e;
+
+   log_segment_id_t s = LogFS_SegmentListAllocSegment(&ml->segment_list);
+
+   LogFS_Log *nextLog = LogFS_MetaLogGetLog(ml, s);
+   LogFS_AppendLogInit(nextLog, ml, s, 0);
+
+   nextLog->fingerPrint = malloc(sizeof(LogFS_FingerPrint));
+   LogFS_FingerPrintInit(nextLog->fingerPrint, ml->segmentBlocks);
+   ml->fingerPrints[s] = ml->fp = nextLog->fingerPrint;
+
+   /* Room for the backward pointer that starts the segment */
+   reserved = LogFS_AppendLogReserve(nextLog, LOG_HEAD_SIZE, 0, &pos);
+   ASSERT(reserved && pos == 0);
+
+   /* Anyone who could still be using the segment retired last time is
+    * counted in the epoch before the current one. Hand the segment to
+    * that epoch, and count ourselves in it, so that it cannot drain
+    * before we are done here. Whoever then leaves it last releases the
+    * segment. The counter is about to take new appenders, so that may be
+    * one of them, but once the next rollover moves them on it drains
+    * for sure. */
+
+   e = (Atomic_Read(&ml->appendEpoch) + 1) & 1;
+   Atomic_Inc(&ml->appenders[e]);
+
+   if (ml->retiredLog != NULL) {
+      SP_Lock(&ml->retired_lock);
+      ml->retiredLog->nextRetired = ml->releaseLogs[e];
+      ml->releaseLogs[e] = ml->retiredLog;
+      SP_Unlock(&ml->retired_lock);
+      ml->retiredLog = NULL;
+   }
+
+   mk_invalid_version(prev);
+   void *beginHead = aligned_malloc(LOG_HEAD_SIZE);
+
+   if (prevLog != NULL) {
+      log_offset_t end = LogFS_AppendLogSeal(prevLog);
+
+      /* append a 'next' pointer to end of log segment before close, or
+       * where a failed write ended it */
+
+      LogFS_MetaLogRolloverContext *r = malloc(sizeof(*r));
+      r->nextLog = nextLog;
+      r->beginHead = beginHead;
+      r->flags = flags;
+      LogFS_LogLinkNext(prevLog, end, s, LogFS_MetaLogPrevStable, r, flags);
+
+      Async_Token *closeToken = Async_AllocToken(0);
+      Async_PushCallbackFrame(closeToken, LogFS_MetaLogCloseDone, 0);
+      status = LogFS_AppendLogCloseAt(prevLog, closeToken,
+                                      end + LOG_HEAD_SIZE, flags);
+      ASSERT(status == VMK_OK);
+
+      ++(ml->lurt);
+      zprintf("lurt %d, append lock contended %" FMT64 "u/%" FMT64
+              "u times, waited %" FMT64 "uus\n", ml->lurt,
+              ml->appendLockContended, ml->appendLockAcquired,
+              Timer_AbsTCToUS(ml->appendLockWaitCycles));
+      LogFS_LogShowBatchStats(prevLog);
+
+   } else {
+
+      /* The first log segment ever */
+      init_backward_pointer(beginHead, prev);
+      LogFS_MetaLogWriteHead(nextLog, beginHead, 0, flags);
+   }
+
+   /* Publish the new segment. The epoch switch must come after, so that
+    * appenders counted in the new epoch cannot see prevLog. */
+
+   ml->activeLog = nextLog;
+   Atomic_Inc(&ml->appendEpoch);
+   ml->retiredLog = prevLog;
+
+   return e;
 }
 
 VMK_ReturnStatus LogFS_MetaLogReopen(LogFS_MetaLog *ml, log_id_t position)
@@ -236,7 +479,6 @@ VMK_ReturnStatus LogFS_MetaLogReopen(LogFS_MetaLog *ml, log_id_t position)
    log_offset_t end = position.v.blk_offset * BLKSIZE;
 
    ml->activeLog = LogFS_MetaLogGetLog(ml, s);
-   ml->spaceLeft = LOG_MAX_SEGMENT_SIZE - end;
 
    zprintf("reopen end %lu\n",end);
    LogFS_AppendLogInit(ml->activeLog, ml, s, end);
@@ -367,152 +609,237 @@ void LogFS_MetaLogDedupeSg(
 }
 #endif
 
-VMK_ReturnStatus
-LogFS_MetaLogAppend(LogFS_MetaLog *ml, Async_Token *token,
-      SG_Array *sgArr,
-      log_id_t *retVersion, int flags)
-{
-   VMK_ReturnStatus status = VMK_OK;
-   Async_IOHandle *ioh = NULL;
-
-   Hash nil;
-   LogFS_HashZero(&nil);
+/* A log entry's blocks hashed ahead of appending it, so that the hashing
+ * happens outside of append_lock. Entries of up to LOGFS_INLINE_HASH_BLOCKS
+ * body blocks, which is most of them, keep the hashes on the stack. Larger
+ * ones borrow a buffer from the metaLog, which keeps up to
+ * LOGFS_SPARE_HASH_BUFFERS of them, so appends do not go to the heap. */
 
-   SP_Lock(&ml->append_lock);
+#define LOGFS_INLINE_HASH_BLOCKS 16
+#define LOGFS_SPARE_HASH_BUFFERS 4
 
-   /* Is current log segment full? */
+typedef struct LogFS_MetaLogHashBuffer {
+   struct LogFS_MetaLogHashBuffer *next;
+   Hash hashes[LOG_ENTRY_MAX_BLOCKS];
+   log_block_t blknos[LOG_ENTRY_MAX_BLOCKS];
+} LogFS_MetaLogHashBuffer;
 
-   if (ml->spaceLeft < SG_TotalLength(sgArr) + 3 * LOG_HEAD_SIZE) {
+typedef struct {
+   LogFS_VDisk *vd;
+   int numBlocks;
+   int headBlocks;
+   Hash *hashes;
+   log_block_t *blknos;
+   LogFS_MetaLogHashBuffer *buffer;   /* borrowed, or NULL */
+   Hash inlineHashes[LOGFS_INLINE_HASH_BLOCKS];
+   log_block_t inlineBlknos[LOGFS_INLINE_HASH_BLOCKS];
+} LogFS_MetaLogBlockHashes;
+
+static LogFS_MetaLogHashBuffer *
+LogFS_MetaLogGetHashBuffer(LogFS_MetaLog *ml)
+{
+   LogFS_MetaLogHashBuffer *hb;
 
-      log_segment_id_t s = LogFS_SegmentListAllocSegment(&ml->segment_list);
+   SP_Lock(&ml->hashbuffer_lock);
+   hb = ml->hashBuffers;
+   if (hb != NULL) {
+      ml->hashBuffers = hb->next;
+      --(ml->numHashBuffers);
+   }
+   SP_Unlock(&ml->hashbuffer_lock);
 
-      LogFS_Log *nextLog = LogFS_MetaLogGetLog(ml, s);
-      LogFS_AppendLogInit(nextLog, ml, s, 0);
- 
-      ml->fp = malloc(sizeof(LogFS_FingerPrint));
-      LogFS_FingerPrintInit(ml->fp);
-      ml->fingerPrints[s] = ml->fp;
+   if (hb == NULL) {
+      hb = malloc(sizeof(LogFS_MetaLogHashBuffer));
+      ASSERT(hb);
+   }
+   return hb;
+}
 
-      mk_invalid_version(prev);
+static void
+LogFS_MetaLogPutHashBuffer(LogFS_MetaLog *ml, LogFS_MetaLogHashBuffer *hb)
+{
+   SP_Lock(&ml->hashbuffer_lock);
+   if (ml->numHashBuffers < LOGFS_SPARE_HASH_BUFFERS) {
+      hb->next = ml->hashBuffers;
+      ml->hashBuffers = hb;
+      ++(ml->numHashBuffers);
+      hb = NULL;
+   }
+   SP_Unlock(&ml->hashbuffer_lock);
 
-      ASSERT(token);
+   if (hb != NULL) {
+      free(hb);
+   }
+}
 
-      /* append a 'next' pointer to end of log segment before close */
+static void
+LogFS_MetaLogFreeHashBuffers(LogFS_MetaLog *ml)
+{
+   while (ml->hashBuffers != NULL) {
+      LogFS_MetaLogHashBuffer *hb = ml->hashBuffers;
+      ml->hashBuffers = hb->next;
+      free(hb);
+   }
+   ml->numHashBuffers = 0;
+}
 
-      log_id_t next;
-      next.v.segment = s;
-      next.v.blk_offset = 0;
+static void
+LogFS_MetaLogHashBlocks(LogFS_MetaLog *ml, struct log_head *head,
+                        SG_Array *sgArr, LogFS_MetaLogBlockHashes *bh)
+{
+   int i, j, k, n;
+   const void *blks[SHA1_MULTI_LANES];
+
+   int numRefs = head->update.num_blocks;
+   log_ref_t *refs = log_entry_refs(head);
+
+   bh->vd = LogFS_DiskMapLookupDisk(LogFS_HashFromRaw(head->disk));
+   bh->headBlocks = sgArr->sg[0].length / BLKSIZE;
+   bh->numBlocks = (SG_TotalLength(sgArr) - sgArr->sg[0].length) / BLKSIZE;
+   bh->hashes = bh->inlineHashes;
+   bh->blknos = bh->inlineBlknos;
+   bh->buffer = NULL;
+
+   /* An all-zero write has no body */
+   if (bh->numBlocks == 0) {
+      return;
+   }
 
-      void *beginHead = aligned_malloc(LOG_HEAD_SIZE);
-      void *endHead = aligned_malloc(LOG_HEAD_SIZE);
+   if (bh->numBlocks > LOGFS_INLINE_HASH_BLOCKS) {
+      ASSERT(bh->numBlocks <= LOG_ENTRY_MAX_BLOCKS);
+      bh->buffer = LogFS_MetaLogGetHashBuffer(ml);
+      bh->hashes = bh->buffer->hashes;
+      bh->blknos = bh->buffer->blknos;
+   }
 
-      init_forward_pointer(endHead, next);
+   /* Hash the blocks SHA1_MULTI_LANES at a time, which is several
+    * times faster than doing them one by one */
 
-      LogFS_MetaLogCloseContext *c = Async_PushCallbackFrame(token,
-                                                             LogFS_MetaLogCloseDone,
-                                                             sizeof
-                                                             (LogFS_MetaLogCloseContext));
-      c->ml = ml;
-      c->log = ml->activeLog;
-      c->beginHead = beginHead;
-      c->endHead = endHead;
+   for (i = 1, k = 0, n = 0; i < sgArr->length; ++i) {
 
-      Async_StartSplitIO(token, Async_DefaultChildDoneFn, 0, &ioh);
+      size_t sz = sgArr->sg[i].length;
+      for (j = 0; j < sz / BLKSIZE; ++j) {
 
-      /* Except if its the first log segment ever */
+         /* Non-zero blocks come in runs, so only look up where the n'th
+          * body block lives in the entry when a run ends */
+         if (k >= numRefs || !BitTest(refs, k)) {
+            k = BitFindNth(refs, numRefs, n);
+         }
 
-      if (ml->activeLog != NULL) {
-         Async_Token *t1 = Async_PrepareOneIO(ioh, NULL);
-         status = LogFS_AppendLogAppendSimple(ml->activeLog, t1, endHead, LOG_HEAD_SIZE,
-                               &prev, flags);
-         ASSERT(status==VMK_OK);
-         LogFS_FingerPrintAddHash(ml->fp,nil,NULL,0);
+         ASSERT(k >= 0 && BitTest(refs, k));
+         blks[n % SHA1_MULTI_LANES] = (char*) (sgArr->sg[i].addr + BLKSIZE * j);
+         bh->blknos[n] = head->update.blkno + k;
 
-         Async_Token *t2 = Async_PrepareOneIO(ioh, NULL);
-         status = LogFS_AppendLogClose(ml->activeLog, t2, flags);
-         ASSERT(status==VMK_OK);
+         if (++n % SHA1_MULTI_LANES == 0) {
+            LogFS_HashChecksumMulti(bh->hashes + n - SHA1_MULTI_LANES, blks,
+                                    SHA1_MULTI_LANES, BLKSIZE);
+         }
 
-         LogFS_FingerPrintFinish(ml->fp,ml->vt,LogFS_LogGetSegment(ml->activeLog));
-         ++(ml->lurt);
-         zprintf("lurt %d\n",ml->lurt);
+         ++k;
       }
+   }
+   LogFS_HashChecksumMulti(bh->hashes + n - n % SHA1_MULTI_LANES, blks,
+                           n % SHA1_MULTI_LANES, BLKSIZE);
+   ASSERT(n == bh->numBlocks);
+}
 
+static void
+LogFS_MetaLogFreeBlockHashes(LogFS_MetaLog *ml, LogFS_MetaLogBlockHashes *bh)
+{
+   if (bh->buffer != NULL) {
+      LogFS_MetaLogPutHashBuffer(ml, bh->buffer);
+      bh->buffer = NULL;
+   }
+}
 
-      /* start the new segment with a pointer to previous segment */
-
-      Async_Token *t3 = Async_PrepareOneIO(ioh, NULL);
-      init_backward_pointer(beginHead, prev);
-      status = LogFS_AppendLogAppendSimple(nextLog, t3, beginHead, LOG_HEAD_SIZE, NULL,
-                            flags);
-
-      LogFS_FingerPrintAddHash(ml->fp,nil,NULL,0);
-
-      ml->activeLog = nextLog;
-      ml->spaceLeft = LOG_MAX_SEGMENT_SIZE;
-
-      /* Because we have split the IO, we override the incoming token
-       * with our own */
-      if (token != NULL) {
-         token = Async_PrepareOneIO(ioh, NULL);
-      }
+/* Take append_lock, and account for how long we had to wait for it. */
 
+static inline void
+LogFS_MetaLogLockAppend(LogFS_MetaLog *ml)
+{
+   if (!SP_TryLock(&ml->append_lock)) {
+      uint64 start = Timer_GetCycles();
+      SP_Lock(&ml->append_lock);
+      ml->appendLockWaitCycles += Timer_GetCycles() - start;
+      ++(ml->appendLockContended);
    }
+   ++(ml->appendLockAcquired);
+}
 
-   /* Now we know the log segment has enough space to hold our write. */
-
-   //log_id_t nil;
-   //nil.raw = 0;
-   //log_id_t pos = ml->activeLog ? LogFS_AppendLogGetEnd(ml->activeLog) : nil;
-   //LogFS_MetaLogDedupeSg(ml,token,pos,ml->hd,sgIn,&sgArr);
-   //
+VMK_ReturnStatus
+LogFS_MetaLogAppend(LogFS_MetaLog *ml, Async_Token *token,
+      SG_Array *sgArr,
+      log_id_t *retVersion, int flags)
+{
+   VMK_ReturnStatus status = VMK_OK;
+   int i;
 
    struct log_head *head = (struct log_head*) sgArr->sg[0].addr;
 
-   int i,j;
+   /* Fingerprinting is CPU heavy, so do it up front. Once we know where in
+    * the segment the blocks go, recording the hashes is just a copy. */
 
-   if (head->tag == log_entry_type) {
+   LogFS_MetaLogBlockHashes bh;
+   Bool isEntry = (head->tag == log_entry_type);
+   if (isEntry) {
+      LogFS_MetaLogHashBlocks(ml, head, sgArr, &bh);
+   }
 
-      LogFS_VDisk *vd = LogFS_DiskMapLookupDisk( LogFS_HashFromRaw(head->disk));
+   for (;;) {
+      log_offset_t pos;
+      int e = LogFS_MetaLogEnterAppend(ml);
+      LogFS_Log *log = *((LogFS_Log * volatile *) &ml->activeLog);
 
-      /* Add head to fingerprint for completeness */
-      LogFS_FingerPrintAddHash(ml->fp,nil,NULL,0);
+      if (log != NULL &&
+          LogFS_AppendLogReserve(log, SG_TotalLength(sgArr),
+                                 3 * LOG_HEAD_SIZE, &pos)) {
 
-      int k=0;
-      for(i=1; i<sgArr->length; ++i) {
+         if (isEntry && log->fingerPrint != NULL) {
+            for (i = 0; i < bh.numBlocks; ++i) {
+               LogFS_FingerPrintSetHash(log->fingerPrint,
+                                        pos / BLKSIZE + bh.headBlocks + i,
+                                        bh.hashes[i], bh.vd, bh.blknos[i]);
+            }
+         }
 
-         while(k < head->update.num_blocks && !BitTest(head->update.refs,k)) ++k;
+         status = LogFS_AppendLogAppendAt(log, token, sgArr, pos,
+                                          retVersion, flags);
+         LogFS_MetaLogExitAppend(ml, e);
 
-         size_t sz = sgArr->sg[i].length;
-         for(j=0;j<sz/BLKSIZE;++j) {
+         /* XXX how do we know the IO has completed? We don't, but the
+          * remoteLog will loop around waiting for data. */
+         CpuSched_Wakeup(&ml->remoteWaiters);
+         break;
+      }
 
-            char *blk = (char*) (sgArr->sg[i].addr + BLKSIZE*j);
-            Hash h = LogFS_HashChecksum(blk,BLKSIZE);
-            ASSERT(BitTest(head->update.refs,k));
-            LogFS_FingerPrintAddHash(ml->fp,h,vd, head->update.blkno + k);
+      LogFS_MetaLogExitAppend(ml, e);
 
+      /* The segment is full, or there is none yet. Whoever gets the lock
+       * first rolls over, and everyone else then retries in the new one. */
 
-            ++k;
+      Bool rolledOver = FALSE;
 
-         }
+      LogFS_MetaLogLockAppend(ml);
+      if (ml->activeLog == log) {
+         e = LogFS_MetaLogRollover(ml, flags);
+         rolledOver = TRUE;
       }
-   }
-
-   status = LogFS_AppendLogAppend(ml->activeLog, token, sgArr,
-         retVersion, flags);
+      SP_Unlock(&ml->append_lock);
 
-   /* XXX how do we know the IO has completed? We don't, but the
-    * remoteLog will loop around waiting for data. */
-   CpuSched_Wakeup(&ml->remoteWaiters);
+      /* Releasing the retired segment condenses its fingerprint, so do
+       * that, if it falls to us, outside append_lock */
+      if (rolledOver) {
+         LogFS_MetaLogExitAppend(ml, e);
+      }
+   }
 
-   ml->spaceLeft -= SG_TotalLength(sgArr);
+   /* The write may already have completed, so head must not be
+    * touched from here on */
 
-   /* Did we split the IO above? If so, end it here */
-   if (ioh != NULL) {
-      Async_EndSplitIO(ioh, status, FALSE);
+   if (isEntry) {
+      LogFS_MetaLogFreeBlockHashes(ml, &bh);
    }
 
-   SP_Unlock(&ml->append_lock);
-
    //SG_Free(logfsHeap,&sgArr);
 
    return status;
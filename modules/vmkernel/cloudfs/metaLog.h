@@ -38,10 +38,50 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "segmentlist.h"
 #include "logfsIO.h"
 #include "obsoleted.h"
+#include "blockCache.h"
 
 #define MAX_OPEN_LOGS 128
 
+#define LOGFS_GROUP_COMMIT_WINDOW_US 200
+#define LOGFS_GROUP_COMMIT_BYTES (256 * 1024)
+
+/* Defaults for the coalescing of small vdisk writes, see vDisk.c. It costs
+ * a copy of the data, so it is off unless asked for. */
+
+#define LOGFS_COALESCE_WINDOW_US 0
+#define LOGFS_COALESCE_BYTES (128 * 1024)
+
+/* Largest readahead window of a vdisk read stream, see vDisk.c */
+
+#define LOGFS_READAHEAD_BYTES (1024 * 1024)
+
+/* Vdisk reads of extents no further apart on disk than this are merged,
+ * see vDisk.c. The default covers the head of a log entry. */
+
+#define LOGFS_READ_GAP_BYTES (4 * 1024)
+#define LOGFS_READ_MAX_GAP_BYTES (64 * 1024)
+
+/* Default size of the cache of log blocks, see blockCache.h */
+
+#define LOGFS_BLOCK_CACHE_BYTES (32 * 1024 * 1024)
+
+/* Threads answering rangemap lookups that had to be postponed, see
+ * bTreeRange.c */
+
+#define LOGFS_LOOKUP_WORKERS 4
+#define LOGFS_LOOKUP_MAX_WORKERS 16
+
+/* How long a read lease lasts, which lets a replica serve reads from its
+ * own log after the primary confirmed it current, see
+ * LogFS_VDiskGrantLease(). The primary holds back write acknowledgements
+ * until its leases end, so this adds up to that much write latency after
+ * a replica read. Off unless asked for. */
+
+#define LOGFS_LOCAL_READ_MS 0
+#define LOGFS_LOCAL_READ_MAX_MS 10000
+
 struct LogFS_FingerPrint;
+struct LogFS_MetaLogHashBuffer;
 
 typedef struct LogFS_MetaLog {
    btree_t *superTree;
@@ -57,18 +97,67 @@ typedef struct LogFS_MetaLog {
 
    SP_SpinLock append_lock;
    SP_SpinLock refcounts_lock;
+   SP_SpinLock fingerprint_lock;   /* protects vt */
+   SP_SpinLock retired_lock;       /* protects releaseLogs */
+   SP_SpinLock hashbuffer_lock;    /* protects hashBuffers */
+
+   /* append_lock contention, protected by append_lock */
+   uint64 appendLockAcquired;
+   uint64 appendLockContended;
+   uint64 appendLockWaitCycles;
 
    List_Links remoteWaiters;
 
    LogFS_Log *activeLog;
-   log_size_t spaceLeft;
+   LogFS_Log *retiredLog;
+   Atomic_uint32 appendEpoch;
+   Atomic_uint32 appenders[2];
+
+   /* Retired logs to release once appenders[e] drops to zero, linked
+    * through nextRetired */
+   LogFS_Log *releaseLogs[2];
 
    int lurt;
 
    struct LogFS_DiskLayout *diskLayout;
+
+   /* From the disk layout */
+   log_size_t segmentSize;
+   uint32 segmentBlocks;
+
+   /* Checksum used for entries appended to this log */
+   log_checksum_type_t checksumType;
+
+   /* Group commit tuning, see log.c. A zero window disables batching. */
+   uint32 groupCommitWindowUS;
+   uint32 groupCommitBytes;
+
+   /* Small-write coalescing, see vDisk.c. A zero window disables it. */
+   uint32 coalesceWindowUS;
+   uint32 coalesceBytes;
+
+   /* Sequential readahead, see vDisk.c. Zero disables it. */
+   uint32 readAheadBytes;
+
+   /* Gap allowed between merged vdisk reads, read into readGapBuffer */
+   uint32 readGapBytes;
+   char *readGapBuffer;
+
+   /* Recently read log blocks, shared by all vdisks */
+   LogFS_BlockCache blockCache;
+
+   /* Number of rangemap lookup workers */
+   uint32 lookupWorkers;
+
+   /* Local reads on replicas, see vDisk.c. Zero disables them. */
+   uint32 localReadMS;
    
    Bool compactionInProgress;
 
+   /* Spare block hash buffers for large entries, see metaLog.c */
+   struct LogFS_MetaLogHashBuffer *hashBuffers;
+   int numHashBuffers;
+
    /* Dedupe related */
    struct LogFS_VebTree *vt;
    struct LogFS_HashDb *hd;
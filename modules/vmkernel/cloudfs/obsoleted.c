@@ -35,11 +35,13 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "metaLog.h"
 #include "binHeap.h"
 
-void LogFS_ObsoletedSegmentsInit(LogFS_ObsoletedSegments *os)
+void LogFS_ObsoletedSegmentsInit(LogFS_ObsoletedSegments *os,
+                                 uint32 segmentBlocks)
 {
 
    LogFS_BinHeapInit(&os->heap, MAX_NUM_SEGMENTS);
    os->numCandidateSegments = 0;
+   os->candidateLimit = segmentBlocks / 5;
 
    SP_InitLock("obslock", &os->lock, SP_RANK_OBSOLETED);
    LogFS_ObsoletedSegmentsClearRemaps(os);
@@ -117,7 +119,7 @@ void LogFS_ObsoletedSegmentsAdd(LogFS_ObsoletedSegments *os,
 
    value = LogFS_BinHeapAdjustUp(&os->heap, segment, howmany);
 
-   int limit = LOG_MAX_SEGMENT_BLOCKS / 5;
+   int limit = os->candidateLimit;
    /* Did we cross the threshold and become GC fodder? */
    if ((value - howmany) < limit && value >= limit) {
       ++(os->numCandidateSegments);
@@ -45,6 +45,9 @@ typedef struct {
    LogFS_BinHeap heap;
    int numCandidateSegments;
 
+   /* Segments with this many obsolete blocks are worth cleaning */
+   int candidateLimit;
+
    struct {
       log_segment_id_t from, to;
    } remaps[LOGFS_OBS_MAX_REMAPS];
@@ -54,7 +57,8 @@ typedef struct {
 
 struct LogFS_MetaLog;
 
-void LogFS_ObsoletedSegmentsInit(LogFS_ObsoletedSegments *os);
+void LogFS_ObsoletedSegmentsInit(LogFS_ObsoletedSegments *os,
+                                 uint32 segmentBlocks);
 void LogFS_ObsoletedSegmentsCleanup(LogFS_ObsoletedSegments *os);
 void LogFS_ObsoletedSegmentsAdd(LogFS_ObsoletedSegments *os,
                                 log_segment_id_t segment, int howmany);
@@ -163,6 +163,7 @@ static inline NodeInfo *createNodeInfo(btree_t *t, void *context, disk_block_t b
 
    List_InitElement(&info->dirtyList);
    List_Init(&info->waiters);
+   List_Init(&info->resumers);
    return info;
 }
 
@@ -171,6 +172,12 @@ typedef struct {
    NodeInfo *info;
 } ReadInfo;
 
+typedef struct {
+   void (*resume)(void *data);
+   void *data;
+   List_Links next;
+} ResumeInfo;
+
 void LogFS_RangeMapGotNode(Async_Token *token, void *data)
 {
    ReadInfo *c = data;
@@ -184,16 +191,29 @@ void LogFS_RangeMapGotNode(Async_Token *token, void *data)
    }
 
 
-   /* Wake up threads waiting for this node */
+   /* Wake up threads waiting for this node, and resume optimistic readers
+    * that ran into it */
+   List_Links resumers;
+   List_Links *curr, *next;
+   List_Init(&resumers);
+
    SP_Lock(&cache->lock);
    incoming->user_data = (uint64)info;
    info->incoming = NULL;
    info->node = incoming;
    CpuSched_Wakeup(&info->waiters);
+   List_Append(&resumers, &info->resumers);
    SP_Unlock(&cache->lock);
 
    releaseInfo(info);
 
+   LIST_FORALL_SAFE(&resumers, curr, next) {
+      ResumeInfo *r = List_Entry(curr, ResumeInfo, next);
+      List_Remove(curr);
+      r->resume(r->data);
+      free(r);
+   }
+
    Async_TokenCallback(token);
 }
 
@@ -204,6 +224,15 @@ static const node_t *get_node_disk(btree_t *t, disk_block_t block,
    int line;
    int idx;
 
+   LogFS_PagedTreeReader *reader =
+      (context != LOGFS_PAGEDTREE_CANTBLOCK) ? context : NULL;
+
+   /* An optimistic reader may have read a node while it was changing */
+   if (reader != NULL &&
+       (block >= TREE_MAX_BLOCKS || !BitTest(nodesBitmap,block))) {
+      return NULL;
+   }
+
    if (block >= TREE_MAX_BLOCKS) {
       Panic("out of room node %u",block);
    }
@@ -313,12 +342,57 @@ found:
             }
          }
       } else {
+         if (reader != NULL && reader->fault == NULL) {
+            reader->fault = refInfo(info);
+         }
          return NULL;
       }
 
    }
 }
 
+/* Forget the node an optimistic reader ran into, if any. */
+
+void LogFS_PagedTreeReaderDone(LogFS_PagedTreeReader *reader)
+{
+   if (reader->fault != NULL) {
+      releaseInfo(reader->fault);
+      reader->fault = NULL;
+   }
+}
+
+/* Arrange for RESUME to be called with DATA, from the completion of the
+ * page-in, once the node READER ran into is in memory. Returns FALSE if it
+ * already is, in which case the caller should simply retry. */
+
+Bool LogFS_PagedTreeResumeOnFault(LogFS_PagedTreeReader *reader,
+                                  void (*resume)(void *), void *data)
+{
+   NodeInfo *info = reader->fault;
+   Bool waiting = FALSE;
+
+   ASSERT(info != NULL);
+
+   ResumeInfo *r = malloc(sizeof(ResumeInfo));
+   ASSERT(r);
+   r->resume = resume;
+   r->data = data;
+
+   SP_Lock(&theCache->lock);
+   if (info->node == NULL) {
+      List_Insert(&r->next, LIST_ATREAR(&info->resumers));
+      waiting = TRUE;
+   }
+   SP_Unlock(&theCache->lock);
+
+   if (!waiting) {
+      free(r);
+   }
+
+   LogFS_PagedTreeReaderDone(reader);
+   return waiting;
+}
+
 
 static inline void rememberDirtyNode(btree_t *t, NodeInfo *info)
 {
@@ -567,17 +641,26 @@ VMK_ReturnStatus LogFS_PagedTreeSync(btree_t *t, LogFS_MetaLog *ml, List_Links *
 
    /* Now that we know the new locations of the nodes to be written,
     * we can fix up inter-node references so that nodes are referenced
-    * at the new locations. After fixing up a node, we queue for write.
-    * Ideally we should use an SGArray instead of potentially lots of
-    * split IOs here.
+    * at the new locations. This is done on copies of the nodes, as
+    * optimistic readers must not follow the new references before the
+    * nodes are on disk and in the cache at their new locations. After
+    * fixing up a node, we queue for write. Ideally we should use an
+    * SGArray instead of potentially lots of split IOs here.
     */
 
+   node_t **copies = malloc(MAX(numNodes, 1) * sizeof(node_t *));
+   ASSERT(copies);
+   int i = 0;
+
    Async_StartSplitIO(token, Async_DefaultChildDoneFn, 0, &ioh);
 
    LIST_FORALL(&dirtyNodesList, curr) {
 
       NodeInfo *info = List_Entry(curr, NodeInfo, dirtyList);
-      node_t *n = (node_t *)info->node;
+      node_t *n = malloc(t->real_node_size);
+      ASSERT(n);
+      memcpy(n, info->node, t->real_node_size);
+      copies[i++] = n;
 
       Async_Token *t1 = Async_PrepareOneIO(ioh, NULL);
 
@@ -598,14 +681,25 @@ VMK_ReturnStatus LogFS_PagedTreeSync(btree_t *t, LogFS_MetaLog *ml, List_Links *
    Async_WaitForIO(token);
    Async_ReleaseToken(token);
 
-   /* The final step is to reindex the cache with the new node locations.  We
-    * need to do this with the cache lock held, because the cache nodeMap will
-    * be temporarily unsorted. */
+   for (i = 0; i < numNodes; i++) {
+      free(copies[i]);
+   }
+   free(copies);
+
+   /* The final step is to switch the nodes in memory, and the cache index,
+    * over to the new node locations.  We need to do this with the cache
+    * lock held, because the cache nodeMap will be temporarily unsorted. */
 
+   LogFS_PagedTreeWriteBegin(t);
    SP_Lock(&cache->lock);
 
    LIST_FORALL(&dirtyNodesList, curr) {
       NodeInfo *info = List_Entry(curr, NodeInfo, dirtyList);
+      node_t *n = (node_t *)info->node;
+
+      if(!n->leaf) {
+         remapChildren(n, map);
+      }
       info->nodeIdx = remapBlock(info->nodeIdx,map);
    }
 
@@ -628,6 +722,7 @@ VMK_ReturnStatus LogFS_PagedTreeSync(btree_t *t, LogFS_MetaLog *ml, List_Links *
 
    /* Finally commit the updates by updating the tree root pointer */
    t->root = remapBlock(t->root, map);
+   LogFS_PagedTreeWriteEnd(t);
 
 #if 0
    if (numNodes > 0) {
@@ -640,6 +735,13 @@ VMK_ReturnStatus LogFS_PagedTreeSync(btree_t *t, LogFS_MetaLog *ml, List_Links *
    return VMK_OK;
 }
 
+/* Readers pass a LogFS_PagedTreeReader as context, see get_node_disk() */
+
+static int optimistic_disk(btree_t *t, void *context)
+{
+   return (context != NULL && context != LOGFS_PAGEDTREE_CANTBLOCK);
+}
+
 void LogFS_PagedTreeFillinCallbacks(btree_callbacks_t *callbacks)
 {
    callbacks->alloc_node = allocDiskNode;
@@ -647,6 +749,7 @@ void LogFS_PagedTreeFillinCallbacks(btree_callbacks_t *callbacks)
    callbacks->edit_node = edit_node_disk;
    callbacks->get_node = get_node_disk;
    callbacks->put_node = put_node_disk;
+   callbacks->optimistic = optimistic_disk;
 }
 
 static TreeInfo *LogFS_PagedTreeCreateTreeInfo(btree_t *t,
@@ -807,6 +910,7 @@ VMK_ReturnStatus LogFS_PagedTreeDiskReopen(LogFS_MetaLog *ml, disk_block_t super
       LogFS_HashSetRaw(&vd->parent, e.value.currentId);
       LogFS_HashSetRaw(&vd->entropy, e.value.entropy);
       vd->lsn = e.value.lsn;
+      vd->appliedLsn = e.value.lsn;
       LogFS_DiskMapInsert(vd);
 
       result = tree_iter_inc(&it, NULL);
@@ -50,6 +50,7 @@ typedef struct NodeInfo {
 
    List_Links dirtyList;
    List_Links waiters;
+   List_Links resumers;          /* optimistic readers waiting for node */
 } NodeInfo;
 
 typedef struct {
@@ -59,6 +60,9 @@ typedef struct {
    btree_t *tree;
    struct LogFS_MetaLog *ml;
    struct LogFS_PagedTreeCache* cache;
+
+   /* Odd while the tree is being changed, see LogFS_PagedTreeReadBegin() */
+   Atomic_uint32 seq;
 } TreeInfo;
 
 
@@ -90,6 +94,62 @@ VMK_ReturnStatus LogFS_PagedTreeSync(btree_t *t, struct LogFS_MetaLog *ml, List_
 
 VMK_ReturnStatus LogFS_PagedTreeRescan(struct LogFS_MetaLog *);
 
+/* Optimistic reads. Nodes are changed in place, so rather than excluding
+ * writers, a reader notes the tree's sequence number before looking
+ * anything up, and checks afterwards that it has not moved, retrying if it
+ * has. Writers make it odd for as long as they are changing nodes. A
+ * reader passes a LogFS_PagedTreeReader as the btree context, which means
+ * it cannot block: a node that is not in memory gets paged in, and is
+ * remembered so that the reader can be resumed when it arrives. Nodes
+ * read halfway through a change may point anywhere, so bad node numbers
+ * make such reads fail rather than panic. */
+
+#define LOGFS_PAGEDTREE_CANTBLOCK ((void *)1)
+
+typedef struct LogFS_PagedTreeReader {
+   NodeInfo *fault;
+} LogFS_PagedTreeReader;
+
+static inline uint32 LogFS_PagedTreeReadBegin(btree_t *t)
+{
+   TreeInfo *treeInfo = t->user_data;
+   uint32 seq = Atomic_Read(&treeInfo->seq);
+
+   CPU_MemBarrier();
+   return seq;
+}
+
+/* Must whatever was read since LogFS_PagedTreeReadBegin() returned SEQ be
+ * thrown away? */
+
+static inline Bool LogFS_PagedTreeReadRetry(btree_t *t, uint32 seq)
+{
+   TreeInfo *treeInfo = t->user_data;
+
+   CPU_MemBarrier();
+   return (seq & 1) || Atomic_Read(&treeInfo->seq) != seq;
+}
+
+static inline void LogFS_PagedTreeWriteBegin(btree_t *t)
+{
+   TreeInfo *treeInfo = t->user_data;
+
+   Atomic_Inc(&treeInfo->seq);
+   CPU_MemBarrier();
+}
+
+static inline void LogFS_PagedTreeWriteEnd(btree_t *t)
+{
+   TreeInfo *treeInfo = t->user_data;
+
+   CPU_MemBarrier();
+   Atomic_Inc(&treeInfo->seq);
+}
+
+void LogFS_PagedTreeReaderDone(LogFS_PagedTreeReader *reader);
+Bool LogFS_PagedTreeResumeOnFault(LogFS_PagedTreeReader *reader,
+                                  void (*resume)(void *), void *data);
+
 static inline void LogFS_PagedTreeChecksum(node_t *n)
 {
    const int hdr = 20 + sizeof(void *);
@@ -155,10 +155,13 @@ tree_result_t __rangemap_get(btree_t *tree, uint64_t block,
    btree_iter_t it;
 
    tree_result_t result = tree_lower_bound(tree, &it, (elem_t *) & r, context);
-   ASSERT(it.depth < TREE_MAX_DEPTH);
+   ASSERT(result == tree_result_node_fault || it.depth < TREE_MAX_DEPTH);
+
+   if (result == tree_result_found) {
+      result = tree_iter_read(&lb, &it, context);
+   }
 
    if (result == tree_result_found) {
-      tree_iter_read(&lb, &it, context);
       r2r(ret,&lb);
 
       uint64_t to = lb.to;
@@ -183,6 +186,68 @@ tree_result_t __rangemap_get(btree_t *tree, uint64_t block,
 
 }
 
+/* Look up [block, end[ in one descent, walking the leaves from there.
+ * RET gets the ranges and the holes between them in order, each starting
+ * where the previous one ends, with the version of its first block. Stops
+ * early after MAX ranges, or at a node that is not in memory. Returns the
+ * number of ranges found, and where the last one ends in *endsat. */
+
+int __rangemap_get_range(btree_t *tree, uint64_t block, uint64_t end,
+      range_t *ret, int max,
+      uint64_t *endsat, void *context)
+{
+   qprintf("%s\n", __FUNCTION__);
+   struct range r;
+   r.to = block + 1;
+
+   const uint64_t invalid = ~0ULL;
+
+   struct range lb;
+
+   btree_iter_t it;
+   int n = 0;
+
+   tree_result_t result = tree_lower_bound(tree, &it, (elem_t *) & r, context);
+   ASSERT(result == tree_result_node_fault || it.depth < TREE_MAX_DEPTH);
+
+   while (block < end && n < max && result != tree_result_node_fault) {
+
+      /* nothing more to the right */
+      if (result == tree_result_end) {
+         ret[n].from = block;
+         ret[n].version = invalid;
+         ++n;
+         block = end;
+         break;
+      }
+
+      if (tree_iter_read(&lb, &it, context) == tree_result_node_fault) {
+         break;
+      }
+
+      uint64_t from = lb.to - lb.length;
+      ret[n].from = block;
+
+      /* hole before the next range */
+      if (block < from) {
+         ret[n].version = invalid;
+         block = MIN(from, end);
+      } else {
+         ret[n].version = (lb.version == invalid) ? invalid :
+                          lb.version + (block - from);
+         block = MIN(lb.to, end);
+
+         if (block < end) {
+            result = tree_iter_inc(&it, context);
+         }
+      }
+      ++n;
+   }
+
+   *endsat = block;
+   return n;
+}
+
 uint64_t rangemap_get(btree_t *tree, uint64_t block,
                       uint64_t * endsat)
 {
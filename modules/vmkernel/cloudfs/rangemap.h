@@ -70,6 +70,9 @@ uint64_t rangemap_get(btree_t*, uint64_t, uint64_t *);
 tree_result_t __rangemap_get(btree_t *tree, uint64_t block,
       range_t *result,
       uint64_t * endsat, void *context);
+int __rangemap_get_range(btree_t *tree, uint64_t block, uint64_t end,
+      range_t *ret, int max,
+      uint64_t *endsat, void *context);
 void rangemap_replace(btree_t*, uint64_t, uint64_t, uint64_t,
                       uint64_t);
 int rangemap_check(btree_t*);
@@ -481,15 +481,19 @@ VMK_ReturnStatus LogFS_RemoteLogSpoolFromRevision(LogFS_RemoteLog *rl)
 
  andagain:
             sz = log_body_size(head);
-            take = LOG_HEAD_SIZE + sz;
-            char *headAndBody = aligned_malloc(LOG_HEAD_SIZE + sz);
-            char *body = headAndBody + LOG_HEAD_SIZE;
+            take = log_entry_size(head);
+            char *headAndBody = aligned_malloc(take);
+            char *body = headAndBody + log_entry_head_size(head);
             memcpy(headAndBody, head, LOG_HEAD_SIZE);
 
-            if (sz > 0) {
+            /* Read any overflow refs blocks along with the body */
+
+            if (take > LOG_HEAD_SIZE) {
                do {
                   status =
-                      LogFS_LogReadBody(log, NULL, body, sz, e + LOG_HEAD_SIZE);
+                      LogFS_LogReadBody(log, NULL, headAndBody + LOG_HEAD_SIZE,
+                                        take - LOG_HEAD_SIZE,
+                                        e + LOG_HEAD_SIZE);
                } while (status == VMK_BUSY
                         || status == VMK_STORAGE_RETRY_OPERATION);
 
@@ -504,7 +508,8 @@ VMK_ReturnStatus LogFS_RemoteLogSpoolFromRevision(LogFS_RemoteLog *rl)
             /* verify checksum before sending */
 
             unsigned char checksum[SHA1_DIGEST_SIZE];
-            log_entry_checksum(checksum, head, body, sz);
+            log_entry_checksum(checksum, (struct log_head *)headAndBody,
+                               body, sz);
 
             if (memcmp(checksum, head->update.checksum, SHA1_DIGEST_SIZE) != 0) {
                zprintf("chk prob\n");
@@ -544,7 +549,7 @@ VMK_ReturnStatus LogFS_RemoteLogSpoolFromRevision(LogFS_RemoteLog *rl)
                SP_Lock(&rl->lock);
                status =
                    LogFS_RemoteLogPushUpdateSimple(rl, headAndBody,
-                                             LOG_HEAD_SIZE + sz, token);
+                                             take, token);
                SP_Unlock(&rl->lock);
 
                if (status == VMK_WOULD_BLOCK) {
@@ -0,0 +1,193 @@
+/*
+Copyright (c) 2007-2011 VMware, Inc. All Rights Reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted (subject to the limitations in the
+disclaimer below) provided that the following conditions are met:
+
+* Redistributions of source code must retain the above copyright
+   notice, this list of conditions and the following disclaimer.
+
+* Redistributions in binary form must reproduce the above copyright
+   notice, this list of conditions and the following disclaimer in the
+   documentation and/or other materials provided with the
+   distribution.
+
+* Neither the name of VMware nor the names of its
+   contributors may be used to endorse or promote products derived
+   from this software without specific prior written permission.
+
+NO EXPRESS OR IMPLIED LICENSES TO ANY PARTY'S PATENT RIGHTS ARE
+GRANTED BY THIS LICENSE.  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT
+HOLDERS AND CONTRIBUTORS "AS IS" AND ANY EXPRESS OR IMPLIED
+WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF
+MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR
+BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE
+OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN
+IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "system.h"
+#include "crc32c.h"
+
+/* Reflected Castagnoli polynomial */
+#define CRC32C_POLY 0x82f63b78
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) \
+  && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define CRC32C_X86 1
+#else
+#define CRC32C_X86 0
+#endif
+
+typedef uint32_t crc32c_func(uint32_t crc, const uint8_t *data, size_t length);
+
+/*
+ * Software version, processing eight bytes per step with eight tables
+ * ("slicing-by-8"). The tables are built on first use.
+ */
+
+static uint32_t crc32cTable[8][256];
+
+static void
+crc32c_init_table(void)
+{
+   uint32_t i, j, crc;
+
+   for (i = 0; i < 256; i++) {
+      crc = i;
+      for (j = 0; j < 8; j++) {
+         crc = (crc >> 1) ^ (CRC32C_POLY & (0 - (crc & 1)));
+      }
+      crc32cTable[0][i] = crc;
+   }
+   for (i = 0; i < 256; i++) {
+      crc = crc32cTable[0][i];
+      for (j = 1; j < 8; j++) {
+         crc = crc32cTable[0][crc & 0xff] ^ (crc >> 8);
+         crc32cTable[j][i] = crc;
+      }
+   }
+}
+
+static uint32_t
+crc32c_sw(uint32_t crc, const uint8_t *data, size_t length)
+{
+   while (length > 0 && ((unsigned long)data & 7) != 0) {
+      crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+      length--;
+   }
+
+   while (length >= 8) {
+      /* Little-endian only, like the rest of the on-disk format */
+      uint64_t v = *(const uint64_t *)data ^ crc;
+
+      crc = crc32cTable[7][v & 0xff] ^
+            crc32cTable[6][(v >> 8) & 0xff] ^
+            crc32cTable[5][(v >> 16) & 0xff] ^
+            crc32cTable[4][(v >> 24) & 0xff] ^
+            crc32cTable[3][(v >> 32) & 0xff] ^
+            crc32cTable[2][(v >> 40) & 0xff] ^
+            crc32cTable[1][(v >> 48) & 0xff] ^
+            crc32cTable[0][v >> 56];
+      data += 8;
+      length -= 8;
+   }
+
+   while (length > 0) {
+      crc = crc32cTable[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+      length--;
+   }
+
+   return crc;
+}
+
+#if CRC32C_X86
+
+static uint32_t __attribute__((__target__("sse4.2")))
+crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length)
+{
+   while (length > 0 && ((unsigned long)data & 7) != 0) {
+      crc = __builtin_ia32_crc32qi(crc, *data++);
+      length--;
+   }
+
+#ifdef __x86_64__
+   {
+      uint64_t c = crc;
+      while (length >= 8) {
+         c = __builtin_ia32_crc32di(c, *(const uint64_t *)data);
+         data += 8;
+         length -= 8;
+      }
+      crc = c;
+   }
+#endif
+
+   while (length >= 4) {
+      crc = __builtin_ia32_crc32si(crc, *(const uint32_t *)data);
+      data += 4;
+      length -= 4;
+   }
+
+   while (length > 0) {
+      crc = __builtin_ia32_crc32qi(crc, *data++);
+      length--;
+   }
+
+   return crc;
+}
+
+static int
+crc32c_have_sse42(void)
+{
+   uint32_t a, b, c, d;
+
+   __asm__ ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "0" (1), "2" (0));
+   return (c & (1 << 20)) != 0;
+}
+
+#endif /* CRC32C_X86 */
+
+static crc32c_func *crc32cImpl = NULL;
+
+static void
+crc32c_select(void)
+{
+#if CRC32C_X86
+   if (crc32c_have_sse42()) {
+      crc32cImpl = crc32c_sse42;
+      return;
+   }
+#endif
+   crc32c_init_table();
+   crc32cImpl = crc32c_sw;
+}
+
+uint32_t
+crc32c(uint32_t crc, const uint8_t *data, size_t length)
+{
+   if (crc32cImpl == NULL) {
+      crc32c_select();
+   }
+   return ~crc32cImpl(~crc, data, length);
+}
+
+const char *
+crc32c_name(void)
+{
+   if (crc32cImpl == NULL) {
+      crc32c_select();
+   }
+#if CRC32C_X86
+   if (crc32cImpl == crc32c_sse42) {
+      return "sse4.2";
+   }
+#endif
+   return "table";
+}
@@ -36,6 +36,9 @@ extern "C" {
 #define sha1_init nettle_sha1_init
 #define sha1_update nettle_sha1_update
 #define sha1_digest nettle_sha1_digest
+#define sha1_select_compress nettle_sha1_select_compress
+#define sha1_compress_name nettle_sha1_compress_name
+#define sha1_multi_digest nettle_sha1_multi_digest
 #define sha256_init nettle_sha256_init
 #define sha256_update nettle_sha256_update
 #define sha256_digest nettle_sha256_digest
@@ -69,10 +72,42 @@ sha1_digest(struct sha1_ctx *ctx,
 	    unsigned length,
 	    uint8_t *digest);
 
+/* Number of messages sha1_multi_digest works on side by side. */
+#define SHA1_MULTI_LANES 8
+
+/* Hashes N independent messages of LENGTH bytes each, DATA[i] into
+   DIGESTS[i] (SHA1_DIGEST_SIZE bytes). Same results as running
+   sha1_init, sha1_update and sha1_digest on each of them, but faster
+   for short messages, as the work is spread over vector lanes. */
+void
+sha1_multi_digest(uint8_t **digests, const uint8_t **data,
+                  unsigned n, unsigned length);
+
 /* Internal compression function. STATE points to 5 uint32_t words,
-   and DATA points to 64 bytes of input data, possibly unaligned. */
+   and DATA points to 64 bytes of input data, possibly unaligned.
+
+   There is a portable C version and, on x86, versions using the SSSE3
+   and SHA extensions. _nettle_sha1_compress points to the best one the
+   CPU supports; it starts out as the C version and is switched over by
+   sha1_select_compress(), which sha1_init calls the first time
+   around. All versions produce identical digests. */
+typedef void
+_nettle_sha1_compress_func(uint32_t *state, const uint8_t *data);
+
+extern _nettle_sha1_compress_func *_nettle_sha1_compress;
+
+_nettle_sha1_compress_func _nettle_sha1_compress_c;
+_nettle_sha1_compress_func _nettle_sha1_compress_ssse3;
+_nettle_sha1_compress_func _nettle_sha1_compress_shani;
+
+/* Probes the CPU and points _nettle_sha1_compress at the fastest
+   implementation available. Safe to call more than once. */
 void
-_nettle_sha1_compress(uint32_t *state, const uint8_t *data);
+sha1_select_compress(void);
+
+/* Name of the selected implementation, for logging. */
+const char *
+sha1_compress_name(void);
 
 /* SHA256 */
 
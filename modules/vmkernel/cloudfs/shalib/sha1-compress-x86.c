@@ -0,0 +1,346 @@
+/* sha1-compress-x86.c
+ *
+ * x86 versions of the sha1 compression function, and the run time
+ * selection between those and the portable one in sha1-compress.c.
+ */
+
+/* nettle, low-level cryptographics library
+ *
+ * The nettle library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The nettle library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the nettle library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/* Two implementations live here:
+
+   _nettle_sha1_compress_shani uses the SHA extensions (sha1rnds4 and
+   friends), which do four rounds and the message schedule in
+   hardware.
+
+   _nettle_sha1_compress_ssse3 keeps the 80 rounds in scalar code but
+   computes the message schedule (byte swap, expansion and adding of
+   the round constants) four words at a time in xmm registers, which
+   takes the dependency chain of the expansion off the round path.
+
+   The intrinsics need per-function target attributes, which appeared
+   in gcc 4.9. Older compilers and non-x86 builds only get the portable
+   version. */
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "system.h"
+#include "sha.h"
+
+#include "macros.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) \
+  && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define SHA1_X86 1
+#else
+# define SHA1_X86 0
+#endif
+
+#if SHA1_X86
+
+#include <immintrin.h>
+
+#define K1  0x5A827999L                                 /* Rounds  0-19 */
+#define K2  0x6ED9EBA1L                                 /* Rounds 20-39 */
+#define K3  0x8F1BBCDCL                                 /* Rounds 40-59 */
+#define K4  0xCA62C1D6L                                 /* Rounds 60-79 */
+
+#define ROTL(n,X)  ( ( (X) << (n) ) | ( (X) >> ( 32 - (n) ) ) )
+
+#define f1(x,y,z)   ( z ^ ( x & ( y ^ z ) ) )           /* Rounds  0-19 */
+#define f2(x,y,z)   ( x ^ y ^ z )                       /* Rounds 20-39 */
+#define f3(x,y,z)   ( ( x & y ) | ( z & ( x | y ) ) )   /* Rounds 40-59 */
+#define f4(x,y,z)   ( x ^ y ^ z )                       /* Rounds 60-79 */
+
+/* Same sub-round as in sha1-compress.c, but with the round constant
+   already folded into the schedule word. */
+#define subRound(a, b, c, d, e, f, wk) \
+    ( e += ROTL( 5, a ) + f( b, c, d ) + wk, b = ROTL( 30, b ) )
+
+#define SSSE3_TARGET __attribute__((__target__("ssse3")))
+#define SHANI_TARGET __attribute__((__target__("sha,ssse3")))
+
+static inline __m128i SSSE3_TARGET
+rotl1_epi32(__m128i x)
+{
+  return _mm_or_si128(_mm_slli_epi32(x, 1), _mm_srli_epi32(x, 31));
+}
+
+static inline __m128i SSSE3_TARGET
+rotl2_epi32(__m128i x)
+{
+  return _mm_or_si128(_mm_slli_epi32(x, 2), _mm_srli_epi32(x, 30));
+}
+
+void SSSE3_TARGET
+_nettle_sha1_compress_ssse3(uint32_t *state, const uint8_t *input)
+{
+  const __m128i bswap = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11,
+                                     4, 5, 6, 7, 0, 1, 2, 3);
+  __m128i w[20];        /* W[0..79], four words per vector */
+  uint32_t wk[80];      /* W[i] + K for round i */
+  uint32_t A, B, C, D, E;
+  int i;
+
+  for (i = 0; i < 4; i++)
+    w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(input + 16 * i)),
+                            bswap);
+
+  /* W[i] = ROTL(1, W[i-3] ^ W[i-8] ^ W[i-14] ^ W[i-16]). The last lane
+     of each vector depends on the first one, so compute it with W[i-3]
+     taken as zero and patch it up afterwards. */
+  for (i = 4; i < 8; i++)
+    {
+      __m128i w3 = _mm_srli_si128(w[i - 1], 4);           /* W[i-3..i-1], 0 */
+      __m128i w14 = _mm_alignr_epi8(w[i - 3], w[i - 4], 8);
+      __m128i t = _mm_xor_si128(_mm_xor_si128(w3, w[i - 2]),
+                                _mm_xor_si128(w14, w[i - 4]));
+      __m128i r = rotl1_epi32(t);
+      __m128i fix = _mm_slli_si128(rotl2_epi32(t), 12);
+
+      w[i] = _mm_xor_si128(r, fix);
+    }
+
+  /* From W[32] on there is an equivalent recurrence without the
+     dependency between lanes:
+     W[i] = ROTL(2, W[i-6] ^ W[i-16] ^ W[i-28] ^ W[i-32]). */
+  for (i = 8; i < 20; i++)
+    {
+      __m128i w6 = _mm_alignr_epi8(w[i - 1], w[i - 2], 8);
+      __m128i t = _mm_xor_si128(_mm_xor_si128(w6, w[i - 4]),
+                                _mm_xor_si128(w[i - 7], w[i - 8]));
+      w[i] = rotl2_epi32(t);
+    }
+
+  for (i = 0; i < 20; i++)
+    {
+      uint32_t k = i < 5 ? K1 : i < 10 ? K2 : i < 15 ? K3 : K4;
+      _mm_storeu_si128((__m128i *)(wk + 4 * i),
+                       _mm_add_epi32(w[i], _mm_set1_epi32(k)));
+    }
+
+  A = state[0];
+  B = state[1];
+  C = state[2];
+  D = state[3];
+  E = state[4];
+
+  for (i = 0; i < 20; i += 5)
+    {
+      subRound( A, B, C, D, E, f1, wk[i + 0] );
+      subRound( E, A, B, C, D, f1, wk[i + 1] );
+      subRound( D, E, A, B, C, f1, wk[i + 2] );
+      subRound( C, D, E, A, B, f1, wk[i + 3] );
+      subRound( B, C, D, E, A, f1, wk[i + 4] );
+    }
+  for (; i < 40; i += 5)
+    {
+      subRound( A, B, C, D, E, f2, wk[i + 0] );
+      subRound( E, A, B, C, D, f2, wk[i + 1] );
+      subRound( D, E, A, B, C, f2, wk[i + 2] );
+      subRound( C, D, E, A, B, f2, wk[i + 3] );
+      subRound( B, C, D, E, A, f2, wk[i + 4] );
+    }
+  for (; i < 60; i += 5)
+    {
+      subRound( A, B, C, D, E, f3, wk[i + 0] );
+      subRound( E, A, B, C, D, f3, wk[i + 1] );
+      subRound( D, E, A, B, C, f3, wk[i + 2] );
+      subRound( C, D, E, A, B, f3, wk[i + 3] );
+      subRound( B, C, D, E, A, f3, wk[i + 4] );
+    }
+  for (; i < 80; i += 5)
+    {
+      subRound( A, B, C, D, E, f4, wk[i + 0] );
+      subRound( E, A, B, C, D, f4, wk[i + 1] );
+      subRound( D, E, A, B, C, f4, wk[i + 2] );
+      subRound( C, D, E, A, B, f4, wk[i + 3] );
+      subRound( B, C, D, E, A, f4, wk[i + 4] );
+    }
+
+  state[0] += A;
+  state[1] += B;
+  state[2] += C;
+  state[3] += D;
+  state[4] += E;
+}
+
+/* Four rounds of the SHA extensions. E0/E1 alternate as the register
+   carrying the E value, MSG0..MSG3 rotate as the schedule window. */
+#define SHANI_ROUNDS(f, e_in, e_out, m0, m1, m2, m3)            \
+  do {                                                          \
+    e_in = _mm_sha1nexte_epu32(e_in, m0);                       \
+    e_out = abcd;                                               \
+    m1 = _mm_sha1msg2_epu32(m1, m0);                            \
+    abcd = _mm_sha1rnds4_epu32(abcd, e_in, f);                  \
+    m3 = _mm_sha1msg1_epu32(m3, m0);                            \
+    m2 = _mm_xor_si128(m2, m0);                                 \
+  } while (0)
+
+void SHANI_TARGET
+_nettle_sha1_compress_shani(uint32_t *state, const uint8_t *input)
+{
+  const __m128i bswap = _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7,
+                                     8, 9, 10, 11, 12, 13, 14, 15);
+  __m128i abcd, abcd_save, e0, e0_save, e1;
+  __m128i msg0, msg1, msg2, msg3;
+
+  /* The instructions want A in the most significant lane. */
+  abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *)state), 0x1b);
+  e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+  abcd_save = abcd;
+  e0_save = e0;
+
+  msg0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(input + 0)), bswap);
+  msg1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(input + 16)), bswap);
+  msg2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(input + 32)), bswap);
+  msg3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *)(input + 48)), bswap);
+
+  /* Rounds 0-15 consume the message words directly. */
+  e0 = _mm_add_epi32(e0, msg0);
+  e1 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+
+  e1 = _mm_sha1nexte_epu32(e1, msg1);
+  e0 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+  msg0 = _mm_sha1msg1_epu32(msg0, msg1);
+
+  e0 = _mm_sha1nexte_epu32(e0, msg2);
+  e1 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e0, 0);
+  msg1 = _mm_sha1msg1_epu32(msg1, msg2);
+  msg0 = _mm_xor_si128(msg0, msg2);
+
+  e1 = _mm_sha1nexte_epu32(e1, msg3);
+  e0 = abcd;
+  msg0 = _mm_sha1msg2_epu32(msg0, msg3);
+  abcd = _mm_sha1rnds4_epu32(abcd, e1, 0);
+  msg2 = _mm_sha1msg1_epu32(msg2, msg3);
+  msg1 = _mm_xor_si128(msg1, msg3);
+
+  /* Rounds 16-67 run the schedule four words ahead. */
+  SHANI_ROUNDS(0, e0, e1, msg0, msg1, msg2, msg3);      /* 16-19 */
+  SHANI_ROUNDS(1, e1, e0, msg1, msg2, msg3, msg0);      /* 20-23 */
+  SHANI_ROUNDS(1, e0, e1, msg2, msg3, msg0, msg1);      /* 24-27 */
+  SHANI_ROUNDS(1, e1, e0, msg3, msg0, msg1, msg2);      /* 28-31 */
+  SHANI_ROUNDS(1, e0, e1, msg0, msg1, msg2, msg3);      /* 32-35 */
+  SHANI_ROUNDS(1, e1, e0, msg1, msg2, msg3, msg0);      /* 36-39 */
+  SHANI_ROUNDS(2, e0, e1, msg2, msg3, msg0, msg1);      /* 40-43 */
+  SHANI_ROUNDS(2, e1, e0, msg3, msg0, msg1, msg2);      /* 44-47 */
+  SHANI_ROUNDS(2, e0, e1, msg0, msg1, msg2, msg3);      /* 48-51 */
+  SHANI_ROUNDS(2, e1, e0, msg1, msg2, msg3, msg0);      /* 52-55 */
+  SHANI_ROUNDS(2, e0, e1, msg2, msg3, msg0, msg1);      /* 56-59 */
+  SHANI_ROUNDS(3, e1, e0, msg3, msg0, msg1, msg2);      /* 60-63 */
+  SHANI_ROUNDS(3, e0, e1, msg0, msg1, msg2, msg3);      /* 64-67 */
+
+  /* Rounds 68-79 drain the remaining schedule words. */
+  e1 = _mm_sha1nexte_epu32(e1, msg1);
+  e0 = abcd;
+  msg2 = _mm_sha1msg2_epu32(msg2, msg1);
+  abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+  msg3 = _mm_xor_si128(msg3, msg1);
+
+  e0 = _mm_sha1nexte_epu32(e0, msg2);
+  e1 = abcd;
+  msg3 = _mm_sha1msg2_epu32(msg3, msg2);
+  abcd = _mm_sha1rnds4_epu32(abcd, e0, 3);
+
+  e1 = _mm_sha1nexte_epu32(e1, msg3);
+  e0 = abcd;
+  abcd = _mm_sha1rnds4_epu32(abcd, e1, 3);
+
+  e0 = _mm_sha1nexte_epu32(e0, e0_save);
+  abcd = _mm_add_epi32(abcd, abcd_save);
+
+  _mm_storeu_si128((__m128i *)state, _mm_shuffle_epi32(abcd, 0x1b));
+  state[4] = _mm_extract_epi16(e0, 7) << 16 | _mm_extract_epi16(e0, 6);
+}
+
+static void
+sha1_cpuid(uint32_t leaf, uint32_t subleaf,
+           uint32_t *a, uint32_t *b, uint32_t *c, uint32_t *d)
+{
+#if defined(__i386__) && defined(__PIC__)
+  /* ebx is the PIC register on i386 and can't be clobbered. */
+  __asm__ ("xchgl %%ebx, %1\n\t"
+           "cpuid\n\t"
+           "xchgl %%ebx, %1"
+           : "=a" (*a), "=&r" (*b), "=c" (*c), "=d" (*d)
+           : "0" (leaf), "2" (subleaf));
+#else
+  __asm__ ("cpuid"
+           : "=a" (*a), "=b" (*b), "=c" (*c), "=d" (*d)
+           : "0" (leaf), "2" (subleaf));
+#endif
+}
+
+#define CPUID1_ECX_SSSE3   (1 << 9)
+#define CPUID7_EBX_SHA     (1 << 29)
+
+#else /* !SHA1_X86 */
+
+void
+_nettle_sha1_compress_ssse3(uint32_t *state, const uint8_t *input)
+{
+  _nettle_sha1_compress_c(state, input);
+}
+
+void
+_nettle_sha1_compress_shani(uint32_t *state, const uint8_t *input)
+{
+  _nettle_sha1_compress_c(state, input);
+}
+
+#endif /* !SHA1_X86 */
+
+void
+sha1_select_compress(void)
+{
+#if SHA1_X86
+  uint32_t max, a, b, c, d;
+  uint32_t ecx1 = 0, ebx7 = 0;
+
+  sha1_cpuid(0, 0, &max, &b, &c, &d);
+  if (max >= 1)
+    sha1_cpuid(1, 0, &a, &b, &ecx1, &d);
+  if (max >= 7)
+    sha1_cpuid(7, 0, &a, &ebx7, &c, &d);
+
+  if ((ebx7 & CPUID7_EBX_SHA) && (ecx1 & CPUID1_ECX_SSSE3))
+    _nettle_sha1_compress = _nettle_sha1_compress_shani;
+  else if (ecx1 & CPUID1_ECX_SSSE3)
+    _nettle_sha1_compress = _nettle_sha1_compress_ssse3;
+  else
+#endif
+    _nettle_sha1_compress = _nettle_sha1_compress_c;
+}
+
+const char *
+sha1_compress_name(void)
+{
+  if (_nettle_sha1_compress == _nettle_sha1_compress_shani)
+    return "sha-ni";
+  else if (_nettle_sha1_compress == _nettle_sha1_compress_ssse3)
+    return "ssse3";
+  else
+    return "c";
+}
@@ -122,7 +122,7 @@
    sections, e.g. based on the four subrounds. */
 
 void
-_nettle_sha1_compress(uint32_t *state, const uint8_t *input)
+_nettle_sha1_compress_c(uint32_t *state, const uint8_t *input)
 {
   uint32_t data[16];
   uint32_t A, B, C, D, E;     /* Local vars */
@@ -0,0 +1,281 @@
+/* sha1-multi.c
+ *
+ * Hashing of many independent, equally long messages at once.
+ */
+
+/* nettle, low-level cryptographics library
+ *
+ * The nettle library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The nettle library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the nettle library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+/* A single SHA-1 stream is one long dependency chain, so hashing a
+   short message leaves most of the CPU idle. Here up to
+   SHA1_MULTI_LANES messages are hashed side by side, one per 32-bit
+   lane of a vector, so that each instruction advances all of them.
+
+   The lane code is written with gcc vector extensions and compiled
+   twice, once for the baseline instruction set (two xmm registers per
+   vector) and once for AVX2 (one ymm register), and the right one is
+   picked at run time. On CPUs with the SHA extensions a single stream
+   is already faster than the lanes, so then the messages are simply
+   hashed one after the other with the regular code. */
+
+#if HAVE_CONFIG_H
+# include "config.h"
+#endif
+
+#include "system.h"
+#include "sha.h"
+
+#include "macros.h"
+
+#if defined(__GNUC__) && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+# define SHA1_MULTI_VECTOR 1
+#else
+# define SHA1_MULTI_VECTOR 0
+#endif
+
+#if SHA1_MULTI_VECTOR
+
+typedef uint32_t lanes_t
+  __attribute__((__vector_size__(4 * SHA1_MULTI_LANES)));
+
+#define K1  0x5A827999L                                 /* Rounds  0-19 */
+#define K2  0x6ED9EBA1L                                 /* Rounds 20-39 */
+#define K3  0x8F1BBCDCL                                 /* Rounds 40-59 */
+#define K4  0xCA62C1D6L                                 /* Rounds 60-79 */
+
+#define ROTL(n,X)  ( ( (X) << (n) ) | ( (X) >> ( 32 - (n) ) ) )
+
+#define f1(x,y,z)   ( z ^ ( x & ( y ^ z ) ) )           /* Rounds  0-19 */
+#define f2(x,y,z)   ( x ^ y ^ z )                       /* Rounds 20-39 */
+#define f3(x,y,z)   ( ( x & y ) | ( z & ( x | y ) ) )   /* Rounds 40-59 */
+#define f4(x,y,z)   ( x ^ y ^ z )                       /* Rounds 60-79 */
+
+#define expand(W,i) ( W[ (i) & 15 ] = \
+		      ROTL( 1, ( W[ (i) & 15 ] ^ W[ ((i) - 14) & 15 ] ^ \
+				 W[ ((i) - 8) & 15 ] ^ W[ ((i) - 3) & 15 ] ) ) )
+
+#define subRound(a, b, c, d, e, f, k, data) \
+    ( e += ROTL( 5, a ) + f( b, c, d ) + k + data, b = ROTL( 30, b ) )
+
+#define ROUNDS5(f, k, i, W)                                     \
+  do {                                                          \
+    subRound( A, B, C, D, E, f, k, expand( W, i + 0 ) );        \
+    subRound( E, A, B, C, D, f, k, expand( W, i + 1 ) );        \
+    subRound( D, E, A, B, C, f, k, expand( W, i + 2 ) );        \
+    subRound( C, D, E, A, B, f, k, expand( W, i + 3 ) );        \
+    subRound( B, C, D, E, A, f, k, expand( W, i + 4 ) );        \
+  } while (0)
+
+/* Compresses one 64-byte block of every lane. BLOCKS[j] points to the
+   block of lane j; lanes past N are fed a copy of lane 0. */
+static inline void __attribute__((__always_inline__))
+sha1_lanes_compress(lanes_t *state, const uint8_t **blocks, unsigned n)
+{
+  lanes_t A, B, C, D, E, W[16];
+  int i;
+  unsigned j;
+
+  for (i = 0; i < 16; i++)
+    for (j = 0; j < SHA1_MULTI_LANES; j++)
+      W[i][j] = READ_UINT32(blocks[j < n ? j : 0] + 4 * i);
+
+  A = state[0];
+  B = state[1];
+  C = state[2];
+  D = state[3];
+  E = state[4];
+
+  subRound( A, B, C, D, E, f1, K1, W[ 0] );
+  subRound( E, A, B, C, D, f1, K1, W[ 1] );
+  subRound( D, E, A, B, C, f1, K1, W[ 2] );
+  subRound( C, D, E, A, B, f1, K1, W[ 3] );
+  subRound( B, C, D, E, A, f1, K1, W[ 4] );
+  subRound( A, B, C, D, E, f1, K1, W[ 5] );
+  subRound( E, A, B, C, D, f1, K1, W[ 6] );
+  subRound( D, E, A, B, C, f1, K1, W[ 7] );
+  subRound( C, D, E, A, B, f1, K1, W[ 8] );
+  subRound( B, C, D, E, A, f1, K1, W[ 9] );
+  subRound( A, B, C, D, E, f1, K1, W[10] );
+  subRound( E, A, B, C, D, f1, K1, W[11] );
+  subRound( D, E, A, B, C, f1, K1, W[12] );
+  subRound( C, D, E, A, B, f1, K1, W[13] );
+  subRound( B, C, D, E, A, f1, K1, W[14] );
+  subRound( A, B, C, D, E, f1, K1, W[15] );
+  subRound( E, A, B, C, D, f1, K1, expand( W, 16 ) );
+  subRound( D, E, A, B, C, f1, K1, expand( W, 17 ) );
+  subRound( C, D, E, A, B, f1, K1, expand( W, 18 ) );
+  subRound( B, C, D, E, A, f1, K1, expand( W, 19 ) );
+
+  for (i = 20; i < 40; i += 5)
+    ROUNDS5(f2, K2, i, W);
+  for (; i < 60; i += 5)
+    ROUNDS5(f3, K3, i, W);
+  for (; i < 80; i += 5)
+    ROUNDS5(f4, K4, i, W);
+
+  state[0] += A;
+  state[1] += B;
+  state[2] += C;
+  state[3] += D;
+  state[4] += E;
+}
+
+/* Hashes up to SHA1_MULTI_LANES messages of LENGTH bytes each. */
+static inline void __attribute__((__always_inline__))
+sha1_lanes_digest(unsigned n, unsigned length,
+                  const uint8_t **data, uint8_t **digests)
+{
+  /* Room for the tail of each message plus padding, at most two
+     blocks. */
+  uint8_t tail[SHA1_MULTI_LANES][2 * SHA1_DATA_SIZE];
+  const uint8_t *blocks[SHA1_MULTI_LANES];
+  lanes_t state[_SHA1_DIGEST_LENGTH];
+  unsigned full = length / SHA1_DATA_SIZE;
+  unsigned left = length % SHA1_DATA_SIZE;
+  unsigned padded = left + 9 > SHA1_DATA_SIZE ? 2 : 1;
+  uint64_t bits = (uint64_t) length << 3;
+  unsigned i, j;
+
+  for (j = 0; j < SHA1_MULTI_LANES; j++)
+    {
+      state[0][j] = 0x67452301L;
+      state[1][j] = 0xEFCDAB89L;
+      state[2][j] = 0x98BADCFEL;
+      state[3][j] = 0x10325476L;
+      state[4][j] = 0xC3D2E1F0L;
+    }
+
+  for (i = 0; i < full; i++)
+    {
+      for (j = 0; j < n; j++)
+        blocks[j] = data[j] + i * SHA1_DATA_SIZE;
+      sha1_lanes_compress(state, blocks, n);
+    }
+
+  for (j = 0; j < n; j++)
+    {
+      uint8_t *t = tail[j];
+      unsigned end = padded * SHA1_DATA_SIZE;
+
+      memcpy(t, data[j] + full * SHA1_DATA_SIZE, left);
+      t[left] = 0x80;
+      memset(t + left + 1, 0, end - 8 - left - 1);
+      WRITE_UINT32(t + end - 8, (uint32_t) (bits >> 32));
+      WRITE_UINT32(t + end - 4, (uint32_t) bits);
+    }
+
+  for (i = 0; i < padded; i++)
+    {
+      for (j = 0; j < n; j++)
+        blocks[j] = tail[j] + i * SHA1_DATA_SIZE;
+      sha1_lanes_compress(state, blocks, n);
+    }
+
+  for (j = 0; j < n; j++)
+    for (i = 0; i < _SHA1_DIGEST_LENGTH; i++)
+      WRITE_UINT32(digests[j] + 4 * i, state[i][j]);
+}
+
+static void
+sha1_lanes_digest_generic(unsigned n, unsigned length,
+                          const uint8_t **data, uint8_t **digests)
+{
+  sha1_lanes_digest(n, length, data, digests);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+static void __attribute__((__target__("avx2")))
+sha1_lanes_digest_avx2(unsigned n, unsigned length,
+                       const uint8_t **data, uint8_t **digests)
+{
+  sha1_lanes_digest(n, length, data, digests);
+}
+
+static int
+sha1_have_avx2(void)
+{
+  uint32_t a, b, c, d;
+  uint64_t xcr0;
+
+  __asm__ ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "0" (0), "2" (0));
+  if (a < 7)
+    return 0;
+
+  /* The OS has to save the ymm state for us. */
+  __asm__ ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "0" (1), "2" (0));
+  if (!(c & (1 << 27)))
+    return 0;
+  __asm__ ("xgetbv" : "=a" (a), "=d" (d) : "c" (0));
+  xcr0 = ((uint64_t) d << 32) | a;
+  if ((xcr0 & 6) != 6)
+    return 0;
+
+  __asm__ ("cpuid" : "=a" (a), "=b" (b), "=c" (c), "=d" (d) : "0" (7), "2" (0));
+  return (b & (1 << 5)) != 0;
+}
+
+#endif
+
+typedef void
+sha1_lanes_func(unsigned n, unsigned length,
+                const uint8_t **data, uint8_t **digests);
+
+static sha1_lanes_func *
+sha1_lanes_select(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+  if (sha1_have_avx2())
+    return sha1_lanes_digest_avx2;
+#endif
+  return sha1_lanes_digest_generic;
+}
+
+#endif /* SHA1_MULTI_VECTOR */
+
+void
+sha1_multi_digest(uint8_t **digests, const uint8_t **data,
+                  unsigned n, unsigned length)
+{
+  unsigned i = 0;
+
+#if SHA1_MULTI_VECTOR
+  static sha1_lanes_func *lanes = NULL;
+
+  if (lanes == NULL)
+    lanes = sha1_lanes_select();
+
+  if (_nettle_sha1_compress != _nettle_sha1_compress_shani)
+    {
+      for (; i + 1 < n; i += SHA1_MULTI_LANES)
+        {
+          unsigned m = n - i < SHA1_MULTI_LANES ? n - i : SHA1_MULTI_LANES;
+          lanes(m, length, data + i, digests + i);
+        }
+    }
+#endif
+
+  /* Stragglers, or everything if there is no point in using lanes. */
+  for (; i < n; i++)
+    {
+      struct sha1_ctx ctx;
+      sha1_init(&ctx);
+      sha1_update(&ctx, length, data[i]);
+      sha1_digest(&ctx, SHA1_DIGEST_SIZE, digests[i]);
+    }
+}
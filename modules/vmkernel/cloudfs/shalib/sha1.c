@@ -57,11 +57,22 @@
 #define h3init  0x10325476L
 #define h4init  0xC3D2E1F0L
 
+/* The compression function in use, see sha1_select_compress() in
+   sha1-compress-x86.c. */
+_nettle_sha1_compress_func *_nettle_sha1_compress = _nettle_sha1_compress_c;
+static int sha1_compress_selected = 0;
+
 /* Initialize the SHA values */
 
 void
 sha1_init(struct sha1_ctx *ctx)
 {
+  if (!sha1_compress_selected)
+    {
+      sha1_select_compress();
+      sha1_compress_selected = 1;
+    }
+
   /* Set the h-vars to their initial values */
   ctx->digest[ 0 ] = h0init;
   ctx->digest[ 1 ] = h1init;
@@ -0,0 +1,160 @@
+/* sha1bench.c
+ *
+ * Measures throughput of the available sha1 compression functions, and
+ * of sha1_multi_digest, on blocks of 512 bytes (the unit the log
+ * fingerprints), 4KB and 32KB, and checks that they all agree with the
+ * portable version.
+ *
+ * Usage: sha1bench [megabytes]
+ */
+
+/* nettle, low-level cryptographics library
+ *
+ * The nettle library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or (at your
+ * option) any later version.
+ *
+ * The nettle library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU Lesser General Public
+ * License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with the nettle library; see the file COPYING.LIB.  If not, write to
+ * the Free Software Foundation, Inc., 59 Temple Place - Suite 330, Boston,
+ * MA 02111-1307, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "system.h"
+#include "sha.h"
+
+#define BENCH_MIN_BLOCK 512
+#define BENCH_BUFFER (1 << 20)
+
+static const size_t block_sizes[] = { 512, 4096, 32768 };
+
+static double
+now(void)
+{
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+hash_blocks(const uint8_t *buf, size_t length, size_t block,
+            uint8_t *digests)
+{
+  size_t i;
+  for (i = 0; i < length; i += block, digests += SHA1_DIGEST_SIZE)
+    {
+      struct sha1_ctx ctx;
+      sha1_init(&ctx);
+      sha1_update(&ctx, block, buf + i);
+      sha1_digest(&ctx, SHA1_DIGEST_SIZE, digests);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+  static const struct
+  {
+    const char *name;
+    _nettle_sha1_compress_func *f;
+  } impls[] = {
+    { "c", _nettle_sha1_compress_c },
+    { "ssse3", _nettle_sha1_compress_ssse3 },
+    { "sha-ni", _nettle_sha1_compress_shani },
+  };
+  static const uint8_t *data[BENCH_BUFFER / BENCH_MIN_BLOCK];
+  static uint8_t *digests[BENCH_BUFFER / BENCH_MIN_BLOCK];
+  unsigned megabytes = argc > 1 ? atoi(argv[1]) : 256;
+  uint8_t *buf = malloc(BENCH_BUFFER);
+  uint8_t *ref = malloc(BENCH_BUFFER / BENCH_MIN_BLOCK * SHA1_DIGEST_SIZE);
+  uint8_t *out = malloc(BENCH_BUFFER / BENCH_MIN_BLOCK * SHA1_DIGEST_SIZE);
+  unsigned i, j, k, selected = 0;
+  int status = 0;
+
+  for (i = 0; i < BENCH_BUFFER; i++)
+    buf[i] = rand();
+
+  /* Pull in the selection done by sha1_init before overriding it. */
+  hash_blocks(buf, BENCH_BUFFER, BENCH_MIN_BLOCK, ref);
+  printf("selected: %s\n", sha1_compress_name());
+
+  /* impls[] is ordered so that the CPU supports everything up to and
+     including the selected version. */
+  for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+    if (impls[i].f == _nettle_sha1_compress)
+      selected = i;
+
+  for (k = 0; k < sizeof(block_sizes) / sizeof(block_sizes[0]); k++)
+    {
+      size_t block = block_sizes[k];
+      size_t nblocks = BENCH_BUFFER / block;
+      double t;
+
+      printf("%zu-byte blocks:\n", block);
+
+      _nettle_sha1_compress = _nettle_sha1_compress_c;
+      hash_blocks(buf, BENCH_BUFFER, block, ref);
+
+      for (i = 0; i < sizeof(impls) / sizeof(impls[0]); i++)
+        {
+          if (i > selected)
+            {
+              printf("  %-8s not available\n", impls[i].name);
+              continue;
+            }
+
+          _nettle_sha1_compress = impls[i].f;
+          hash_blocks(buf, BENCH_BUFFER, block, out);
+          if (memcmp(out, ref, nblocks * SHA1_DIGEST_SIZE) != 0)
+            {
+              printf("  %-8s DIGEST MISMATCH\n", impls[i].name);
+              status = 1;
+              continue;
+            }
+
+          t = now();
+          for (j = 0; j < megabytes; j++)
+            hash_blocks(buf, BENCH_BUFFER, block, out);
+          t = now() - t;
+
+          printf("  %-8s %8.1f MB/s\n", impls[i].name, megabytes / t);
+        }
+
+      _nettle_sha1_compress = impls[selected].f;
+      for (i = 0; i < nblocks; i++)
+        {
+          data[i] = buf + i * block;
+          digests[i] = out + i * SHA1_DIGEST_SIZE;
+        }
+
+      sha1_multi_digest(digests, data, nblocks, block);
+      if (memcmp(out, ref, nblocks * SHA1_DIGEST_SIZE) != 0)
+        {
+          printf("  multi    DIGEST MISMATCH\n");
+          status = 1;
+          continue;
+        }
+
+      t = now();
+      for (j = 0; j < megabytes; j++)
+        sha1_multi_digest(digests, data, nblocks, block);
+      t = now() - t;
+
+      printf("  multi    %8.1f MB/s\n", megabytes / t);
+    }
+
+  free(buf);
+  free(ref);
+  free(out);
+  return status;
+}
@@ -42,9 +42,8 @@ IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 int main(int argc, char **argv)
 {
 
-   char *entry = malloc(LOG_HEAD_SIZE + LOG_HEAD_MAX_BLOCKS * BLKSIZE);
+   char *entry = malloc(LOG_MAX_ENTRY_SIZE);
    struct log_head *head = (struct log_head *)entry;
-   char *body = entry + BLKSIZE;
 
    int f = open(argv[1], O_RDONLY);
    int g = -1;
@@ -74,8 +73,16 @@ int main(int argc, char **argv)
       int r = pread(f, head, LOG_HEAD_SIZE, e);
       if (r <= 0)
          break;
-      if (log_body_size(head) > 0) {
-         r = pread(f, body, log_body_size(head), e + LOG_HEAD_SIZE);
+      if (head->tag == log_entry_type && !log_entry_extent_valid(head)) {
+         printf("%05d bad extent %lld+%d\n", line, head->update.blkno,
+                head->update.num_blocks);
+         break;
+      }
+
+      /* Overflow refs blocks and body */
+      if (log_entry_size(head) > LOG_HEAD_SIZE) {
+         r = pread(f, entry + LOG_HEAD_SIZE, log_entry_size(head) - LOG_HEAD_SIZE,
+                   e + LOG_HEAD_SIZE);
          if (r <= 0)
             break;
       }
@@ -88,15 +95,20 @@ int main(int argc, char **argv)
       printf("%lld+%d : %s\n", head->update.blkno, head->update.num_blocks,
              s_id);
 
-      log_entry_checksum(checksum, head, ((char *)head) + BLKSIZE,
-                         log_body_size(head));
+      if (head->tag == log_entry_type && !log_entry_checksum_supported(head)) {
+         printf("unsupported entry version %d checksum %d\n",
+                head->update.version, head->update.checksum_type);
+      } else if (head->tag == log_entry_type) {
+         log_entry_checksum(checksum, head,
+                            ((char *)head) + log_entry_head_size(head),
+                            log_body_size(head));
 
-      if (head->tag == log_entry_type) {
          if (memcmp(checksum, head->update.checksum, SHA1_DIGEST_SIZE) != 0) {
             Hash a, b;
             LogFS_HashSetRaw(&a, checksum);
             LogFS_HashSetRaw(&b, head->update.checksum);
-            printf("bad checksum %s vs %s\n",
+            printf("bad %s checksum %s vs %s\n",
+                   log_checksum_name(head->update.checksum_type),
                    LogFS_HashShow(&a), LogFS_HashShow(&b));
             //exit(1);
          }
@@ -66,6 +66,7 @@ typedef struct {
 static void
 LogFS_VDiskCommonInit(LogFS_VDisk *vd, LogFS_VDisk *parentDisk, Hash disk,
                       LogFS_MetaLog *log);
+static Bool LogFS_VDiskIsCurrentLocked(LogFS_VDisk *vd);
 
 /* vd->lock must be held */
 static inline LogFS_BTreeRangeMap *LogFS_VDiskGetVersionsMapLocked(LogFS_VDisk *vd)
@@ -116,6 +117,9 @@ Hash LogFS_VDiskGetParentDiskId(void *vd)
    return ((LogFS_VDisk *)vd)->parentBaseId;
 }
 
+static void LogFS_VDiskReadAheadInvalidate(LogFS_VDisk *vd, log_block_t from,
+                                           log_block_t to);
+
 static void LogFS_VDiskDeref(LogFS_VDisk *vd)
 {
    SP_Lock(&vd->lock);
@@ -127,6 +131,7 @@ static void LogFS_VDiskDeref(LogFS_VDisk *vd)
 
 typedef struct {
    LogFS_RefCountedBuffer *headBuffer;
+   LogFS_RefCountedBuffer *bodyBuffer;
    LogFS_RemoteLog *rl;
 } LogFS_VDiskNetSendContext;
 
@@ -141,6 +146,9 @@ void LogFS_VDiskSendDone(Async_Token * token, void *data)
    }
 
    LogFS_RefCountedBufferRelease(c->headBuffer);
+   if (c->bodyBuffer != NULL) {
+      LogFS_RefCountedBufferRelease(c->bodyBuffer);
+   }
 
 #ifdef SYNCMODE
    Async_TokenCallback(token);
@@ -181,8 +189,10 @@ void LogFS_VDiskWriteDone(Async_Token * token, void *data)
    SP_Lock(&vd->lock);
 
    int i;
+   log_ref_t *refs = log_entry_refs(head);
 
-   ++(v.v.blk_offset); /* skip over head */
+   /* skip over head and any overflow refs */
+   v.v.blk_offset += log_entry_head_size(head) / BLKSIZE;
 
    log_id_t *vs[] = {&inv,&v};
    log_block_t begin;
@@ -190,9 +200,9 @@ void LogFS_VDiskWriteDone(Async_Token * token, void *data)
    for (i=1, begin=0 ; ; i++) {
 
       Bool stop = (i == head->update.num_blocks);
-      int prev = BitTest(head->update.refs,i-1);
+      int prev = BitTest(refs,i-1);
 
-      if (stop || prev != BitTest(head->update.refs,i)) {
+      if (stop || prev != BitTest(refs,i)) {
 
          LogFS_BTreeRangeMapInsert(vd->bt,
                head->update.lsn,
@@ -211,6 +221,9 @@ void LogFS_VDiskWriteDone(Async_Token * token, void *data)
       }
 
    }
+   LogFS_VDiskReadAheadInvalidate(vd, head->update.blkno,
+         head->update.blkno + head->update.num_blocks);
+   vd->appliedLsn = MAX(vd->appliedLsn, head->update.lsn);
    SP_Unlock(&vd->lock);
 
    LogFS_RefCountedBufferRelease(c->headBuffer);
@@ -233,39 +246,69 @@ typedef struct {
    List_Links next;
 } LogFS_VDiskIoContext;
 
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LogFS_VDiskContinueWriteSg --
+ *
+ *      Append NUM_BLOCKS blocks to the vdisk log, taking the data from the
+ *      virtually addressed SRC, where every element holds whole blocks. The
+ *      log entries point straight into SRC, so it must stay valid until
+ *      TOKEN completes.
+ *
+ * Results:
+ *      VMK_OK, or append error.
+ *
+ * Side effects:
+ *      None.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
 VMK_ReturnStatus
-LogFS_VDiskContinueWrite(LogFS_VDisk *vd,
-                         Async_Token * token,
-                         const char *buf,
-                         log_block_t blkno, size_t num_blocks, int flags)
+LogFS_VDiskContinueWriteSg(LogFS_VDisk *vd,
+                           Async_Token * token,
+                           const SG_Array *src,
+                           log_block_t blkno, size_t num_blocks, int flags)
 {
    VMK_ReturnStatus status = VMK_OK;
    struct sha1_ctx ctx;
+   log_checksum_ctx sum;
 
    int blocks_left;
    int take;
 
+   /* Where in SRC the next block comes from */
+   int elem = 0;
+   uint32 elemOffset = 0;
+
    Async_IOHandle *ioh;
 
+   ASSERT(src->addrType == SG_VIRT_ADDR);
+
    SP_Lock(&vd->lock);
 
    ASSERT(LogFS_VDiskIsWritable(vd));
 
    Async_StartSplitIO(token, Async_DefaultChildDoneFn, 0, &ioh);
-   const int sgMax = 1024;
 
    for (blocks_left = num_blocks; blocks_left > 0; blocks_left -= take) {
 
-      take = MIN(blocks_left, LOG_HEAD_MAX_BLOCKS);
+      take = MIN(blocks_left, LOG_ENTRY_MAX_BLOCKS);
+
+      /* A new SG element is needed for every run of non-zero blocks, and
+       * wherever SRC is split */
+      const int sgMax = 1 + take;
 
       SG_Array *sgArr = SG_Alloc(LogFS_GetHeap(), sgMax);
       sgArr->addrType = SG_VIRT_ADDR;
 
-      struct log_head *head = aligned_malloc(LOG_HEAD_SIZE);
-      LogFS_RefCountedBuffer *headBuffer = 
-         LogFS_RefCountedBufferCreate(head,LOG_HEAD_SIZE);
+      /* Room for the overflow refs blocks of a large entry */
+      const size_t headMax = LOG_HEAD_SIZE * (1 + LOG_MAX_REFS_BLOCKS);
+
+      struct log_head *head = aligned_malloc(headMax);
 
-      memset(head, 0, LOG_HEAD_SIZE);
+      memset(head, 0, headMax);
       head->tag = log_entry_type;
       head->update.lsn = ++( vd->lsn );
       head->update.blkno = blkno;
@@ -291,13 +334,15 @@ LogFS_VDiskContinueWrite(LogFS_VDisk *vd,
        * for compressing away any zero blocks, but we do that last
        * to avoid looping over the block data twice. */
 
-      sha1_init(&ctx);
-      uint64 b = blkno;
-      uint16 n = num_blocks;
-      uint64 l = head->update.lsn;
-      sha1_update(&ctx, sizeof(l), (const uint8_t *)&l);
-      sha1_update(&ctx, sizeof(b), (const uint8_t *)&b);
-      sha1_update(&ctx, sizeof(n), (const uint8_t *)&n);
+      head->update.version = LOG_ENTRY_VERSION;
+      head->update.checksum_type = vd->log->checksumType;
+      log_entry_checksum_begin(&sum, head);
+
+      const size_t headSize = log_entry_head_size(head);
+      log_ref_t *refs = log_entry_refs(head);
+
+      LogFS_RefCountedBuffer *headBuffer = 
+         LogFS_RefCountedBufferCreate(head, headSize);
 
       /* We only store non-zero blocks in the log, and represent zero blocks
        * as unset bits in the log header bit vector. If we could store a 'is
@@ -314,7 +359,7 @@ LogFS_VDiskContinueWrite(LogFS_VDisk *vd,
 
       sgArr->sg[0].addr = (uint64) head;
       sgArr->sg[0].offset = 0;
-      sgArr->sg[0].length = LOG_HEAD_SIZE;
+      sgArr->sg[0].length = headSize;
       sgArr->length = 1;
 
       /* Then loop over the blocks and create SG entries that point to the
@@ -322,53 +367,101 @@ LogFS_VDiskContinueWrite(LogFS_VDisk *vd,
        * the log header. We do not yet know where on the disk the log entry
        * will get written, so we always start from zero. */
 
-      int mode = 0;
-      uint64 offset = LOG_HEAD_SIZE;
+      uint64 offset = headSize;
+      int n;
+
+      /* First find the non-zero blocks. The data comes from as many pieces
+       * of SRC as it spans. */
+
+      int e = elem;
+      uint32 eo = elemOffset;
+
+      for (i = 0; i < take; i += n) {
+         const char *piece = (const char *)src->sg[e].addr + eo;
+         uint64 bits;
+         int k;
+
+         n = MIN(take - i, (src->sg[e].length - eo) / BLKSIZE);
+         n = MIN(n, 64);
+         ASSERT(n > 0);
 
-      for (i=0, j=0 ; i < take; i++) {
-         char *blkdata = (char *)buf + i * BLKSIZE;
+         if (LogFS_ClassifyBlocks(piece, n, &bits) > 0) {
+            for (k = 0; k < n; k++) {
+               if (BitTest(&bits, k)) {
+                  BitSet(refs, i + k);
+               }
+            }
+         }
+
+         eo += n * BLKSIZE;
+         if (eo == src->sg[e].length) {
+            ++e;
+            eo = 0;
+         }
+      }
 
-         if (!is_block_zero(blkdata)) {
+      /* Then point the SG array at the non-zero blocks. Runs only get
+       * merged within a piece, as pieces need not be adjacent in memory. */
 
-            if(mode==0) {
+      for (i=0, j=0 ; i < take; i += n) {
+         const char *piece = (const char *)src->sg[elem].addr + elemOffset;
+         int k, mode = 0;
 
-               ++j;
-               ASSERT(j<sgMax);
+         n = MIN(take - i, (src->sg[elem].length - elemOffset) / BLKSIZE);
 
-               sgArr->sg[j].addr = (uint64) blkdata;
-               sgArr->sg[j].offset = offset;
-               sgArr->sg[j].length = BLKSIZE;
+         for (k = 0; k < n; k++) {
+            char *blkdata = (char *)piece + k * BLKSIZE;
 
-               ++(sgArr->length);
+            if (BitTest(refs, i + k)) {
 
-            } else {
-               ASSERT(j<sgMax);
-               sgArr->sg[j].length += BLKSIZE;
-            }
+               if(mode==0) {
+
+                  ++j;
+                  ASSERT(j<sgMax);
+
+                  sgArr->sg[j].addr = (uint64) blkdata;
+                  sgArr->sg[j].offset = offset;
+                  sgArr->sg[j].length = BLKSIZE;
 
-            BitSet(head->update.refs,i);
-            sha1_update(&ctx, BLKSIZE, blkdata);
-            offset += BLKSIZE;
+                  ++(sgArr->length);
 
-            mode = 1;
+               } else {
+                  ASSERT(j<sgMax);
+                  sgArr->sg[j].length += BLKSIZE;
+               }
+
+               log_checksum_update(&sum, BLKSIZE, blkdata);
+               offset += BLKSIZE;
+
+               mode = 1;
+            }
+            else {
+               mode = 0;
+            }
          }
-         else {
-            BitClear(head->update.refs,i);
-            mode = 0;
+
+         elemOffset += n * BLKSIZE;
+         if (elemOffset == src->sg[elem].length) {
+            ++elem;
+            elemOffset = 0;
          }
       }
 
+      if (log_entry_refs_blocks(head) > 0) {
+         log_entry_set_body_blocks(head, (offset - headSize) / BLKSIZE);
+      }
+
       /* Now that we have seen all the blocks, fixate the entry checksum */
 
-      sha1_update(&ctx, LOG_HEAD_SIZE - sizeof(struct log_head),
-            (const uint8_t *)head->update.refs);
-      sha1_digest(&ctx, SHA1_DIGEST_SIZE, head->update.checksum);
+      log_entry_checksum_end(&sum, head, head->update.checksum);
 
       /* calculate 'entropy' coming from update context and contents.
        * This is an incremental hash covering the entire history of the
        * volume. We store this in a separate field because we may have
        * to modify the checksum later, during log compation, but we wish
-       * to preserve the entropy for future use.
+       * to preserve the entropy for future use. The contents enter
+       * through the entry checksum, whichever algorithm the device uses,
+       * see log_checksum_type_t.
        *
        * XXX we could turn this into a HMAC and get update signing for free. */
 
@@ -429,6 +522,37 @@ LogFS_VDiskContinueWrite(LogFS_VDisk *vd,
        * IO when writes are failing, to make sure we get through to the disk
        * eventually. */
 
+      /* The body points into SRC, which need only stay valid until TOKEN
+       * completes, and for guest writes is mapped only until then. The
+       * sends to the replicas may still be reading after that, so they
+       * get a copy of the body, shared between them. */
+
+      LogFS_RefCountedBuffer *bodyBuffer = NULL;
+      SG_Array *netSgArr = sgArr;
+      size_t bodySize = SG_TotalLength(sgArr) - headSize;
+
+      if (!List_IsEmpty(&vd->remoteLogs) && bodySize > 0) {
+         char *body = aligned_malloc(bodySize);
+         size_t copied = 0;
+
+         ASSERT(body);
+         for (i = 1; i < sgArr->length; i++) {
+            memcpy(body + copied, (void *) sgArr->sg[i].addr,
+                   sgArr->sg[i].length);
+            copied += sgArr->sg[i].length;
+         }
+         bodyBuffer = LogFS_RefCountedBufferCreate(body, bodySize);
+
+         netSgArr = SG_Alloc(LogFS_GetHeap(), 2);
+         netSgArr->addrType = SG_VIRT_ADDR;
+         netSgArr->length = 2;
+         netSgArr->sg[0] = sgArr->sg[0];
+         netSgArr->sg[0].offset = 0;
+         netSgArr->sg[1].addr = (uint64) body;
+         netSgArr->sg[1].offset = headSize;
+         netSgArr->sg[1].length = bodySize;
+      }
+
       List_Links *curr, *next;
       LIST_FORALL_SAFE(&vd->remoteLogs, curr, next) {
          LogFS_RemoteLog *rl = List_Entry(curr, LogFS_RemoteLog, nextLog);
@@ -443,14 +567,18 @@ LogFS_VDiskContinueWrite(LogFS_VDisk *vd,
 #endif
 
          LogFS_RefCountedBufferRef(headBuffer);
+         if (bodyBuffer != NULL) {
+            LogFS_RefCountedBufferRef(bodyBuffer);
+         }
 
          LogFS_VDiskNetSendContext *c = Async_PushCallbackFrame(netToken,
-               LogFS_VDiskSendDone, sizeof (LogFS_VDiskNetSendContext *));
+               LogFS_VDiskSendDone, sizeof (LogFS_VDiskNetSendContext));
          c->rl = rl;
          c->headBuffer = headBuffer;
+         c->bodyBuffer = bodyBuffer;
 
          VMK_ReturnStatus netStatus;
-         netStatus = LogFS_RemoteLogAppend(rl, sgArr, netToken);
+         netStatus = LogFS_RemoteLogAppend(rl, netSgArr, netToken);
 
          if (netStatus == VMK_WOULD_BLOCK) {
             zprintf("detaching still open RL\n");
@@ -470,11 +598,14 @@ LogFS_VDiskContinueWrite(LogFS_VDisk *vd,
       }
 
       LogFS_RefCountedBufferRelease(headBuffer);
+      if (bodyBuffer != NULL) {
+         LogFS_RefCountedBufferRelease(bodyBuffer);
+         SG_Free(LogFS_GetHeap(), &netSgArr);
+      }
       SG_Free(LogFS_GetHeap(), &sgArr);
 
       /* increment counters */
       blkno += take;
-      buf += take * BLKSIZE;
    }
 
    Async_EndSplitIO(ioh, VMK_OK, FALSE);
@@ -483,6 +614,19 @@ LogFS_VDiskContinueWrite(LogFS_VDisk *vd,
    return status;
 }
 
+VMK_ReturnStatus
+LogFS_VDiskContinueWrite(LogFS_VDisk *vd,
+                         Async_Token * token,
+                         const char *buf,
+                         log_block_t blkno, size_t num_blocks, int flags)
+{
+   SG_Array src;
+
+   SG_SingletonSGArray(&src, 0, (VA) buf, num_blocks * BLKSIZE, SG_VIRT_ADDR);
+   return LogFS_VDiskContinueWriteSg(vd, token, &src, blkno, num_blocks,
+                                     flags);
+}
+
 /* Continue IO, caller must have bumped refcount to prevent the secret token being stolen */
 
 void LogFS_VDiskContinueIo(LogFS_VDiskIoContext * c)
@@ -516,177 +660,668 @@ void LogFS_VDiskContinueIo(LogFS_VDiskIoContext * c)
    }
 }
 
-VMK_ReturnStatus
-LogFS_VDiskWrite(LogFS_VDisk *vd,
-                 Async_Token * token,
-                 const char *buf,
-                 log_block_t blkno, size_t num_blocks, int flags)
-{
-   VMK_ReturnStatus status = VMK_OK;
+/* Small-write coalescing.
+ *
+ * Guests often issue runs of small adjacent writes, each of which would
+ * become a log entry of its own, with a head, a step of the hash chain, an
+ * append and a rangemap insert. With coalescing enabled, a small write that
+ * arrives while other writes to the vdisk are in flight is copied and
+ * linked into a stage instead. Later writes that are adjacent to the stage
+ * or overlap it get linked in too. The stage goes to the log as a single
+ * entry, with the writes merged in arrival order so the newest data wins,
+ * once the writes in flight complete, or earlier if a write arrives that
+ * does not fit in it or the stage is older than the window. The copying
+ * and merging happen outside vd->lock, which is only held to link a write.
+ *
+ * Writes in the stage are only acked when the merged entry is durable, so
+ * there is never acked data waiting for a flush, and a vdisk with nothing
+ * in flight sees no added latency. */
 
-   printf("write %" FMT64 "d+%lu\n", blkno, num_blocks);
+#define LOGFS_COALESCE_MAX_WRITES 64
 
- retry:
-   SP_Lock(&vd->lock);
-   LogFS_BTreeRangeMap *bt = vd->bt;
+/* A copy of a guest write, to ack when the entry is durable */
 
-   if (bt && LogFS_BTreeRangeMapHighWater(bt)) {
-      if (flags & FS_CANTBLOCK) {
-         if (!LogFS_BTreeRangeMapCanInsert(bt)) {
-            zprintf("can't insert, b-tree full!\n");
-            status = VMK_WOULD_BLOCK;
-            goto out;
-         }
-      } else {
-         SP_Unlock(&vd->lock);
-         zprintf("force flush\n");
-         LogFS_BTreeRangeMapFlush(bt);
-         goto retry;
-      }
-   }
+typedef struct LogFS_VDiskStagedWrite {
+   struct LogFS_VDiskStagedWrite *next;
+   Async_Token *token;
+   log_block_t blkno;
+   size_t numBlocks;
+   char data[0];
+} LogFS_VDiskStagedWrite;
 
-   if (LogFS_VDiskIsWritable(vd)) {
-      LogFS_VDiskRef(vd);
-      SP_Unlock(&vd->lock);
+typedef struct LogFS_VDiskStage {
+   char *buffer;                /* the merged entry, once emitted */
+   log_block_t blkno;
+   size_t numBlocks;
+   int flags;                   /* of all the writes, or'ed together */
+   uint64 openedCycles;
 
-      status =
-          LogFS_VDiskContinueWrite(vd, token, buf, blkno, num_blocks, flags);
-      LogFS_VDiskDeref(vd);
-      return status;
-   } else {
-      Hash inv;
+   /* Guest writes, in arrival order */
+   int numWrites;
+   LogFS_VDiskStagedWrite *first;
+   LogFS_VDiskStagedWrite *last;
+} LogFS_VDiskStage;
 
-      LogFS_HashClear(&inv);
-      Hash id = LogFS_HashIsValid(vd->secretView) ? vd->parent : inv;
+typedef struct {
+   LogFS_VDisk *vd;
+   LogFS_VDiskStage *stage;
+} LogFS_VDiskStageContext;
 
-      status = LogFS_HttpClientRequest(vd->disk, id,
-                                       token, (char *)buf, blkno, num_blocks,
-                                       flags & FS_WRITE_OP);
-   }
- out:
-   SP_Unlock(&vd->lock);
-   return status;
+static void LogFS_VDiskEmitStage(LogFS_VDisk *vd, LogFS_VDiskStage *s);
 
-}
+/* A write in flight completed. Called with vd->lock held. Returns the stage
+ * to emit, if this was the last one. */
 
-void LogFS_VDiskAddRemoteLog(LogFS_VDisk *vd, LogFS_RemoteLog *rl)
+static LogFS_VDiskStage *
+LogFS_VDiskRetireWrite(LogFS_VDisk *vd)
 {
-   LogFS_RemoteLogRef(rl);
-   List_Insert(&rl->nextLog, LIST_ATREAR(&vd->remoteLogs));
+   LogFS_VDiskStage *s = NULL;
+
+   ASSERT(vd->writesInFlight > 0);
+
+   if (--(vd->writesInFlight) == 0 && vd->stage != NULL) {
+      s = vd->stage;
+      vd->stage = NULL;
+      ++(vd->writesInFlight);
+   }
+   return s;
 }
 
-int LogFS_VDiskAddRemoteLogIfSameVersion(LogFS_VDisk *vd, LogFS_RemoteLog *rl)
+typedef struct {
+   LogFS_VDisk *vd;
+   Async_Token *token;
+} LogFS_VDiskLeaseContext;
+
+static void
+LogFS_VDiskLeaseTimer(void *data, UNUSED_PARAM(Timer_AbsCycles timestamp))
 {
-   int added = 0;
+   LogFS_VDiskLeaseContext *c = data;
+   LogFS_VDisk *vd = c->vd;
+   Async_Token *token = c->token;
+
+   free(c);
+
    SP_Lock(&vd->lock);
-   if (vd->lsn == rl->lsn) {
-      zprintf("adding sync log\n");
-      LogFS_VDiskAddRemoteLog(vd, rl);
-      added = 1;
-   }
+   --(vd->heldWrites);
    SP_Unlock(&vd->lock);
-   return added;
+
+   LogFS_VDiskDeref(vd);
+   Async_TokenCallback(token);
 }
 
-void LogFS_VDiskContinueWithSecret(LogFS_VDisk *vd)
+/* A write on the primary is done. Replicas holding a read lease we granted
+ * do not see it, so hold the acknowledgement back until the lease ends. */
+
+static void
+LogFS_VDiskLeaseDone(Async_Token * token, void *data)
 {
-   List_Links *curr, *next;
-   LIST_FORALL_SAFE(&vd->tokenWaiters, curr, next) {
-      LogFS_VDiskIoContext *c = List_Entry(curr, LogFS_VDiskIoContext, next);
+   LogFS_VDisk *vd = *((LogFS_VDisk **) data);
+   uint64 leftUS = 0;
 
-      SP_Lock(&vd->lock);
-      Bool canProceed = (vd->generation == c->needsGeneration);
-      SP_Unlock(&vd->lock);
+   SP_Lock(&vd->lock);
+   if (vd->grantMS != 0) {
+      uint64 us = Timer_AbsTCToUS(Timer_GetCycles() - vd->grantCycles);
 
-      if (canProceed) {
-         LogFS_VDiskContinueIo(c);
-         List_Remove(curr);
-         free(c);
+      if (us < vd->grantMS * 1000ULL) {
+         leftUS = vd->grantMS * 1000ULL - us;
+         ++(vd->heldWrites);
+      } else {
+         vd->grantMS = 0;
       }
    }
+   SP_Unlock(&vd->lock);
+
+   if (leftUS == 0) {
+      LogFS_VDiskDeref(vd);
+      Async_TokenCallback(token);
+   } else {
+      LogFS_VDiskLeaseContext *c = malloc(sizeof(LogFS_VDiskLeaseContext));
+      c->vd = vd;
+      c->token = token;
+      Timer_Add(MY_PCPU, LogFS_VDiskLeaseTimer, leftUS / 1000 + 1,
+                TIMER_ONE_SHOT, c);
+   }
 }
 
-VMK_ReturnStatus LogFS_VDiskSetSecret(LogFS_VDisk *vd, Hash secret,
-                                      Hash secretView)
+static void
+LogFS_VDiskInFlightDone(Async_Token * token, void *data)
 {
-   VMK_ReturnStatus status;
+   LogFS_VDisk *vd = *((LogFS_VDisk **) data);
+   LogFS_VDiskStage *s;
 
    SP_Lock(&vd->lock);
+   s = LogFS_VDiskRetireWrite(vd);
+   SP_Unlock(&vd->lock);
 
-   if (LogFS_HashIsNull(secret)) {
-      vd->secretView = secretView;
-      status = VMK_OK;
+   if (s != NULL) {
+      LogFS_VDiskEmitStage(vd, s);
    }
 
-   else if (LogFS_HashEquals(vd->parent, LogFS_HashApply(secret))) {
-      vd->secret_parent = secret;
-      vd->secretView = secretView;
-      vd->stopRequested = FALSE;
-      ++(vd->generation);
-      status = VMK_OK;
-      zprintf("secret set ok\n");
-   } else {
-      Warning("bad secret input!\n");
-      status = VMK_BAD_PARAM;
-   }
+   LogFS_VDiskDeref(vd);
+   Async_TokenCallback(token);
+}
 
-   LogFS_VDiskRef(vd);
+/* A write sent to the primary is done. Until it comes back to us through
+ * the stream, reads must go to the primary to see it. */
+
+static void
+LogFS_VDiskRemoteWriteDone(Async_Token * token, void *data)
+{
+   LogFS_VDisk *vd = *((LogFS_VDisk **) data);
 
+   SP_Lock(&vd->lock);
+   vd->leaseMS = 0;
    SP_Unlock(&vd->lock);
 
-   if (status == VMK_OK)
-      LogFS_VDiskContinueWithSecret(vd);
    LogFS_VDiskDeref(vd);
-
-   return status;
+   Async_TokenCallback(token);
 }
 
-void LogFS_VDiskRelease(LogFS_VDisk *vd)
+static void
+LogFS_VDiskStageDone(Async_Token * token, void *data)
 {
+   LogFS_VDiskStageContext *c = data;
+   LogFS_VDisk *vd = c->vd;
+   LogFS_VDiskStage *s = c->stage;
+   LogFS_VDiskStage *next;
+   VMK_ReturnStatus status = token->transientStatus;
+   LogFS_VDiskStagedWrite *w;
+
    SP_Lock(&vd->lock);
-   vd->haveReservation = FALSE;
+   next = LogFS_VDiskRetireWrite(vd);
    SP_Unlock(&vd->lock);
+
+   if (next != NULL) {
+      LogFS_VDiskEmitStage(vd, next);
+   }
+
+   while ((w = s->first) != NULL) {
+      s->first = w->next;
+
+      if (status == VMK_OK) {
+         ((SCSI_Result *) w->token->result)->status =
+            SCSI_MAKE_STATUS(SCSI_HOST_OK, SDSTAT_GOOD);
+      } else {
+         w->token->transientStatus = status;
+      }
+      Async_TokenCallback(w->token);
+      free(w);
+   }
+
+   if (s->buffer) {
+      aligned_free(s->buffer);
+   }
+   free(s);
    LogFS_VDiskDeref(vd);
+
+   Async_TokenCallback(token);
+   Async_ReleaseToken(token);
 }
 
-VMK_ReturnStatus LogFS_VDiskReserve(LogFS_VDisk *vd)
+/* Write the stage to the log as a single entry. Must be called without
+ * vd->lock held, and counts as a write in flight. */
+
+static void
+LogFS_VDiskEmitStage(LogFS_VDisk *vd, LogFS_VDiskStage *s)
 {
-   SP_Lock(&vd->lock);
+   Async_Token *token = Async_AllocToken(0);
+   LogFS_VDiskStageContext *c;
+   LogFS_VDiskStagedWrite *w;
+   SG_Array src;
+   Bool writable;
+
    LogFS_VDiskRef(vd);
-   vd->haveReservation = TRUE;
+   c = Async_PushCallbackFrame(token, LogFS_VDiskStageDone,
+                               sizeof(LogFS_VDiskStageContext));
+   c->vd = vd;
+   c->stage = s;
+
+   SP_Lock(&vd->lock);
+   writable = LogFS_VDiskIsWritable(vd);
+   if (writable) {
+      vd->stagedWrites += s->numWrites;
+      ++(vd->stagedEntries);
+   }
    SP_Unlock(&vd->lock);
 
-   return VMK_OK;
+   if (!writable) {
+      zprintf("failing %d staged writes to %" FMT64 "d\n", s->numWrites,
+              s->blkno);
+      token->transientStatus = VMK_RESERVATION_CONFLICT;
+      Async_TokenCallback(token);
+      return;
+   }
+
+   s->buffer = aligned_malloc(s->numBlocks * BLKSIZE);
+   ASSERT(s->buffer);
+   for (w = s->first; w != NULL; w = w->next) {
+      memcpy(s->buffer + (w->blkno - s->blkno) * BLKSIZE, w->data,
+             w->numBlocks * BLKSIZE);
+   }
+
+   SG_SingletonSGArray(&src, 0, (VA) s->buffer, s->numBlocks * BLKSIZE,
+                       SG_VIRT_ADDR);
+   LogFS_VDiskContinueWriteSg(vd, token, &src, s->blkno, s->numBlocks,
+                              s->flags);
 }
 
-VMK_ReturnStatus LogFS_VDiskSnapshot(LogFS_VDisk *vd, LogFS_VDisk **snapshot)
+/* Copy a write that may get staged, and make a stage for it to open,
+ * before vd->lock is taken. Whether there is anything to stage behind is
+ * read without the lock, so this is only a guess, and the stage is made
+ * even if it will not be needed. LogFS_VDiskStageWrite() decides, and
+ * takes what it uses; the caller frees the rest. */
+
+static void
+LogFS_VDiskPrepareStage(LogFS_VDisk *vd, const SG_Array *src,
+                        log_block_t blkno, size_t num_blocks,
+                        LogFS_VDiskStagedWrite **w, LogFS_VDiskStage **fresh)
 {
-   VMK_ReturnStatus status = VMK_OK;
-   LogFS_VDisk *carcass;
+   LogFS_MetaLog *ml = vd->log;
+   int i;
 
-   zprintf("snapshotting disk %s\n", LogFS_HashShow(&vd->disk));
+   *w = NULL;
+   *fresh = NULL;
 
-   /* We need two new vDisks, one to hold the immutable state of the base
-    * branch, and one for storing changes to the new one.
-    * Rather than trying to figure out who might be holding references to
-    * the existing vd, we keep the old one and fix up the bt ptr */
+   if (ml->coalesceWindowUS == 0 ||
+       num_blocks > ml->coalesceBytes / BLKSIZE ||
+       (vd->writesInFlight == 0 && vd->stage == NULL)) {
+      return;
+   }
 
-   /* Create the 'carcass'; the readonly snapshot of the vd the way it looks
-    * right now, inheriting its baseId and version map.
-    * If the current vd is the same version as its parent (an older carcass),
-    * we reuse that one.
-    */
+   *w = malloc(sizeof(LogFS_VDiskStagedWrite) + num_blocks * BLKSIZE);
+   ASSERT(*w);
+   (*w)->next = NULL;
+   (*w)->token = NULL;
+   (*w)->blkno = blkno;
+   (*w)->numBlocks = num_blocks;
+   for (i = 0; i < src->length; i++) {
+      memcpy((*w)->data + src->sg[i].offset - src->sg[0].offset,
+             (void *)src->sg[i].addr, src->sg[i].length);
+   }
 
-   /* We currently do not support branching an empty disk as this makes little
-    * sense. Better to just create a new one. */
+   *fresh = malloc(sizeof(LogFS_VDiskStage));
+   ASSERT(*fresh);
+}
 
-   if (LogFS_HashEquals(vd->disk, vd->parent)) {
-      zprintf("cannot snapshot empty disk!\n");
-      status = VMK_NOT_SUPPORTED;
-      goto out;
-   }
+/* Free what LogFS_VDiskStageWrite() did not take */
 
-   if (vd->parentDisk != NULL &&
+static void
+LogFS_VDiskUnprepareStage(LogFS_VDiskStagedWrite *w, LogFS_VDiskStage *fresh)
+{
+   if (w) {
+      free(w);
+   }
+   if (fresh) {
+      free(fresh);
+   }
+}
+
+/*
+ *-----------------------------------------------------------------------------
+ *
+ * LogFS_VDiskStageWrite --
+ *
+ *      Try to link the write copied into *W by LogFS_VDiskPrepareStage()
+ *      into the stage of the vdisk, opening *FRESH if there is no stage.
+ *      Called with vd->lock held.
+ *
+ * Results:
+ *      TRUE if the write was staged, and TOKEN now completes along with
+ *      the merged entry. FALSE if the write must go to the log directly.
+ *
+ * Side effects:
+ *      Clears *W and *FRESH if they were taken. May set *EMIT to a stage
+ *      the write did not fit in, which the caller must emit after dropping
+ *      the lock, before writing anything else.
+ *
+ *-----------------------------------------------------------------------------
+ */
+
+static Bool
+LogFS_VDiskStageWrite(LogFS_VDisk *vd,
+                      Async_Token * token,
+                      log_block_t blkno, size_t num_blocks, int flags,
+                      LogFS_VDiskStagedWrite **w, LogFS_VDiskStage **fresh,
+                      LogFS_VDiskStage **emit)
+{
+   LogFS_MetaLog *ml = vd->log;
+   LogFS_VDiskStage *s = vd->stage;
+   size_t maxBlocks = ml->coalesceBytes / BLKSIZE;
+   uint64 now = Timer_GetCycles();
+
+   *emit = NULL;
+
+   if (ml->coalesceWindowUS == 0) {
+      return FALSE;
+   }
+
+   /* A write that was not copied goes to the log directly, so the stage
+    * must go first in case they overlap */
+
+   if (s != NULL &&
+       (*w == NULL ||
+        blkno > s->blkno + s->numBlocks ||
+        blkno + num_blocks < s->blkno ||
+        MAX(blkno + num_blocks, s->blkno + s->numBlocks) -
+        MIN(blkno, s->blkno) > maxBlocks ||
+        s->numWrites == LOGFS_COALESCE_MAX_WRITES ||
+        Timer_AbsTCToUS(now - s->openedCycles) >= ml->coalesceWindowUS)) {
+      *emit = s;
+      vd->stage = s = NULL;
+      ++(vd->writesInFlight);
+   }
+
+   /* With nothing to wait for there is no point in staging, and large
+    * writes gain little from it */
+
+   if (*w == NULL ||
+       (s == NULL &&
+        (vd->writesInFlight == 0 || num_blocks > maxBlocks / 4))) {
+      return FALSE;
+   }
+
+   if (s == NULL) {
+      s = *fresh;
+      *fresh = NULL;
+      s->buffer = NULL;
+      s->blkno = blkno;
+      s->numBlocks = num_blocks;
+      s->flags = flags;
+      s->openedCycles = now;
+      s->numWrites = 0;
+      s->first = NULL;
+      s->last = NULL;
+      vd->stage = s;
+   }
+
+   s->flags |= flags;
+   if (blkno < s->blkno) {
+      s->numBlocks += s->blkno - blkno;
+      s->blkno = blkno;
+   }
+   s->numBlocks = MAX(s->numBlocks, blkno + num_blocks - s->blkno);
+
+   (*w)->token = token;
+   if (s->last != NULL) {
+      s->last->next = *w;
+   } else {
+      s->first = *w;
+   }
+   s->last = *w;
+   *w = NULL;
+   ++(s->numWrites);
+
+   return TRUE;
+}
+
+VMK_ReturnStatus
+LogFS_VDiskWrite(LogFS_VDisk *vd,
+                 Async_Token * token,
+                 const char *buf,
+                 log_block_t blkno, size_t num_blocks, int flags)
+{
+   SG_Array src;
+
+   SG_SingletonSGArray(&src, 0, (VA) buf, num_blocks * BLKSIZE, SG_VIRT_ADDR);
+   return LogFS_VDiskWriteSg(vd, token, &src, blkno, num_blocks, flags);
+}
+
+/* Like LogFS_VDiskWrite(), but without first gathering the data into one
+ * buffer. SRC is virtually addressed and holds whole blocks per element, and
+ * must stay valid until TOKEN completes. */
+
+VMK_ReturnStatus
+LogFS_VDiskWriteSg(LogFS_VDisk *vd,
+                   Async_Token * token,
+                   const SG_Array *src,
+                   log_block_t blkno, size_t num_blocks, int flags)
+{
+   VMK_ReturnStatus status = VMK_OK;
+   LogFS_VDiskStagedWrite *w;
+   LogFS_VDiskStage *fresh;
+
+   printf("write %" FMT64 "d+%lu\n", blkno, num_blocks);
+
+   LogFS_VDiskPrepareStage(vd, src, blkno, num_blocks, &w, &fresh);
+
+ retry:
+   SP_Lock(&vd->lock);
+   LogFS_BTreeRangeMap *bt = vd->bt;
+
+   if (bt && LogFS_BTreeRangeMapHighWater(bt)) {
+      if (flags & FS_CANTBLOCK) {
+         if (!LogFS_BTreeRangeMapCanInsert(bt)) {
+            zprintf("can't insert, b-tree full!\n");
+            status = VMK_WOULD_BLOCK;
+            goto out;
+         }
+      } else {
+         SP_Unlock(&vd->lock);
+         zprintf("force flush\n");
+         LogFS_BTreeRangeMapFlush(bt);
+         goto retry;
+      }
+   }
+
+   if (LogFS_VDiskIsWritable(vd)) {
+      LogFS_VDiskStage *emit;
+      Bool staged;
+
+      /* While replicas may serve reads from a lease we granted, the write
+       * must not be acknowledged, see LogFS_VDiskLeaseDone(). This frame
+       * goes first so that it runs last. */
+
+      if (vd->log->localReadMS != 0) {
+         LogFS_VDiskRef(vd);
+         *((LogFS_VDisk **) Async_PushCallbackFrame(token,
+                                                    LogFS_VDiskLeaseDone,
+                                                    sizeof(LogFS_VDisk *))) =
+            vd;
+      }
+
+      staged = LogFS_VDiskStageWrite(vd, token, blkno, num_blocks, flags,
+                                     &w, &fresh, &emit);
+
+      /* Keep count of writes in flight, for the stage to go out when they
+       * are done */
+
+      if (!staged && vd->log->coalesceWindowUS != 0) {
+         ++(vd->writesInFlight);
+         LogFS_VDiskRef(vd);
+         *((LogFS_VDisk **) Async_PushCallbackFrame(token,
+                                                    LogFS_VDiskInFlightDone,
+                                                    sizeof(LogFS_VDisk *))) =
+            vd;
+      }
+
+      LogFS_VDiskRef(vd);
+      SP_Unlock(&vd->lock);
+
+      LogFS_VDiskUnprepareStage(w, fresh);
+
+      if (emit != NULL) {
+         LogFS_VDiskEmitStage(vd, emit);
+      }
+      if (!staged) {
+         status = LogFS_VDiskContinueWriteSg(vd, token, src, blkno,
+                                             num_blocks, flags);
+      }
+      LogFS_VDiskDeref(vd);
+      return status;
+   } else {
+      Hash inv;
+      char *buf;
+      int i;
+
+      LogFS_HashClear(&inv);
+      Hash id = LogFS_HashIsValid(vd->secretView) ? vd->parent : inv;
+
+      /* Our own write will only reach us later through the stream, so
+       * reads must ask the primary again until then */
+      vd->leaseMS = 0;
+      LogFS_VDiskRef(vd);
+      *((LogFS_VDisk **) Async_PushCallbackFrame(token,
+                                                 LogFS_VDiskRemoteWriteDone,
+                                                 sizeof(LogFS_VDisk *))) = vd;
+
+      /* The HTTP client wants the data in one piece */
+
+      if (src->length == 1) {
+         buf = (char *)src->sg[0].addr;
+      } else {
+         buf = aligned_malloc(num_blocks * BLKSIZE);
+         ASSERT(buf);
+         for (i = 0; i < src->length; i++) {
+            memcpy(buf + src->sg[i].offset - src->sg[0].offset,
+                   (void *)src->sg[i].addr, src->sg[i].length);
+         }
+         *((void **)Async_PushCallbackFrame(token, LogFS_FreeSimpleBuffer,
+                                            sizeof(void *))) = buf;
+      }
+
+      status = LogFS_HttpClientRequest(vd->disk, id,
+                                       token, (char *)buf, blkno, num_blocks,
+                                       flags & FS_WRITE_OP);
+   }
+ out:
+   SP_Unlock(&vd->lock);
+   LogFS_VDiskUnprepareStage(w, fresh);
+   return status;
+
+}
+
+void LogFS_VDiskAddRemoteLog(LogFS_VDisk *vd, LogFS_RemoteLog *rl)
+{
+   LogFS_RemoteLogRef(rl);
+   List_Insert(&rl->nextLog, LIST_ATREAR(&vd->remoteLogs));
+}
+
+int LogFS_VDiskAddRemoteLogIfSameVersion(LogFS_VDisk *vd, LogFS_RemoteLog *rl)
+{
+   int added = 0;
+   SP_Lock(&vd->lock);
+   if (vd->lsn == rl->lsn) {
+      zprintf("adding sync log\n");
+      LogFS_VDiskAddRemoteLog(vd, rl);
+      added = 1;
+   }
+   SP_Unlock(&vd->lock);
+   return added;
+}
+
+void LogFS_VDiskContinueWithSecret(LogFS_VDisk *vd)
+{
+   List_Links *curr, *next;
+   LIST_FORALL_SAFE(&vd->tokenWaiters, curr, next) {
+      LogFS_VDiskIoContext *c = List_Entry(curr, LogFS_VDiskIoContext, next);
+
+      SP_Lock(&vd->lock);
+      Bool canProceed = (vd->generation == c->needsGeneration);
+      SP_Unlock(&vd->lock);
+
+      if (canProceed) {
+         LogFS_VDiskContinueIo(c);
+         List_Remove(curr);
+         free(c);
+      }
+   }
+}
+
+VMK_ReturnStatus LogFS_VDiskSetSecret(LogFS_VDisk *vd, Hash secret,
+                                      Hash secretView)
+{
+   VMK_ReturnStatus status;
+
+   SP_Lock(&vd->lock);
+
+   if (LogFS_HashIsNull(secret)) {
+      vd->secretView = secretView;
+      status = VMK_OK;
+   }
+
+   else if (LogFS_HashEquals(vd->parent, LogFS_HashApply(secret))) {
+      vd->secret_parent = secret;
+      vd->secretView = secretView;
+      vd->stopRequested = FALSE;
+      ++(vd->generation);
+      status = VMK_OK;
+      zprintf("secret set ok\n");
+   } else {
+      Warning("bad secret input!\n");
+      status = VMK_BAD_PARAM;
+   }
+
+   LogFS_VDiskRef(vd);
+
+   SP_Unlock(&vd->lock);
+
+   if (status == VMK_OK)
+      LogFS_VDiskContinueWithSecret(vd);
+   LogFS_VDiskDeref(vd);
+
+   return status;
+}
+
+void LogFS_VDiskRelease(LogFS_VDisk *vd)
+{
+   SP_Lock(&vd->lock);
+   vd->haveReservation = FALSE;
+   if (vd->stagedEntries > 0) {
+      zprintf("%s: coalesced %" FMT64 "u writes into %" FMT64 "u entries\n",
+              LogFS_HashShow(&vd->disk), vd->stagedWrites, vd->stagedEntries);
+   }
+   if (vd->localReads > 0) {
+      zprintf("%s: %" FMT64 "u reads served by the local replica\n",
+              LogFS_HashShow(&vd->disk), vd->localReads);
+   }
+   if (vd->readAhead != NULL && vd->readAhead->fetchedBlocks > 0) {
+      zprintf("%s: %" FMT64 "u reads from readahead, %" FMT64
+              "u blocks fetched, %" FMT64 "u unused\n",
+              LogFS_HashShow(&vd->disk), vd->readAhead->hits,
+              vd->readAhead->fetchedBlocks, vd->readAhead->wastedBlocks);
+   }
+   SP_Unlock(&vd->lock);
+   LogFS_VDiskDeref(vd);
+}
+
+VMK_ReturnStatus LogFS_VDiskReserve(LogFS_VDisk *vd)
+{
+   SP_Lock(&vd->lock);
+   LogFS_VDiskRef(vd);
+   vd->haveReservation = TRUE;
+   SP_Unlock(&vd->lock);
+
+   return VMK_OK;
+}
+
+VMK_ReturnStatus LogFS_VDiskSnapshot(LogFS_VDisk *vd, LogFS_VDisk **snapshot)
+{
+   VMK_ReturnStatus status = VMK_OK;
+   LogFS_VDisk *carcass;
+
+   zprintf("snapshotting disk %s\n", LogFS_HashShow(&vd->disk));
+
+   /* We need two new vDisks, one to hold the immutable state of the base
+    * branch, and one for storing changes to the new one.
+    * Rather than trying to figure out who might be holding references to
+    * the existing vd, we keep the old one and fix up the bt ptr */
+
+   /* Create the 'carcass'; the readonly snapshot of the vd the way it looks
+    * right now, inheriting its baseId and version map.
+    * If the current vd is the same version as its parent (an older carcass),
+    * we reuse that one.
+    */
+
+   /* We currently do not support branching an empty disk as this makes little
+    * sense. Better to just create a new one. */
+
+   if (LogFS_HashEquals(vd->disk, vd->parent)) {
+      zprintf("cannot snapshot empty disk!\n");
+      status = VMK_NOT_SUPPORTED;
+      goto out;
+   }
+
+   if (vd->parentDisk != NULL &&
        LogFS_HashEquals(vd->parent, vd->parentDisk->parent)) {
       carcass = vd->parentDisk;
    } else {
@@ -913,122 +1548,527 @@ void LogFS_VDiskFreeGenericBuffer(Async_Token * token, void *data)
 
 
 
-typedef struct {
-   LogFS_VDisk *vd;
-   log_block_t blkno;
-   size_t num_blocks;
-   char *buf;
-   Async_IOHandle *ioh;
-   log_block_t end;
-   int flags;
-   int depth;
-
-} LogFS_VDiskLookupContext;
+/* Make an SG array of the LENGTH bytes of SRC that start FROM bytes into
+ * it, with offsets counting up from OFFSET. Free it with SG_Free(). */
 
-void LogFS_VDiskProcessLookups(range_t range, log_block_t endsat, void *data)
+static SG_Array *
+LogFS_VDiskSliceSg(const SG_Array *src, uint64 from, uint64 length,
+                   uint64 offset)
 {
-   VMK_ReturnStatus status;
+   SG_Array *dst = SG_Alloc(LogFS_GetHeap(), src->length);
+   uint64 pos = 0;
+   int i, n;
 
-   LogFS_VDiskLookupContext *c = (LogFS_VDiskLookupContext *) data;
-   ++(c->depth);
-   if (c->depth > 5)
-      zprintf("recursion depth %d\n", c->depth);
+   ASSERT(dst);
+   dst->addrType = src->addrType;
 
-   log_id_t v;
-   v.raw = range.version;
+   for (i = 0, n = 0; i < src->length && length > 0; i++) {
+      uint64 elemLength = src->sg[i].length;
+
+      if (pos + elemLength > from) {
+         uint64 skip = (from > pos) ? from - pos : 0;
+         uint64 take = MIN(elemLength - skip, length);
 
-   for (;;) {
+         dst->sg[n].addr = src->sg[i].addr + skip;
+         dst->sg[n].offset = offset;
+         dst->sg[n].length = take;
 
-      //zprintf("process %lu-> (%lu) blkno %lu\n",range.from,endsat,c->blkno);
+         offset += take;
+         length -= take;
+         ++n;
+      }
+      pos += elemLength;
+   }
+
+   ASSERT(length == 0);
+   dst->length = n;
+   return dst;
+}
 
-      char *buf = c->buf;
-      LogFS_VDisk *vd = c->vd;
-      LogFS_MetaLog *log = vd->log;
+/* Copy LENGTH bytes from SRC into the memory described by SG, starting
+ * FROM bytes into it, or zero them if SRC is NULL. Machine addresses get
+ * mapped a page at a time. */
 
-      log_block_t i = c->blkno;
+static void
+LogFS_VDiskFillSgRange(const SG_Array *sg, uint64 from, uint64 length,
+                       const char *src)
+{
+   int i;
 
-      log_block_t end = c->blkno + c->num_blocks;
-      size_t sz = MIN(endsat, end) - i;
+   for (i = 0; i < sg->length && length > 0; i++) {
+      uint64 elemLength = sg->sg[i].length;
+      uint64 done = from;
 
-      ASSERT(sz > 0);
+      if (from >= elemLength) {
+         from -= elemLength;
+         continue;
+      }
+      from = 0;
 
-      /* never written? */
-      if (is_invalid_version(v)) {
-         void *pd = vd->parentDisk;
+      while (done < elemLength && length > 0) {
+         uint64 n = MIN(elemLength - done, length);
+         char *dst;
 
-         if (pd != NULL) {
-            ASSERT(pd != vd);
-            printf("forwarding read %ld+%ld to parent\n", i, sz);
-            Async_Token *childToken = Async_PrepareOneIO(c->ioh, NULL);
-            status = LogFS_VDiskRead(pd, childToken, buf, i, sz, c->flags);
-            ASSERT(status == VMK_OK);
+         if (sg->addrType == SG_MACH_ADDR) {
+            n = MIN(n, PAGE_SIZE - ((sg->sg[i].addr + done) & (PAGE_SIZE - 1)));
+            dst = Kseg_MapMA(sg->sg[i].addr + done, n);
+            ASSERT(dst);
          } else {
-            /* We may need a parent, but not actually have one. In that case,
-             * the read should fail. */
-            if (LogFS_HashIsValid(vd->parentBaseId)) {
-               status = VMK_READ_ERROR;
-            }
-            /* Otherwise, just zero the buffer */
-            else {
-               memset(buf, 0, BLKSIZE * sz);
-               status = VMK_OK;
-            }
+            dst = (char *)(VA) sg->sg[i].addr + done;
+         }
+
+         if (src) {
+            memcpy(dst, src, n);
+            src += n;
+         } else {
+            memset(dst, 0, n);
          }
+
+         if (sg->addrType == SG_MACH_ADDR) {
+            Kseg_ReleaseVA(dst);
+         }
+         done += n;
+         length -= n;
       }
+   }
+   ASSERT(length == 0);
+}
+
+/* Copy from SRC into all of the memory described by SG, or zero it if SRC
+ * is NULL. */
 
-      /* data for these blocks is present in the log. */
-      else {
+static void
+LogFS_VDiskFillSg(const SG_Array *sg, const char *src)
+{
+   LogFS_VDiskFillSgRange(sg, 0, SG_TotalLength(sg), src);
+}
 
-         int relPos = c->blkno - range.from;
-         ASSERT(range.from <= c->blkno);
+typedef struct {
+   char *buf;
+   SG_Array *sg;
+} LogFS_VDiskBounceContext;
 
-         Async_Token *childToken = Async_PrepareOneIO(c->ioh, NULL);
+/* Copy what was read into a bounce buffer to where it was meant to go */
+
+static void
+LogFS_VDiskBounceDone(Async_Token * token, void *data)
+{
+   LogFS_VDiskBounceContext *c = data;
+
+   if (token->transientStatus == VMK_OK) {
+      LogFS_VDiskFillSg(c->sg, c->buf);
+   }
+   aligned_free(c->buf);
+   SG_Free(LogFS_GetHeap(), &c->sg);
 
-         LogFS_Log *sublog = LogFS_MetaLogGetLog(log, v.v.segment);
-         log_offset_t position = ( relPos + v.v.blk_offset ) * BLKSIZE;
+   Async_TokenCallback(token);
+}
+
+typedef struct {
+   LogFS_VDisk *vd;
+   log_block_t blkno;
+   size_t num_blocks;
+   SG_Array *sg;         /* where the data goes, from block 'first' on */
+   log_block_t first;
+   Async_IOHandle *ioh;
+   log_block_t end;
+   int flags;
+
+   /* Log reads not issued yet, see LogFS_VDiskMergeRead() */
+   SG_Array *merged;
+   int mergedSlots;
+   uint64 mergedStart;
+   uint64 mergedEnd;
+   struct LogFS_VDiskCacheFills *fills;
+
+} LogFS_VDiskLookupContext;
+
+/* Extents small enough for the block cache, see blockCache.h, are looked
+ * up there first. Those that miss are read as usual, and then copied out
+ * of the caller's buffer into the cache once the read completes. */
+
+#define LOGFS_READ_MERGE_FILLS 32
+
+typedef struct LogFS_VDiskCacheFills {
+   LogFS_MetaLog *ml;
+   SG_Array *sg;                /* the merged read */
+   int numFills;
+   struct {
+      log_id_t pos;
+      uint32 numBlocks;
+      uint32 generation;
+      uint64 from;              /* where in SG */
+   } fills[LOGFS_READ_MERGE_FILLS];
+} LogFS_VDiskCacheFills;
+
+/* Copy the memory described by SG out into DST. */
+
+static void
+LogFS_VDiskGatherSg(const SG_Array *sg, char *dst)
+{
+   int i;
 
-         log_offset_t offset = 
-            LogFS_VDiskGetAbsoluteDiskPosition(log, sublog, position);
+   for (i = 0; i < sg->length; i++) {
+      uint64 length = sg->sg[i].length;
+      uint64 done = 0;
 
-         LogFS_MetaLogPutLog(log,sublog);
+      while (done < length) {
+         uint64 n = length - done;
+         char *src;
+
+         if (sg->addrType == SG_MACH_ADDR) {
+            n = MIN(n, PAGE_SIZE - ((sg->sg[i].addr + done) & (PAGE_SIZE - 1)));
+            src = Kseg_MapMA(sg->sg[i].addr + done, n);
+            ASSERT(src);
+         } else {
+            src = (char *)(VA) sg->sg[i].addr + done;
+         }
+
+         memcpy(dst, src, n);
+         dst += n;
+
+         if (sg->addrType == SG_MACH_ADDR) {
+            Kseg_ReleaseVA(src);
+         }
+         done += n;
+      }
+   }
+}
+
+static void
+LogFS_VDiskCacheFillDone(Async_Token * token, void *data)
+{
+   LogFS_VDiskCacheFills *f = *((LogFS_VDiskCacheFills **) data);
+   char *buf;
+   int i;
+
+   if (token->transientStatus == VMK_OK) {
+      buf = aligned_malloc(LOGFS_BLOCK_CACHE_MAX_READ);
+      ASSERT(buf);
+
+      for (i = 0; i < f->numFills; i++) {
+         uint64 length = f->fills[i].numBlocks * BLKSIZE;
+         SG_Array *s = LogFS_VDiskSliceSg(f->sg, f->fills[i].from, length, 0);
+
+         LogFS_VDiskGatherSg(s, buf);
+         SG_Free(LogFS_GetHeap(), &s);
+         LogFS_BlockCacheFill(&f->ml->blockCache, f->fills[i].pos,
+                              f->fills[i].numBlocks, buf,
+                              f->fills[i].generation);
+      }
+      aligned_free(buf);
+   }
+
+   SG_Free(LogFS_GetHeap(), &f->sg);
+   free(f);
+
+   Async_TokenCallback(token);
+}
+
+typedef struct {
+   const SG_Array *slice;
+   uint64 done;
+} LogFS_VDiskCacheCopy;
+
+/* Copy one cache page's share of a hit into the slice, after the part
+ * already copied. Called with the block cache lock held. */
+
+static void
+LogFS_VDiskCopyFromCache(void *data, const char *src, uint32 bytes)
+{
+   LogFS_VDiskCacheCopy *cc = data;
+
+   LogFS_VDiskFillSgRange(cc->slice, cc->done, bytes, src);
+   cc->done += bytes;
+}
+
+/* Serve NUMBLOCKS blocks at log position POS from the block cache into
+ * SLICE, copying straight from the cache pages. Returns FALSE on a miss,
+ * having touched nothing. */
+
+static Bool
+LogFS_VDiskReadFromCache(LogFS_MetaLog *ml, const SG_Array *slice,
+                         log_id_t pos, size_t numBlocks)
+{
+   LogFS_VDiskCacheCopy cc = { slice, 0 };
+
+   return LogFS_BlockCacheRead(&ml->blockCache, pos, numBlocks,
+                               LogFS_VDiskCopyFromCache, &cc);
+}
+
+/* Extents that follow each other in the vdisk often follow each other in
+ * the log as well, right after sequential writes or compaction, apart from
+ * the entry heads between them. Rather than reading each extent on its
+ * own, runs of extents that are adjacent on disk, or separated by no more
+ * than ml->readGapBytes, are read with a single IO. The data in the gaps
+ * goes to ml->readGapBuffer and is thrown away. That buffer is virtually
+ * addressed, so reads into machine addressed memory are only merged when
+ * there is no gap. */
+
+#define LOGFS_READ_MERGE_SG 256
+#define LOGFS_READ_MERGE_BYTES (1024 * 1024)
+
+static void
+LogFS_VDiskIssueMergedRead(LogFS_VDiskLookupContext *c)
+{
+   VMK_ReturnStatus status;
+   FDS_Handle *fdsHandleArray[1];
 
-         SG_Array sgArr;
-         SG_SingletonSGArray(&sgArr, offset, (VA) buf, sz*BLKSIZE, SG_VIRT_ADDR);
-         FDS_Handle *fdsHandleArray[1];
-         fdsHandleArray[0] = log->device->fd;
+   Async_Token *childToken;
 
-         status = FDS_AsyncIO(fdsHandleArray, &sgArr, FS_READ_OP, childToken);
+   if (c->merged == NULL) {
+      return;
+   }
+
+   childToken = Async_PrepareOneIO(c->ioh, NULL);
+
+   /* The cache gets filled from the read data, which the SG array says
+    * where to find. */
+
+   if (c->fills != NULL) {
+      c->fills->sg = c->merged;
+      *((LogFS_VDiskCacheFills **)
+        Async_PushCallbackFrame(childToken, LogFS_VDiskCacheFillDone,
+                                sizeof(LogFS_VDiskCacheFills *))) = c->fills;
+   }
+
+   fdsHandleArray[0] = c->vd->log->device->fd;
+   status = FDS_AsyncIO(fdsHandleArray, c->merged, FS_READ_OP, childToken);
+   ASSERT(status == VMK_OK);
+
+   if (c->fills == NULL) {
+      SG_Free(LogFS_GetHeap(), &c->merged);
+   }
+   c->merged = NULL;
+   c->fills = NULL;
+}
+
+/* Read SLICE from the disk, starting at byte OFFSET of it, together with
+ * the extents before it if possible. If POS is given, the data read is
+ * added to the block cache under that log position. */
+
+static void
+LogFS_VDiskMergeRead(LogFS_VDiskLookupContext *c, const SG_Array *slice,
+                     uint64 offset, const log_id_t *pos)
+{
+   LogFS_MetaLog *ml = c->vd->log;
+   uint64 length = SG_TotalLength(slice);
+   uint64 gap = 0;
+   SG_Array *m = c->merged;
+   int k;
+
+   if (m != NULL) {
+      gap = offset - c->mergedEnd;
+
+      if (offset < c->mergedEnd ||
+          (gap > 0 && (gap > ml->readGapBytes ||
+                       m->addrType != SG_VIRT_ADDR)) ||
+          m->length + slice->length + 1 > c->mergedSlots ||
+          offset + length - c->mergedStart > LOGFS_READ_MERGE_BYTES) {
+         LogFS_VDiskIssueMergedRead(c);
+         m = NULL;
+         gap = 0;
+      }
+   }
+
+   if (m == NULL) {
+      c->mergedSlots = MAX(LOGFS_READ_MERGE_SG, slice->length);
+      m = c->merged = SG_Alloc(LogFS_GetHeap(), c->mergedSlots);
+      ASSERT(m);
+      m->addrType = slice->addrType;
+      m->length = 0;
+      c->mergedStart = c->mergedEnd = offset;
+   }
+
+   if (gap > 0) {
+      m->sg[m->length].addr = (VA) ml->readGapBuffer;
+      m->sg[m->length].offset = c->mergedEnd;
+      m->sg[m->length].length = gap;
+      ++(m->length);
+   }
+
+   for (k = 0; k < slice->length; k++) {
+      m->sg[m->length] = slice->sg[k];
+      m->sg[m->length].offset += offset;
+      ++(m->length);
+   }
+
+   if (pos != NULL) {
+      LogFS_VDiskCacheFills *f = c->fills;
+
+      if (f == NULL) {
+         f = c->fills = malloc(sizeof(LogFS_VDiskCacheFills));
+         ASSERT(f);
+         f->ml = ml;
+         f->numFills = 0;
+      }
+      if (f->numFills < LOGFS_READ_MERGE_FILLS) {
+         f->fills[f->numFills].pos = *pos;
+         f->fills[f->numFills].numBlocks = length / BLKSIZE;
+         f->fills[f->numFills].generation =
+            LogFS_BlockCacheGeneration(&ml->blockCache, pos->v.segment);
+         f->fills[f->numFills].from = offset - c->mergedStart;
+         ++(f->numFills);
+      }
+   }
+
+   c->mergedEnd = offset + length;
+}
+
+static VMK_ReturnStatus
+LogFS_VDiskReadSgInt(LogFS_VDisk *vd, Async_Token * token, const SG_Array *dst,
+                     log_block_t blkno, size_t num_blocks, int flags,
+                     Bool readAhead);
+
+/* Read the next SZ blocks of the request, which the rangemap says are at
+ * log position V, or nowhere if V is invalid. */
+
+static void
+LogFS_VDiskReadExtent(LogFS_VDiskLookupContext *c, log_id_t v, size_t sz)
+{
+   VMK_ReturnStatus status;
+   LogFS_VDisk *vd = c->vd;
+   LogFS_MetaLog *log = vd->log;
+   log_block_t i = c->blkno;
+
+   ASSERT(sz > 0);
+   ASSERT(sz <= c->num_blocks);
+
+   /* The part of the caller's buffer these blocks go to */
+   SG_Array *slice = LogFS_VDiskSliceSg(c->sg, (i - c->first) * BLKSIZE,
+                                        sz * BLKSIZE, 0);
+
+   /* never written? */
+   if (is_invalid_version(v)) {
+      void *pd = vd->parentDisk;
+
+      if (pd != NULL) {
+         ASSERT(pd != vd);
+         printf("forwarding read %ld+%ld to parent\n", i, sz);
+         Async_Token *childToken = Async_PrepareOneIO(c->ioh, NULL);
+         status = LogFS_VDiskReadSgInt(pd, childToken, slice, i, sz,
+                                       c->flags, FALSE);
          ASSERT(status == VMK_OK);
+      } else {
+         /* We may need a parent, but not actually have one. In that case,
+          * the read should fail. */
+         if (LogFS_HashIsValid(vd->parentBaseId)) {
+            status = VMK_READ_ERROR;
+         }
+         /* Otherwise, just zero the buffer */
+         else {
+            LogFS_VDiskFillSg(slice, NULL);
+            status = VMK_OK;
+         }
+      }
+   }
+
+   /* data for these blocks is present in the log. */
+   else {
+      LogFS_Log *sublog = LogFS_MetaLogGetLog(log, v.v.segment);
+      log_offset_t position = v.v.blk_offset * BLKSIZE;
 
+      log_offset_t offset = 
+         LogFS_VDiskGetAbsoluteDiskPosition(log, sublog, position);
+
+      LogFS_MetaLogPutLog(log,sublog);
+
+      Bool cacheable = (sz * BLKSIZE <= LOGFS_BLOCK_CACHE_MAX_READ &&
+                        LogFS_BlockCacheEnabled(&log->blockCache));
+
+      /* Read straight into the caller's buffer, in one go with the
+       * extents next to it on disk */
+
+      if (!cacheable || !LogFS_VDiskReadFromCache(log, slice, v, sz)) {
+         LogFS_VDiskMergeRead(c, slice, offset, cacheable ? &v : NULL);
       }
+   }
+
+   SG_Free(LogFS_GetHeap(), &slice);
+
+   c->blkno += sz;
+   c->num_blocks -= sz;
+}
+
+static void
+LogFS_VDiskLookupDone(LogFS_VDiskLookupContext *c)
+{
+   LogFS_VDiskIssueMergedRead(c);
+   Async_EndSplitIO(c->ioh, VMK_OK, FALSE);
+   SG_Free(LogFS_GetHeap(), &c->sg);
+   free(c);
+}
+
+/* Resolve the rest of the request a batch of extents at a time, and read
+ * them. Only when the rangemap cannot answer without blocking do we fall
+ * back to a lookup that calls LogFS_VDiskProcessLookups() later. */
+
+#define LOGFS_LOOKUP_EXTENTS 32
+
+void LogFS_VDiskProcessLookups(range_t range, log_block_t endsat, void *data);
 
-      if (sz < c->num_blocks) {
-         c->blkno += sz;
-         c->num_blocks -= sz;
-         c->buf += sz * BLKSIZE;
+static void
+LogFS_VDiskLookupRange(LogFS_VDiskLookupContext *c)
+{
+   LogFS_BTreeRangeMap *bt = LogFS_VDiskGetVersionsMap(c->vd);
+   LogFS_BTreeRangeExtent extents[LOGFS_LOOKUP_EXTENTS];
+   VMK_ReturnStatus status;
+   int n;
+   int k;
 
-         status = LogFS_BTreeRangeMapAsyncLookup(LogFS_VDiskGetVersionsMap(vd),
-                                                 c->blkno,
+   while (c->num_blocks > 0) {
+      status = LogFS_BTreeRangeMapLookupRange(bt, c->blkno, c->num_blocks,
+                                              extents, LOGFS_LOOKUP_EXTENTS,
+                                              &n);
+
+      if (status != VMK_OK) {
+         range_t range;
+         log_block_t endsat;
+
+         status = LogFS_BTreeRangeMapAsyncLookup(bt, c->blkno,
                                                  LogFS_VDiskProcessLookups, c,
                                                  c->flags, &range, &endsat);
 
-         /* If the lookup gets satisfied immediately we can use the result
-          * right away rather than do the processing in a callback. This
-          * saves us doing tail recursion in the common case. */
+         /* Answered after all, so carry on here */
 
          if (status == VMK_EXISTS) {
+            log_id_t v;
+            v.raw = range.version;
+            if (!is_invalid_version(v)) {
+               v.v.blk_offset += c->blkno - range.from;
+            }
+            LogFS_VDiskReadExtent(c, v, MIN(endsat - c->blkno, c->num_blocks));
             continue;
          }
+
+         ASSERT(status == VMK_OK);
+         return;
       }
 
-      else {
-         Async_EndSplitIO(c->ioh, VMK_OK, FALSE);
-         free(c);
+      for (k = 0; k < n; k++) {
+         ASSERT(extents[k].from == c->blkno);
+         LogFS_VDiskReadExtent(c, extents[k].version,
+                               extents[k].to - extents[k].from);
       }
+   }
 
-      break;
+   LogFS_VDiskLookupDone(c);
+}
+
+/* Completion of a postponed lookup, for the extent at c->blkno */
+
+void LogFS_VDiskProcessLookups(range_t range, log_block_t endsat, void *data)
+{
+   LogFS_VDiskLookupContext *c = (LogFS_VDiskLookupContext *) data;
+
+   log_id_t v;
+   v.raw = range.version;
+   if (!is_invalid_version(v)) {
+      v.v.blk_offset += c->blkno - range.from;
    }
 
+   LogFS_VDiskReadExtent(c, v, MIN(endsat - c->blkno, c->num_blocks));
+   LogFS_VDiskLookupRange(c);
 }
 
 // We are the primary read it from the disk
@@ -1038,11 +2078,23 @@ LogFS_VDiskContinueRead(LogFS_VDisk *vd,
                         const char *buf,
                         log_block_t blkno, size_t num_blocks, int flags)
 {
-   VMK_ReturnStatus status = VMK_OK;
+   SG_Array dst;
 
-   LogFS_BTreeRangeMap *bt;
+   SG_SingletonSGArray(&dst, 0, (VA) buf, num_blocks * BLKSIZE, SG_VIRT_ADDR);
+   return LogFS_VDiskContinueReadSg(vd, token, &dst, blkno, num_blocks, flags);
+}
+
+/* Read NUM_BLOCKS blocks into the memory described by DST, which may be
+ * machine addressed. Each extent found in the log is read from the disk
+ * straight into its part of DST. */
 
-   bt = LogFS_VDiskGetVersionsMap(vd);
+VMK_ReturnStatus
+LogFS_VDiskContinueReadSg(LogFS_VDisk *vd,
+                          Async_Token * token,
+                          const SG_Array *dst,
+                          log_block_t blkno, size_t num_blocks, int flags)
+{
+   VMK_ReturnStatus status = VMK_OK;
 
    LogFS_VDiskLookupContext *c = malloc(sizeof(LogFS_VDiskLookupContext));
    c->end = blkno + num_blocks;
@@ -1060,22 +2112,351 @@ LogFS_VDiskContinueRead(LogFS_VDisk *vd,
    c->vd = vd;
    c->blkno = blkno;
    c->num_blocks = num_blocks;
-   c->buf = (char *)buf;
-   c->depth = 0;
+   c->sg = LogFS_VDiskSliceSg(dst, 0, num_blocks * BLKSIZE, 0);
+   c->first = blkno;
+   c->merged = NULL;
+   c->fills = NULL;
 
-   status = LogFS_BTreeRangeMapAsyncLookup(bt, blkno,
-         LogFS_VDiskProcessLookups, c,
-         c->flags, NULL, NULL);
+   LogFS_VDiskLookupRange(c);
 
-   ASSERT(status == VMK_OK);
    return status;
 }
 
+/* Sequential readahead. Data that is logically sequential tends to be
+ * scattered over the log, so a guest streaming through a vdisk, as in a boot
+ * or a backup, would otherwise wait for every extent in turn. Reads that
+ * continue where an earlier read left off are tracked as streams, and the
+ * blocks following a stream are fetched ahead of time, through the normal
+ * rangemap lookups, into a few buffers owned by the vdisk. Reads that fall
+ * entirely within a fetched buffer are served from memory.
+ *
+ * A stream starts out fetching LOGFS_RA_MIN_BLOCKS at a time. The window
+ * doubles, up to ml->readAheadBytes, whenever a read catches up with the
+ * newest buffer of its stream, and halves when a buffer gets recycled with
+ * most of it unread. Writes drop the buffers they overlap, including those
+ * still being fetched. vd->lock protects all of this. */
+
+#define LOGFS_RA_STREAMS 4
+#define LOGFS_RA_BUFFERS 8
+#define LOGFS_RA_MIN_BLOCKS 64
+
+typedef enum {
+   LogFS_RABufferEmpty = 0,
+   LogFS_RABufferLoading,
+   LogFS_RABufferValid,
+} LogFS_VDiskRABufferState;
+
+typedef struct {
+   log_block_t next;            /* where the stream should continue */
+   log_block_t fetched;         /* end of what has been fetched for it */
+   uint32 window;               /* blocks per fetch */
+   uint32 id;
+   uint64 lastUsed;
+} LogFS_VDiskRAStream;
+
+typedef struct {
+   LogFS_VDiskRABufferState state;
+   Bool stale;                  /* overwritten while loading */
+   int users;                   /* reads copying out of it */
+   log_block_t blkno;
+   uint32 numBlocks;
+   uint32 hitBlocks;
+   int stream;
+   uint32 streamId;
+   uint64 lastUsed;
+   char *data;
+} LogFS_VDiskRABuffer;
+
+typedef struct LogFS_VDiskReadAhead {
+   LogFS_VDiskRAStream streams[LOGFS_RA_STREAMS];
+   LogFS_VDiskRABuffer buffers[LOGFS_RA_BUFFERS];
+   uint64 clock;
+   uint32 streamIds;
+
+   /* Stats */
+   uint64 hits;
+   uint64 fetchedBlocks;
+   uint64 wastedBlocks;
+} LogFS_VDiskReadAhead;
+
+typedef struct {
+   LogFS_VDisk *vd;
+   LogFS_VDiskRABuffer *b;
+} LogFS_VDiskRAContext;
+
+/* Done with the contents of buffer B. Called with vd->lock held. */
+
+static void
+LogFS_VDiskRARetire(LogFS_VDiskReadAhead *ra, LogFS_VDiskRABuffer *b)
+{
+   LogFS_VDiskRAStream *s = &ra->streams[b->stream];
+
+   if (s->id == b->streamId && b->hitBlocks < b->numBlocks / 4) {
+      s->window = MAX(s->window / 2, LOGFS_RA_MIN_BLOCKS);
+   }
+   ra->wastedBlocks += b->numBlocks - MIN(b->hitBlocks, b->numBlocks);
+   b->state = LogFS_RABufferEmpty;
+}
+
+/* Drop what has been fetched of blocks FROM to TO, as they are about to
+ * change. Called with vd->lock held. */
+
+static void
+LogFS_VDiskReadAheadInvalidate(LogFS_VDisk *vd, log_block_t from,
+                               log_block_t to)
+{
+   LogFS_VDiskReadAhead *ra = vd->readAhead;
+   int i;
+
+   if (ra == NULL) {
+      return;
+   }
+
+   for (i = 0; i < LOGFS_RA_BUFFERS; i++) {
+      LogFS_VDiskRABuffer *b = &ra->buffers[i];
+
+      if (b->state == LogFS_RABufferEmpty ||
+          b->blkno >= to || b->blkno + b->numBlocks <= from) {
+         continue;
+      }
+      if (b->state == LogFS_RABufferLoading) {
+         b->stale = TRUE;
+      } else {
+         LogFS_VDiskRARetire(ra, b);
+      }
+   }
+}
+
+/* Serve the read from a fetched buffer, if one holds all of it. Returns
+ * FALSE if the read has to go to the log. */
+
+static Bool
+LogFS_VDiskReadCached(LogFS_VDisk *vd, Async_Token * token,
+                      const SG_Array *dst, log_block_t blkno,
+                      size_t num_blocks)
+{
+   LogFS_VDiskReadAhead *ra;
+   LogFS_VDiskRABuffer *b = NULL;
+   Async_IOHandle *ioh;
+   int i;
+
+   SP_Lock(&vd->lock);
+   ra = vd->readAhead;
+   for (i = 0; ra != NULL && i < LOGFS_RA_BUFFERS; i++) {
+      b = &ra->buffers[i];
+      if (b->state == LogFS_RABufferValid && b->blkno <= blkno &&
+          blkno + num_blocks <= b->blkno + b->numBlocks) {
+         break;
+      }
+   }
+   if (ra == NULL || i == LOGFS_RA_BUFFERS) {
+      SP_Unlock(&vd->lock);
+      return FALSE;
+   }
+
+   LogFS_VDiskRAStream *s = &ra->streams[b->stream];
+
+   /* The stream caught up with what has been fetched for it, so it has to
+    * fetch further ahead to hide the latency */
+
+   if (s->id == b->streamId && s->fetched == b->blkno + b->numBlocks &&
+       b->hitBlocks == 0) {
+      s->window = MIN(2 * s->window, vd->log->readAheadBytes / BLKSIZE);
+   }
+
+   ++(b->users);
+   b->hitBlocks += num_blocks;
+   b->lastUsed = ++(ra->clock);
+   ++(ra->hits);
+   SP_Unlock(&vd->lock);
+
+   LogFS_VDiskFillSg(dst, b->data + (blkno - b->blkno) * BLKSIZE);
+
+   SP_Lock(&vd->lock);
+   --(b->users);
+   SP_Unlock(&vd->lock);
+
+   Async_StartSplitIO(token, Async_DefaultChildDoneFn, 0, &ioh);
+   Async_EndSplitIO(ioh, VMK_OK, FALSE);
+   return TRUE;
+}
+
+static void
+LogFS_VDiskReadAheadDone(Async_Token * token, void *data)
+{
+   LogFS_VDiskRAContext *c = data;
+   LogFS_VDisk *vd = c->vd;
+   LogFS_VDiskRABuffer *b = c->b;
+
+   SP_Lock(&vd->lock);
+   if (token->transientStatus == VMK_OK && !b->stale) {
+      b->state = LogFS_RABufferValid;
+   } else {
+      b->state = LogFS_RABufferEmpty;
+   }
+   SP_Unlock(&vd->lock);
+
+   LogFS_VDiskDeref(vd);
+
+   Async_TokenCallback(token);
+   Async_ReleaseToken(token);
+}
+
+/* Note a read of NUM_BLOCKS at BLKNO, and fetch ahead if it continues a
+ * stream. */
+
+static void
+LogFS_VDiskReadAhead(LogFS_VDisk *vd, log_block_t blkno, size_t num_blocks,
+                     int flags)
+{
+   LogFS_MetaLog *ml = vd->log;
+   uint32 maxBlocks = ml->readAheadBytes / BLKSIZE;
+   log_block_t capacity = LogFS_VDiskGetCapacity(vd) / BLKSIZE;
+   LogFS_VDiskReadAhead *ra;
+   LogFS_VDiskRAStream *s = NULL;
+   LogFS_VDiskRABuffer *b = NULL;
+   LogFS_VDiskRAContext *c;
+   Async_Token *token;
+   SG_Array sg;
+   char *old;
+   int i;
+
+   if (maxBlocks < LOGFS_RA_MIN_BLOCKS) {
+      return;
+   }
+
+   SP_Lock(&vd->lock);
+
+   if (vd->readAhead == NULL) {
+      vd->readAhead = malloc(sizeof(LogFS_VDiskReadAhead));
+      ASSERT(vd->readAhead);
+   }
+   ra = vd->readAhead;
+   ++(ra->clock);
+
+   for (i = 0; i < LOGFS_RA_STREAMS; i++) {
+      if (ra->streams[i].window != 0 && ra->streams[i].next == blkno) {
+         s = &ra->streams[i];
+         break;
+      }
+   }
+
+   /* Not sequential, but it may be the start of a new stream */
+
+   if (s == NULL) {
+      s = &ra->streams[0];
+      for (i = 1; i < LOGFS_RA_STREAMS; i++) {
+         if (ra->streams[i].lastUsed < s->lastUsed) {
+            s = &ra->streams[i];
+         }
+      }
+      s->next = s->fetched = blkno + num_blocks;
+      s->window = LOGFS_RA_MIN_BLOCKS;
+      s->id = ++(ra->streamIds);
+      s->lastUsed = ra->clock;
+      SP_Unlock(&vd->lock);
+      return;
+   }
+
+   s->next = blkno + num_blocks;
+   s->fetched = MAX(s->fetched, s->next);
+   s->window = MIN(s->window, maxBlocks);
+   s->lastUsed = ra->clock;
+
+   /* Fetch the next window once half of the current one has been read */
+
+   if (s->fetched - s->next > s->window / 2 || s->fetched >= capacity) {
+      SP_Unlock(&vd->lock);
+      return;
+   }
+
+   for (i = 0; i < LOGFS_RA_BUFFERS; i++) {
+      LogFS_VDiskRABuffer *p = &ra->buffers[i];
+
+      if (p->state == LogFS_RABufferLoading || p->users > 0) {
+         continue;
+      }
+      if (b == NULL || p->state == LogFS_RABufferEmpty ||
+          (b->state != LogFS_RABufferEmpty && p->lastUsed < b->lastUsed)) {
+         b = p;
+      }
+      if (b->state == LogFS_RABufferEmpty) {
+         break;
+      }
+   }
+   if (b == NULL) {
+      SP_Unlock(&vd->lock);
+      return;
+   }
+   if (b->state == LogFS_RABufferValid) {
+      LogFS_VDiskRARetire(ra, b);
+   }
+
+   old = b->data;
+   b->data = NULL;
+   b->state = LogFS_RABufferLoading;
+   b->stale = FALSE;
+   b->blkno = s->fetched;
+   b->numBlocks = MIN(s->window, capacity - s->fetched);
+   b->hitBlocks = 0;
+   b->stream = s - ra->streams;
+   b->streamId = s->id;
+   b->lastUsed = ra->clock;
+
+   s->fetched += b->numBlocks;
+   ra->fetchedBlocks += b->numBlocks;
+
+   LogFS_VDiskRef(vd);
+   SP_Unlock(&vd->lock);
+
+   /* Nobody looks at the data of a buffer that is loading */
+
+   aligned_free(old);
+   b->data = aligned_malloc(b->numBlocks * BLKSIZE);
+   ASSERT(b->data);
+
+   token = Async_AllocToken(0);
+   c = Async_PushCallbackFrame(token, LogFS_VDiskReadAheadDone,
+                               sizeof(LogFS_VDiskRAContext));
+   c->vd = vd;
+   c->b = b;
+
+   SG_SingletonSGArray(&sg, 0, (VA) b->data, b->numBlocks * BLKSIZE,
+                       SG_VIRT_ADDR);
+   LogFS_VDiskContinueReadSg(vd, token, &sg, b->blkno, b->numBlocks, flags);
+}
+
 
 VMK_ReturnStatus LogFS_VDiskRead(LogFS_VDisk *vd,
                                  Async_Token * token,
                                  char *buf, log_block_t blkno,
                                  size_t num_blocks, int flags)
+{
+   SG_Array dst;
+
+   SG_SingletonSGArray(&dst, 0, (VA) buf, num_blocks * BLKSIZE, SG_VIRT_ADDR);
+   return LogFS_VDiskReadSg(vd, token, &dst, blkno, num_blocks, flags);
+}
+
+/* Like LogFS_VDiskRead(), but into the memory described by DST, which may be
+ * machine addressed and need only stay valid until TOKEN completes. */
+
+VMK_ReturnStatus LogFS_VDiskReadSg(LogFS_VDisk *vd,
+                                   Async_Token * token,
+                                   const SG_Array *dst, log_block_t blkno,
+                                   size_t num_blocks, int flags)
+{
+   return LogFS_VDiskReadSgInt(vd, token, dst, blkno, num_blocks, flags,
+                               TRUE);
+}
+
+/* Reads forwarded to a parent disk do not drive its readahead, the child
+ * already does that. */
+
+static VMK_ReturnStatus
+LogFS_VDiskReadSgInt(LogFS_VDisk *vd, Async_Token * token, const SG_Array *dst,
+                     log_block_t blkno, size_t num_blocks, int flags,
+                     Bool readAhead)
 {
    VMK_ReturnStatus status = VMK_OK;
 
@@ -1083,7 +2464,8 @@ VMK_ReturnStatus LogFS_VDiskRead(LogFS_VDisk *vd,
 
    SP_Lock(&vd->lock);
 
-   if (vd->isImmutable || LogFS_VDiskIsWritable(vd)) {
+   if (vd->isImmutable || LogFS_VDiskIsWritable(vd) ||
+       LogFS_VDiskIsCurrentLocked(vd)) {
       /* We cannot hold vd->lock during normal read, as it may recurse into a
        * parent vd, and cause a lock rank violation. On the other hand we
        * don't want anyone stealing the secret write token, so we need to 
@@ -1092,8 +2474,16 @@ VMK_ReturnStatus LogFS_VDiskRead(LogFS_VDisk *vd,
       LogFS_VDiskRef(vd);
       SP_Unlock(&vd->lock);
 
-      status =
-          LogFS_VDiskContinueRead(vd, token, buf, blkno, num_blocks, flags);
+      if (!readAhead) {
+         status = LogFS_VDiskContinueReadSg(vd, token, dst, blkno,
+                                            num_blocks, flags);
+      } else {
+         if (!LogFS_VDiskReadCached(vd, token, dst, blkno, num_blocks)) {
+            status = LogFS_VDiskContinueReadSg(vd, token, dst, blkno,
+                                               num_blocks, flags);
+         }
+         LogFS_VDiskReadAhead(vd, blkno, num_blocks, flags);
+      }
 
       LogFS_VDiskDeref(vd);
       
@@ -1102,10 +2492,26 @@ VMK_ReturnStatus LogFS_VDiskRead(LogFS_VDisk *vd,
    } else {
       if ((flags & FS_SKIPZERO) == 0) {
          Hash inv;
+         char *buf;
 
          LogFS_HashClear(&inv);
          Hash id = LogFS_HashIsValid(vd->secretView) ? vd->parent : inv;
 
+         /* The HTTP client reads into one flat buffer, so unless that is
+          * what we were given, bounce the data through one */
+
+         if (dst->addrType == SG_VIRT_ADDR && dst->length == 1) {
+            buf = (char *)(VA) dst->sg[0].addr;
+         } else {
+            LogFS_VDiskBounceContext *b =
+               Async_PushCallbackFrame(token, LogFS_VDiskBounceDone,
+                                       sizeof(LogFS_VDiskBounceContext));
+            buf = aligned_malloc(num_blocks * BLKSIZE);
+            ASSERT(buf);
+            b->buf = buf;
+            b->sg = LogFS_VDiskSliceSg(dst, 0, num_blocks * BLKSIZE, 0);
+         }
+
          status = LogFS_HttpClientRequest(vd->disk, id,
                                           token, buf, blkno, num_blocks,
                                           flags & FS_READ_OP);
@@ -1124,6 +2530,66 @@ Bool LogFS_VDiskIsWritable(LogFS_VDisk *vd)
          && (!vd->stopRequested || vd->haveReservation));
 }
 
+/* Whether a replica may read from its own log rather than from the
+ * primary: the primary granted us a read lease that has not run out, and
+ * every update received since is in the rangemap. vd->lock must be held. */
+
+static Bool LogFS_VDiskIsCurrentLocked(LogFS_VDisk *vd)
+{
+   if (vd->leaseMS == 0 || vd->appliedLsn != vd->lsn) {
+      return FALSE;
+   }
+   if (Timer_AbsTCToUS(Timer_GetCycles() - vd->leaseCycles) >=
+       vd->leaseMS * 1000ULL) {
+      vd->leaseMS = 0;
+      return FALSE;
+   }
+
+   ++(vd->localReads);
+   return TRUE;
+}
+
+/* The primary answered a read by telling us to use our own copy of version
+ * ID, and granted a lease of MS to keep doing so. The lease is counted from
+ * STARTCYCLES, when we sent the request, so that it ends here before the
+ * primary stops holding back writes for it. See logfsHttpClient.c */
+
+void LogFS_VDiskSetLease(LogFS_VDisk *vd, Hash id, uint64 startCycles,
+                         uint32 ms)
+{
+   SP_Lock(&vd->lock);
+
+   /* Unless newer updates came in meanwhile, ID is the primary's latest */
+   if (LogFS_HashEquals(vd->parent, id)) {
+      vd->leaseCycles = startCycles;
+      vd->leaseMS = ms;
+   }
+
+   SP_Unlock(&vd->lock);
+}
+
+/* On the primary, let a replica that has version ID serve reads from its
+ * own copy for the returned number of ms, or 0 for no lease. Writes are not
+ * acknowledged until the lease ends, and no lease is granted while writes
+ * are held back for an earlier one, so writes cannot starve. */
+
+uint32 LogFS_VDiskGrantLease(LogFS_VDisk *vd, Hash id)
+{
+   uint32 ms = 0;
+
+   SP_Lock(&vd->lock);
+
+   if (vd->log->localReadMS != 0 && vd->heldWrites == 0 &&
+       LogFS_HashEquals(vd->parent, id)) {
+      ms = vd->log->localReadMS;
+      vd->grantCycles = Timer_GetCycles();
+      vd->grantMS = ms;
+   }
+
+   SP_Unlock(&vd->lock);
+   return ms;
+}
+
 static void
 LogFS_VDiskCommonInit(LogFS_VDisk *vd,
                       LogFS_VDisk *parentDisk, Hash disk, LogFS_MetaLog *log)
@@ -1169,6 +2635,13 @@ void LogFS_VDiskInit(LogFS_VDisk *vd, LogFS_VDisk *parentDisk, Hash diskId,
 
 void LogFS_VDiskCleanup(LogFS_VDisk *vd)
 {
+   if (vd->readAhead != NULL) {
+      int i;
+      for (i = 0; i < LOGFS_RA_BUFFERS; i++) {
+         aligned_free(vd->readAhead->buffers[i].data);
+      }
+      free(vd->readAhead);
+   }
    if(vd->bt != NULL) {
       LogFS_BTreeRangeMapCleanup(vd->bt);
       free(vd->bt);
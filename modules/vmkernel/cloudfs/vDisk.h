@@ -52,6 +52,20 @@ typedef struct LogFS_VDisk {
 
    uint64 lsn;
 
+   /* When not the primary copy: updates up to appliedLsn are in the
+    * rangemap, and the primary granted a read lease of leaseMS, counted
+    * from leaseCycles. See LogFS_VDiskIsCurrentLocked(). */
+   uint64 appliedLsn;
+   uint64 leaseCycles;
+   uint32 leaseMS;
+   uint64 localReads;
+
+   /* When the primary copy: the last lease granted to a replica, and the
+    * number of write acknowledgements held back until it ends. */
+   uint64 grantCycles;
+   uint32 grantMS;
+   uint32 heldWrites;
+
    LogFS_MetaLog *log;
    List_Links remoteLogs;
 
@@ -66,6 +80,16 @@ typedef struct LogFS_VDisk {
    LogFS_BTreeRangeMap *bt;
 
    SP_SpinLock lock;
+
+   /* Small-write coalescing, see LogFS_VDiskStageWrite() */
+   struct LogFS_VDiskStage *stage;
+   int writesInFlight;
+   uint64 stagedWrites;
+   uint64 stagedEntries;
+
+   /* Sequential readahead, see LogFS_VDiskReadAhead() */
+   struct LogFS_VDiskReadAhead *readAhead;
+
    List_Links closeWaiters;
    List_Links tokenWaiters;
    List_Links openWaiters;
@@ -102,8 +126,14 @@ Hash LogFS_VDiskGetParentDiskId(void *vd);
 VMK_ReturnStatus LogFS_VDiskWrite(LogFS_VDisk *vd, Async_Token *,
                                   const char *buf, log_block_t blkno,
                                   size_t num_blocks, int flags);
+VMK_ReturnStatus LogFS_VDiskWriteSg(LogFS_VDisk *vd, Async_Token *,
+                                    const SG_Array *src, log_block_t blkno,
+                                    size_t num_blocks, int flags);
 VMK_ReturnStatus LogFS_VDiskSetSecret(LogFS_VDisk *vd, Hash secret,
                                       Hash secretView);
+void LogFS_VDiskSetLease(LogFS_VDisk *vd, Hash id, uint64 startCycles,
+                         uint32 ms);
+uint32 LogFS_VDiskGrantLease(LogFS_VDisk *vd, Hash id);
 VMK_ReturnStatus LogFS_VDiskGetSecret(LogFS_VDisk *vd, Hash * secret,
                                       Bool failIfBusy);
 VMK_ReturnStatus LogFS_VDiskAppend(LogFS_VDisk *vd, Async_Token *,
@@ -111,12 +141,25 @@ VMK_ReturnStatus LogFS_VDiskAppend(LogFS_VDisk *vd, Async_Token *,
 VMK_ReturnStatus LogFS_VDiskRead(LogFS_VDisk *vd, Async_Token * token,
                                  char *buf, log_block_t blkno,
                                  size_t num_blocks, int flags);
+VMK_ReturnStatus LogFS_VDiskReadSg(LogFS_VDisk *vd, Async_Token * token,
+                                   const SG_Array *dst, log_block_t blkno,
+                                   size_t num_blocks, int flags);
+VMK_ReturnStatus LogFS_VDiskContinueReadSg(LogFS_VDisk *vd,
+                                           Async_Token * token,
+                                           const SG_Array *dst,
+                                           log_block_t blkno,
+                                           size_t num_blocks, int flags);
 VMK_ReturnStatus LogFS_VDiskContinueRead(LogFS_VDisk *vd, Async_Token * token,
                                          const char *buf, log_block_t blkno,
                                          size_t num_blocks, int flags);
 VMK_ReturnStatus LogFS_VDiskContinueWrite(LogFS_VDisk *vd, Async_Token * token,
                                           const char *buf, log_block_t blkno,
                                           size_t num_blocks, int flags);
+VMK_ReturnStatus LogFS_VDiskContinueWriteSg(LogFS_VDisk *vd,
+                                            Async_Token * token,
+                                            const SG_Array *src,
+                                            log_block_t blkno,
+                                            size_t num_blocks, int flags);
 LogFS_BTreeRangeMap *LogFS_VDiskGetVersionsMap(LogFS_VDisk *vd);
 
 static inline void